@@ -19,6 +19,15 @@
 	method fails for finding the largest eigenvector	*/
 #define USE_COV_MAT	1
 
+/*	the block encoders have SSE2 versions giving the same bytes, used
+	unless the reference encoders are asked for.  Define DXT_NO_SIMD
+	to leave them out	*/
+#if !defined( DXT_NO_SIMD ) && ( defined( __SSE2__ ) || defined( _M_X64 ) || \
+	( defined( _M_IX86_FP ) && ( _M_IX86_FP >= 2 ) ) )
+#define DXT_SIMD	1
+#include <emmintrin.h>
+#endif
+
 /********* Function Prototypes *********/
 /*
 	Takes a 4x4 block of pixels and compresses it into 8 bytes
@@ -37,6 +46,20 @@ void compress_DDS_color_block(
 void compress_DDS_alpha_block(
 				const unsigned char *const uncompressed,
 				unsigned char compressed[8] );
+#if DXT_SIMD
+/*
+	The same two, 4 pixels at a time.  The covariance sums
+	are exact integers and the dot products are multiplied and
+	added in the same order, so they give the same bytes.
+*/
+static void compress_DDS_color_block_SIMD(
+				int channels,
+				const unsigned char *const uncompressed,
+				unsigned char compressed[8] );
+static void compress_DDS_alpha_block_SIMD(
+				const unsigned char *const uncompressed,
+				unsigned char compressed[8] );
+#endif
 
 /********* Actual Exposed Functions *********/
 int
@@ -104,11 +127,6 @@ unsigned char* convert_image_to_DXT1(
 		int *out_size )
 {
 	unsigned char *compressed;
-	int i, j, x, y;
-	unsigned char ublock[16*3];
-	unsigned char cblock[8];
-	int index = 0, chan_step = 1;
-	int block_count = 0;
 	/*	error check	*/
 	*out_size = 0;
 	if( (width < 1) || (height < 1) ||
@@ -117,17 +135,47 @@ unsigned char* convert_image_to_DXT1(
 	{
 		return NULL;
 	}
+	/*	get the RAM for the compressed image
+		(8 bytes per 4x4 pixel block)	*/
+	*out_size = ((width+3) >> 2) * ((height+3) >> 2) * 8;
+	compressed = (unsigned char*)malloc( *out_size );
+	/*	all the rows of blocks	*/
+	convert_image_to_DXT1_rows( uncompressed, width, height, channels,
+			0, (height+3) >> 2, 0, compressed );
+	return compressed;
+}
+
+void convert_image_to_DXT1_rows(
+		const unsigned char *const uncompressed,
+		int width, int height, int channels,
+		int first_row, int rows, int reference,
+		unsigned char *compressed )
+{
+	int i, j, x, y;
+	unsigned char ublock[16*3];
+	unsigned char cblock[8];
+	int index, last, chan_step = 1;
+	/*	error check	*/
+	if( (width < 1) || (height < 1) ||
+		(NULL == uncompressed) || (NULL == compressed) ||
+		(channels < 1) || (channels > 4) )
+	{
+		return;
+	}
 	/*	for channels == 1 or 2, I do not step forward for R,G,B values	*/
 	if( channels < 3 )
 	{
 		chan_step = 0;
 	}
-	/*	get the RAM for the compressed image
-		(8 bytes per 4x4 pixel block)	*/
-	*out_size = ((width+3) >> 2) * ((height+3) >> 2) * 8;
-	compressed = (unsigned char*)malloc( *out_size );
+	/*	the blocks of the rows, and where they go	*/
+	index = first_row * ((width+3) >> 2) * 8;
+	last = (first_row + rows) * 4;
+	if( last > height )
+	{
+		last = height;
+	}
 	/*	go through each block	*/
-	for( j = 0; j < height; j += 4 )
+	for( j = first_row * 4; j < last; j += 4 )
 	{
 		for( i = 0; i < width; i += 4 )
 		{
@@ -144,11 +192,12 @@ unsigned char* convert_image_to_DXT1(
 			}
 			for( y = 0; y < my; ++y )
 			{
+				const unsigned char *row = uncompressed + ((j+y)*width+i)*channels;
 				for( x = 0; x < mx; ++x )
 				{
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels];
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels+chan_step];
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels+chan_step+chan_step];
+					ublock[idx++] = row[x*channels];
+					ublock[idx++] = row[x*channels+chan_step];
+					ublock[idx++] = row[x*channels+chan_step+chan_step];
 				}
 				for( x = mx; x < 4; ++x )
 				{
@@ -167,8 +216,15 @@ unsigned char* convert_image_to_DXT1(
 				}
 			}
 			/*	compress the block	*/
-			++block_count;
-			compress_DDS_color_block( 3, ublock, cblock );
+			#if DXT_SIMD
+			if( !reference )
+			{
+				compress_DDS_color_block_SIMD( 3, ublock, cblock );
+			} else
+			#endif
+			{
+				compress_DDS_color_block( 3, ublock, cblock );
+			}
 			/*	copy the data from the block into the main block	*/
 			for( x = 0; x < 8; ++x )
 			{
@@ -176,7 +232,6 @@ unsigned char* convert_image_to_DXT1(
 			}
 		}
 	}
-	return compressed;
 }
 
 unsigned char* convert_image_to_DXT5(
@@ -185,11 +240,6 @@ unsigned char* convert_image_to_DXT5(
 		int *out_size )
 {
 	unsigned char *compressed;
-	int i, j, x, y;
-	unsigned char ublock[16*4];
-	unsigned char cblock[8];
-	int index = 0, chan_step = 1;
-	int block_count = 0, has_alpha;
 	/*	error check	*/
 	*out_size = 0;
 	if( (width < 1) || (height < 1) ||
@@ -198,6 +248,34 @@ unsigned char* convert_image_to_DXT5(
 	{
 		return NULL;
 	}
+	/*	get the RAM for the compressed image
+		(16 bytes per 4x4 pixel block)	*/
+	*out_size = ((width+3) >> 2) * ((height+3) >> 2) * 16;
+	compressed = (unsigned char*)malloc( *out_size );
+	/*	all the rows of blocks	*/
+	convert_image_to_DXT5_rows( uncompressed, width, height, channels,
+			0, (height+3) >> 2, 0, compressed );
+	return compressed;
+}
+
+void convert_image_to_DXT5_rows(
+		const unsigned char *const uncompressed,
+		int width, int height, int channels,
+		int first_row, int rows, int reference,
+		unsigned char *compressed )
+{
+	int i, j, x, y;
+	unsigned char ublock[16*4];
+	unsigned char cblock[8];
+	int index, last, chan_step = 1;
+	int has_alpha;
+	/*	error check	*/
+	if( (width < 1) || (height < 1) ||
+		(NULL == uncompressed) || (NULL == compressed) ||
+		(channels < 1) || ( channels > 4) )
+	{
+		return;
+	}
 	/*	for channels == 1 or 2, I do not step forward for R,G,B vales	*/
 	if( channels < 3 )
 	{
@@ -205,12 +283,15 @@ unsigned char* convert_image_to_DXT5(
 	}
 	/*	# channels = 1 or 3 have no alpha, 2 & 4 do have alpha	*/
 	has_alpha = 1 - (channels & 1);
-	/*	get the RAM for the compressed image
-		(16 bytes per 4x4 pixel block)	*/
-	*out_size = ((width+3) >> 2) * ((height+3) >> 2) * 16;
-	compressed = (unsigned char*)malloc( *out_size );
+	/*	the blocks of the rows, and where they go	*/
+	index = first_row * ((width+3) >> 2) * 16;
+	last = (first_row + rows) * 4;
+	if( last > height )
+	{
+		last = height;
+	}
 	/*	go through each block	*/
-	for( j = 0; j < height; j += 4 )
+	for( j = first_row * 4; j < last; j += 4 )
 	{
 		for( i = 0; i < width; i += 4 )
 		{
@@ -227,13 +308,14 @@ unsigned char* convert_image_to_DXT5(
 			}
 			for( y = 0; y < my; ++y )
 			{
+				const unsigned char *row = uncompressed + ((j+y)*width+i)*channels;
 				for( x = 0; x < mx; ++x )
 				{
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels];
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels+chan_step];
-					ublock[idx++] = uncompressed[(j+y)*width*channels+(i+x)*channels+chan_step+chan_step];
+					ublock[idx++] = row[x*channels];
+					ublock[idx++] = row[x*channels+chan_step];
+					ublock[idx++] = row[x*channels+chan_step+chan_step];
 					ublock[idx++] =
-						has_alpha * uncompressed[(j+y)*width*channels+(i+x)*channels+channels-1]
+						has_alpha * row[x*channels+channels-1]
 						+ (1-has_alpha)*255;
 				}
 				for( x = mx; x < 4; ++x )
@@ -255,15 +337,30 @@ unsigned char* convert_image_to_DXT5(
 				}
 			}
 			/*	now compress the alpha block	*/
-			compress_DDS_alpha_block( ublock, cblock );
+			#if DXT_SIMD
+			if( !reference )
+			{
+				compress_DDS_alpha_block_SIMD( ublock, cblock );
+			} else
+			#endif
+			{
+				compress_DDS_alpha_block( ublock, cblock );
+			}
 			/*	copy the data from the compressed alpha block into the main buffer	*/
 			for( x = 0; x < 8; ++x )
 			{
 				compressed[index++] = cblock[x];
 			}
 			/*	then compress the color block	*/
-			++block_count;
-			compress_DDS_color_block( 4, ublock, cblock );
+			#if DXT_SIMD
+			if( !reference )
+			{
+				compress_DDS_color_block_SIMD( 4, ublock, cblock );
+			} else
+			#endif
+			{
+				compress_DDS_color_block( 4, ublock, cblock );
+			}
 			/*	copy the data from the compressed color block into the main buffer	*/
 			for( x = 0; x < 8; ++x )
 			{
@@ -271,7 +368,6 @@ unsigned char* convert_image_to_DXT5(
 			}
 		}
 	}
-	return compressed;
 }
 
 /********* Helper Functions *********/
@@ -296,30 +392,15 @@ void rgb_888_from_565( unsigned int c, int *r, int *g, int *b )
 	*b = convert_bit_range( (c >> 00) & 31, 5, 8 );
 }
 
-void compute_color_line_STDEV(
-		const unsigned char *const uncompressed,
-		int channels,
+/*	the color line of a block from the sums of its colors and of
+	their products (what compute_color_line_STDEV adds up)	*/
+static void color_line_from_sums(
+		float sum_r, float sum_g, float sum_b,
+		float sum_rr, float sum_gg, float sum_bb,
+		float sum_rg, float sum_rb, float sum_gb,
 		float point[3], float direction[3] )
 {
 	const float inv_16 = 1.0f / 16.0f;
-	int i;
-	float sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f;
-	float sum_rr = 0.0f, sum_gg = 0.0f, sum_bb = 0.0f;
-	float sum_rg = 0.0f, sum_rb = 0.0f, sum_gb = 0.0f;
-	/*	calculate all data needed for the covariance matrix
-		( to compare with _rygdxt code)	*/
-	for( i = 0; i < 16*channels; i += channels )
-	{
-		sum_r += uncompressed[i+0];
-		sum_rr += uncompressed[i+0] * uncompressed[i+0];
-		sum_g += uncompressed[i+1];
-		sum_gg += uncompressed[i+1] * uncompressed[i+1];
-		sum_b += uncompressed[i+2];
-		sum_bb += uncompressed[i+2] * uncompressed[i+2];
-		sum_rg += uncompressed[i+0] * uncompressed[i+1];
-		sum_rb += uncompressed[i+0] * uncompressed[i+2];
-		sum_gb += uncompressed[i+1] * uncompressed[i+2];
-	}
 	/*	convert the sums to averages	*/
 	sum_r *= inv_16;
 	sum_g *= inv_16;
@@ -408,52 +489,47 @@ void compute_color_line_STDEV(
 	#endif
 }
 
-void LSE_master_colors_max_min(
-		int *cmax, int *cmin,
+void compute_color_line_STDEV(
+		const unsigned char *const uncompressed,
 		int channels,
-		const unsigned char *const uncompressed )
+		float point[3], float direction[3] )
+{
+	int i;
+	float sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f;
+	float sum_rr = 0.0f, sum_gg = 0.0f, sum_bb = 0.0f;
+	float sum_rg = 0.0f, sum_rb = 0.0f, sum_gb = 0.0f;
+	/*	calculate all data needed for the covariance matrix
+		( to compare with _rygdxt code)	*/
+	for( i = 0; i < 16*channels; i += channels )
+	{
+		sum_r += uncompressed[i+0];
+		sum_rr += uncompressed[i+0] * uncompressed[i+0];
+		sum_g += uncompressed[i+1];
+		sum_gg += uncompressed[i+1] * uncompressed[i+1];
+		sum_b += uncompressed[i+2];
+		sum_bb += uncompressed[i+2] * uncompressed[i+2];
+		sum_rg += uncompressed[i+0] * uncompressed[i+1];
+		sum_rb += uncompressed[i+0] * uncompressed[i+2];
+		sum_gb += uncompressed[i+1] * uncompressed[i+2];
+	}
+	color_line_from_sums( sum_r, sum_g, sum_b, sum_rr, sum_gg, sum_bb,
+			sum_rg, sum_rb, sum_gb, point, direction );
+}
+
+/*	the master colors of a block from its color line (point sum_x,
+	direction sum_x2) and the extent of its colors along it	*/
+static void master_colors_from_line(
+		int *cmax, int *cmin,
+		const float sum_x[3], const float sum_x2[3],
+		float dot_min, float dot_max )
 {
 	int i, j;
 	/*	the master colors	*/
 	int c0[3], c1[3];
-	/*	used for fitting the line	*/
-	float sum_x[] = { 0.0f, 0.0f, 0.0f };
-	float sum_x2[] = { 0.0f, 0.0f, 0.0f };
-	float dot_max = 1.0f, dot_min = -1.0f;
 	float vec_len2 = 0.0f;
 	float dot;
-	/*	error check	*/
-	if( (channels < 3) || (channels > 4) )
-	{
-		return;
-	}
-	compute_color_line_STDEV( uncompressed, channels, sum_x, sum_x2 );
 	vec_len2 = 1.0f / ( 0.00001f +
 			sum_x2[0]*sum_x2[0] + sum_x2[1]*sum_x2[1] + sum_x2[2]*sum_x2[2] );
-	/*	finding the max and min vector values	*/
-	dot_max =
-			(
-				sum_x2[0] * uncompressed[0] +
-				sum_x2[1] * uncompressed[1] +
-				sum_x2[2] * uncompressed[2]
-			);
-	dot_min = dot_max;
-	for( i = 1; i < 16; ++i )
-	{
-		dot =
-			(
-				sum_x2[0] * uncompressed[i*channels+0] +
-				sum_x2[1] * uncompressed[i*channels+1] +
-				sum_x2[2] * uncompressed[i*channels+2]
-			);
-		if( dot < dot_min )
-		{
-			dot_min = dot;
-		} else if( dot > dot_max )
-		{
-			dot_max = dot;
-		}
-	}
 	/*	and the offset (from the average location)	*/
 	dot = sum_x2[0]*sum_x[0] + sum_x2[1]*sum_x[1] + sum_x2[2]*sum_x[2];
 	dot_min -= dot;
@@ -497,25 +573,61 @@ void LSE_master_colors_max_min(
 	}
 }
 
-void
-	compress_DDS_color_block
-	(
+void LSE_master_colors_max_min(
+		int *cmax, int *cmin,
 		int channels,
-		const unsigned char *const uncompressed,
-		unsigned char compressed[8]
-	)
+		const unsigned char *const uncompressed )
+{
+	int i;
+	/*	used for fitting the line	*/
+	float sum_x[] = { 0.0f, 0.0f, 0.0f };
+	float sum_x2[] = { 0.0f, 0.0f, 0.0f };
+	float dot_max = 1.0f, dot_min = -1.0f;
+	float dot;
+	/*	error check	*/
+	if( (channels < 3) || (channels > 4) )
+	{
+		return;
+	}
+	compute_color_line_STDEV( uncompressed, channels, sum_x, sum_x2 );
+	/*	finding the max and min vector values	*/
+	dot_max =
+			(
+				sum_x2[0] * uncompressed[0] +
+				sum_x2[1] * uncompressed[1] +
+				sum_x2[2] * uncompressed[2]
+			);
+	dot_min = dot_max;
+	for( i = 1; i < 16; ++i )
+	{
+		dot =
+			(
+				sum_x2[0] * uncompressed[i*channels+0] +
+				sum_x2[1] * uncompressed[i*channels+1] +
+				sum_x2[2] * uncompressed[i*channels+2]
+			);
+		if( dot < dot_min )
+		{
+			dot_min = dot;
+		} else if( dot > dot_max )
+		{
+			dot_max = dot;
+		}
+	}
+	master_colors_from_line( cmax, cmin, sum_x, sum_x2, dot_min, dot_max );
+}
+
+/*	stores the master colors of a color block, zeroes its bits, and
+	gives the line between them (pre-scaled) and the offset of the
+	dot products along it	*/
+static void color_block_line(
+		int enc_c0, int enc_c1,
+		unsigned char compressed[8],
+		float color_line[3], float *dot_offset )
 {
-	/*	variables	*/
 	int i;
-	int next_bit;
-	int enc_c0, enc_c1;
 	int c0[4], c1[4];
-	float color_line[] = { 0.0f, 0.0f, 0.0f, 0.0f };
-	float vec_len2 = 0.0f, dot_offset = 0.0f;
-	/*	stupid order	*/
-	int swizzle4[] = { 0, 2, 3, 1 };
-	/*	get the master colors	*/
-	LSE_master_colors_max_min( &enc_c0, &enc_c1, channels, uncompressed );
+	float vec_len2 = 0.0f;
 	/*	store the 565 color 0 and color 1	*/
 	compressed[0] = (enc_c0 >> 0) & 255;
 	compressed[1] = (enc_c0 >> 8) & 255;
@@ -545,7 +657,29 @@ void
 	color_line[1] *= vec_len2;
 	color_line[2] *= vec_len2;
 	/*	compute the offset (constant) portion of the dot product	*/
-	dot_offset = color_line[0]*c0[0] + color_line[1]*c0[1] + color_line[2]*c0[2];
+	*dot_offset = color_line[0]*c0[0] + color_line[1]*c0[1] + color_line[2]*c0[2];
+}
+
+void
+	compress_DDS_color_block
+	(
+		int channels,
+		const unsigned char *const uncompressed,
+		unsigned char compressed[8]
+	)
+{
+	/*	variables	*/
+	int i;
+	int next_bit;
+	int enc_c0, enc_c1;
+	float color_line[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	float dot_offset = 0.0f;
+	/*	stupid order	*/
+	int swizzle4[] = { 0, 2, 3, 1 };
+	/*	get the master colors	*/
+	LSE_master_colors_max_min( &enc_c0, &enc_c1, channels, uncompressed );
+	/*	store them, and get the line between them	*/
+	color_block_line( enc_c0, enc_c1, compressed, color_line, &dot_offset );
 	/*	store the rest of the bits	*/
 	next_bit = 8*4;
 	for( i = 0; i < 16; ++i )
@@ -630,3 +764,294 @@ void
 	}
 	/*	done compressing to DXT1	*/
 }
+
+#if DXT_SIMD
+/*	the sum of the 4 ints of a register	*/
+static int hsum_epi32( __m128i v )
+{
+	v = _mm_add_epi32( v, _mm_shuffle_epi32( v, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	v = _mm_add_epi32( v, _mm_shuffle_epi32( v, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	return _mm_cvtsi128_si32( v );
+}
+
+/*	16 values of 16 bits (2 registers) to 16 floats	*/
+static void widen_to_float( __m128i lo, __m128i hi, float f[16] )
+{
+	__m128i zero = _mm_setzero_si128();
+	_mm_storeu_ps( f + 0, _mm_cvtepi32_ps( _mm_unpacklo_epi16( lo, zero ) ) );
+	_mm_storeu_ps( f + 4, _mm_cvtepi32_ps( _mm_unpackhi_epi16( lo, zero ) ) );
+	_mm_storeu_ps( f + 8, _mm_cvtepi32_ps( _mm_unpacklo_epi16( hi, zero ) ) );
+	_mm_storeu_ps( f + 12, _mm_cvtepi32_ps( _mm_unpackhi_epi16( hi, zero ) ) );
+}
+
+/*	line . color - offset for the 16 pixels of a block, multiplied and
+	added in the order of the plain C code	*/
+static void line_dots_SIMD(
+		const float line[3], float offset,
+		const float *r, const float *g, const float *b,
+		float dots[16] )
+{
+	int i;
+	__m128 l0 = _mm_set1_ps( line[0] );
+	__m128 l1 = _mm_set1_ps( line[1] );
+	__m128 l2 = _mm_set1_ps( line[2] );
+	__m128 off = _mm_set1_ps( offset );
+	for( i = 0; i < 16; i += 4 )
+	{
+		__m128 dot = _mm_add_ps(
+				_mm_mul_ps( l0, _mm_loadu_ps( r + i ) ),
+				_mm_mul_ps( l1, _mm_loadu_ps( g + i ) ) );
+		dot = _mm_add_ps( dot, _mm_mul_ps( l2, _mm_loadu_ps( b + i ) ) );
+		_mm_storeu_ps( dots + i, _mm_sub_ps( dot, off ) );
+	}
+}
+
+static void
+	compress_DDS_color_block_SIMD
+	(
+		int channels,
+		const unsigned char *const uncompressed,
+		unsigned char compressed[8]
+	)
+{
+	/*	variables	*/
+	int i;
+	int bits;
+	int enc_c0, enc_c1;
+	unsigned char r[16], g[16], b[16];
+	float rf[16], gf[16], bf[16], dots[16];
+	__m128i index[4];
+	float sum_x[3], sum_x2[3];
+	float color_line[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	float dot_min, dot_max, dot_offset = 0.0f;
+	__m128i zero = _mm_setzero_si128();
+	__m128i one_lo = _mm_set1_epi16( 1 ), one_hi = one_lo;
+	__m128i r_lo, r_hi, g_lo, g_hi, b_lo, b_hi;
+	__m128 lo, hi;
+	/*	one array per channel, widened to 16 bits	*/
+	for( i = 0; i < 16; ++i )
+	{
+		r[i] = uncompressed[i*channels+0];
+		g[i] = uncompressed[i*channels+1];
+		b[i] = uncompressed[i*channels+2];
+	}
+	r_lo = _mm_loadu_si128( (const __m128i*)r );
+	g_lo = _mm_loadu_si128( (const __m128i*)g );
+	b_lo = _mm_loadu_si128( (const __m128i*)b );
+	r_hi = _mm_unpackhi_epi8( r_lo, zero );
+	g_hi = _mm_unpackhi_epi8( g_lo, zero );
+	b_hi = _mm_unpackhi_epi8( b_lo, zero );
+	r_lo = _mm_unpacklo_epi8( r_lo, zero );
+	g_lo = _mm_unpacklo_epi8( g_lo, zero );
+	b_lo = _mm_unpacklo_epi8( b_lo, zero );
+	/*	the sums of compute_color_line_STDEV, which are exact in
+		integers (at most 16*255*255), 2 products at a time	*/
+	#define DXT_SUM( x, y ) (float)hsum_epi32( _mm_add_epi32( \
+			_mm_madd_epi16( x##_lo, y##_lo ), _mm_madd_epi16( x##_hi, y##_hi ) ) )
+	color_line_from_sums(
+			DXT_SUM( r, one ), DXT_SUM( g, one ), DXT_SUM( b, one ),
+			DXT_SUM( r, r ), DXT_SUM( g, g ), DXT_SUM( b, b ),
+			DXT_SUM( r, g ), DXT_SUM( r, b ), DXT_SUM( g, b ),
+			sum_x, sum_x2 );
+	#undef DXT_SUM
+	widen_to_float( r_lo, r_hi, rf );
+	widen_to_float( g_lo, g_hi, gf );
+	widen_to_float( b_lo, b_hi, bf );
+	/*	finding the max and min vector values	*/
+	line_dots_SIMD( sum_x2, 0.0f, rf, gf, bf, dots );
+	lo = hi = _mm_loadu_ps( dots );
+	for( i = 4; i < 16; i += 4 )
+	{
+		lo = _mm_min_ps( lo, _mm_loadu_ps( dots + i ) );
+		hi = _mm_max_ps( hi, _mm_loadu_ps( dots + i ) );
+	}
+	lo = _mm_min_ps( lo, _mm_movehl_ps( lo, lo ) );
+	hi = _mm_max_ps( hi, _mm_movehl_ps( hi, hi ) );
+	dot_min = _mm_cvtss_f32( _mm_min_ss( lo, _mm_shuffle_ps( lo, lo, 1 ) ) );
+	dot_max = _mm_cvtss_f32( _mm_max_ss( hi, _mm_shuffle_ps( hi, hi, 1 ) ) );
+	/*	get the master colors, store them, and the line between them	*/
+	master_colors_from_line( &enc_c0, &enc_c1, sum_x, sum_x2, dot_min, dot_max );
+	color_block_line( enc_c0, enc_c1, compressed, color_line, &dot_offset );
+	/*	map to [0,3], 8 values of 16 bits per register	*/
+	line_dots_SIMD( color_line, dot_offset, rf, gf, bf, dots );
+	for( i = 0; i < 4; ++i )
+	{
+		index[i] = _mm_cvttps_epi32( _mm_add_ps(
+				_mm_mul_ps( _mm_loadu_ps( dots + 4*i ), _mm_set1_ps( 3.0f ) ),
+				_mm_set1_ps( 0.5f ) ) );
+	}
+	for( i = 0; i < 2; ++i )
+	{
+		__m128i v = _mm_packs_epi32( index[2*i], index[2*i+1] ), hi_bit;
+		v = _mm_min_epi16( _mm_max_epi16( v, zero ), _mm_set1_epi16( 3 ) );
+		/*	the stupid order { 0, 2, 3, 1 }: high bit b0^b1, low bit b1	*/
+		hi_bit = _mm_srli_epi16( v, 1 );
+		v = _mm_or_si128( hi_bit, _mm_slli_epi16(
+				_mm_xor_si128( hi_bit, _mm_and_si128( v, _mm_set1_epi16( 1 ) ) ), 1 ) );
+		/*	pairs of 2 bits into 4	*/
+		index[i] = _mm_madd_epi16( v, _mm_set1_epi32( 0x00040001 ) );
+	}
+	/*	then into 8, and the 4 bytes of bits	*/
+	index[0] = _mm_madd_epi16( _mm_packs_epi32( index[0], index[1] ), _mm_set1_epi32( 0x00100001 ) );
+	index[0] = _mm_packus_epi16( _mm_packs_epi32( index[0], index[0] ), zero );
+	bits = _mm_cvtsi128_si32( index[0] );
+	compressed[4] = (bits >> 0) & 255;
+	compressed[5] = (bits >> 8) & 255;
+	compressed[6] = (bits >> 16) & 255;
+	compressed[7] = (bits >> 24) & 255;
+}
+
+static void
+	compress_DDS_alpha_block_SIMD
+	(
+		const unsigned char *const uncompressed,
+		unsigned char compressed[8]
+	)
+{
+	/*	variables	*/
+	int i;
+	int bits;
+	int a0, a1;
+	unsigned char alpha[16];
+	__m128i zero = _mm_setzero_si128();
+	__m128i a, a_max, a_min, value[2];
+	__m128 scale_me;
+	for( i = 0; i < 16; ++i )
+	{
+		alpha[i] = uncompressed[i*4+3];
+	}
+	/*	get the alpha limits (a0 > a1), halving the register each step	*/
+	a = _mm_loadu_si128( (const __m128i*)alpha );
+	a_max = _mm_max_epu8( a, _mm_srli_si128( a, 8 ) );
+	a_min = _mm_min_epu8( a, _mm_srli_si128( a, 8 ) );
+	a_max = _mm_max_epu8( a_max, _mm_srli_si128( a_max, 4 ) );
+	a_min = _mm_min_epu8( a_min, _mm_srli_si128( a_min, 4 ) );
+	a_max = _mm_max_epu8( a_max, _mm_srli_si128( a_max, 2 ) );
+	a_min = _mm_min_epu8( a_min, _mm_srli_si128( a_min, 2 ) );
+	a_max = _mm_max_epu8( a_max, _mm_srli_si128( a_max, 1 ) );
+	a_min = _mm_min_epu8( a_min, _mm_srli_si128( a_min, 1 ) );
+	a0 = _mm_cvtsi128_si32( a_max ) & 255;
+	a1 = _mm_cvtsi128_si32( a_min ) & 255;
+	/*	store those limits	*/
+	compressed[0] = a0;
+	compressed[1] = a1;
+	/*	convert the alpha values to 3 bit numbers, 8 per register	*/
+	scale_me = _mm_set1_ps( 7.9999f / (a0 - a1) );
+	for( i = 0; i < 2; ++i )
+	{
+		__m128i v = _mm_sub_epi16(
+				i ? _mm_unpackhi_epi8( a, zero ) : _mm_unpacklo_epi8( a, zero ),
+				_mm_set1_epi16( (short)a1 ) ), s;
+		v = _mm_packs_epi32(
+				_mm_cvttps_epi32( _mm_mul_ps( _mm_cvtepi32_ps( _mm_unpacklo_epi16( v, zero ) ), scale_me ) ),
+				_mm_cvttps_epi32( _mm_mul_ps( _mm_cvtepi32_ps( _mm_unpackhi_epi16( v, zero ) ), scale_me ) ) );
+		/*	the stupid order { 1, 7, 6, 5, 4, 3, 2, 0 }: -value & 7,
+			with 0 and 1 swapped	*/
+		s = _mm_and_si128( _mm_sub_epi16( zero, v ), _mm_set1_epi16( 7 ) );
+		s = _mm_xor_si128( s, _mm_and_si128( _mm_cmplt_epi16( s, _mm_set1_epi16( 2 ) ), _mm_set1_epi16( 1 ) ) );
+		/*	pairs of 3 bits into 6	*/
+		value[i] = _mm_madd_epi16( s, _mm_set1_epi32( 0x00080001 ) );
+	}
+	/*	then into 12, and 24: the 6 bytes of bits	*/
+	value[0] = _mm_madd_epi16( _mm_packs_epi32( value[0], value[1] ), _mm_set1_epi32( 0x00400001 ) );
+	value[0] = _mm_madd_epi16( _mm_packs_epi32( value[0], value[0] ), _mm_set1_epi32( 0x10000001 ) );
+	bits = _mm_cvtsi128_si32( value[0] );
+	compressed[2] = (bits >> 0) & 255;
+	compressed[3] = (bits >> 8) & 255;
+	compressed[4] = (bits >> 16) & 255;
+	bits = _mm_cvtsi128_si32( _mm_srli_si128( value[0], 4 ) );
+	compressed[5] = (bits >> 0) & 255;
+	compressed[6] = (bits >> 8) & 255;
+	compressed[7] = (bits >> 16) & 255;
+}
+#endif
+
+void convert_DXT_to_RGBA(
+		const unsigned char *const compressed,
+		int width, int height, int dxt5,
+		unsigned char *rgba )
+{
+	int i, j, x, y, k;
+	int index = 0;
+	int colors[4][4];
+	int alphas[8];
+	/*	error check	*/
+	if( (width < 1) || (height < 1) ||
+		(NULL == compressed) || (NULL == rgba) )
+	{
+		return;
+	}
+	for( j = 0; j < height; j += 4 )
+	{
+		for( i = 0; i < width; i += 4 )
+		{
+			const unsigned char *block = compressed + index;
+			const unsigned char *color = block + (dxt5 ? 8 : 0);
+			unsigned int c0 = color[0] | (color[1] << 8);
+			unsigned int c1 = color[2] | (color[3] << 8);
+			/*	the 4 colors: DXT5, or c0 > c1, interpolates 2 of them,
+				else 1 and the last is black	*/
+			rgb_888_from_565( c0, &colors[0][0], &colors[0][1], &colors[0][2] );
+			rgb_888_from_565( c1, &colors[1][0], &colors[1][1], &colors[1][2] );
+			for( k = 0; k < 3; ++k )
+			{
+				if( dxt5 || (c0 > c1) )
+				{
+					colors[2][k] = (2*colors[0][k] + colors[1][k]) / 3;
+					colors[3][k] = (colors[0][k] + 2*colors[1][k]) / 3;
+				} else
+				{
+					colors[2][k] = (colors[0][k] + colors[1][k]) / 2;
+					colors[3][k] = 0;
+				}
+			}
+			/*	the 8 alphas: a0 > a1 interpolates 6 of them,
+				else 4, and 0 and 255	*/
+			for( k = 0; k < 8; ++k )
+			{
+				alphas[k] = 255;
+			}
+			if( dxt5 )
+			{
+				alphas[0] = block[0];
+				alphas[1] = block[1];
+				if( alphas[0] > alphas[1] )
+				{
+					for( k = 2; k < 8; ++k )
+					{
+						alphas[k] = ((8-k)*alphas[0] + (k-1)*alphas[1]) / 7;
+					}
+				} else
+				{
+					for( k = 2; k < 6; ++k )
+					{
+						alphas[k] = ((6-k)*alphas[0] + (k-1)*alphas[1]) / 5;
+					}
+					alphas[6] = 0;
+				}
+			}
+			/*	the pixels inside the image	*/
+			for( y = 0; (y < 4) && (j+y < height); ++y )
+			{
+				for( x = 0; (x < 4) && (i+x < width); ++x )
+				{
+					int p = y*4 + x;
+					int c = (color[4 + (p >> 2)] >> ((p & 3) * 2)) & 3;
+					int a = 0;
+					unsigned char *out = rgba + ((j+y)*width + (i+x))*4;
+					if( dxt5 )
+					{
+						/*	3 bits from 2 bytes, starting at bit 16 + 3*p	*/
+						int byte = 2 + ((3*p) >> 3);
+						a = ((block[byte] | (block[byte+1] << 8)) >> ((3*p) & 7)) & 7;
+					}
+					out[0] = colors[c][0];
+					out[1] = colors[c][1];
+					out[2] = colors[c][2];
+					out[3] = alphas[a];
+				}
+			}
+			index += dxt5 ? 16 : 8;
+		}
+	}
+}
@@ -45,6 +45,46 @@ convert_image_to_DXT5
     int *out_size
 );
 
+/**
+	compress the rows of 4x4 blocks [first_row, first_row+rows) of an
+	image, the way convert_image_to_DXT1 does, into compressed, which
+	holds the whole image (8 bytes per block).  Threads can share an
+	image, a band of rows each.  reference = 1 uses the plain C block
+	encoder instead of the SIMD one (the same bytes, only slower).
+**/
+void
+convert_image_to_DXT1_rows
+(
+    const unsigned char *const uncompressed,
+    int width, int height, int channels,
+    int first_row, int rows, int reference,
+    unsigned char *compressed
+);
+
+/**
+	the same for DXT5 (16 bytes per block)
+**/
+void
+convert_image_to_DXT5_rows
+(
+    const unsigned char *const uncompressed,
+    int width, int height, int channels,
+    int first_row, int rows, int reference,
+    unsigned char *compressed
+);
+
+/**
+	take a DXT1 (dxt5 = 0) or DXT5 image back to RGBA
+	(4 bytes per pixel), e.g. to measure the compression error
+**/
+void
+convert_DXT_to_RGBA
+(
+    const unsigned char *const compressed,
+    int width, int height, int dxt5,
+    unsigned char *rgba
+);
+
 /**	A bunch of DirectDraw Surface structures and flags **/
 typedef struct
 {
@@ -10,6 +10,31 @@
 #include <stdlib.h>
 #include <math.h>
 
+/*	the resamplers have SSE2 versions giving the same bytes, used
+	unless the reference loops are asked for.  Define
+	IMAGE_HELPER_NO_SIMD to leave them out	*/
+#if !defined( IMAGE_HELPER_NO_SIMD ) && ( defined( __SSE2__ ) || defined( _M_X64 ) || \
+	( defined( _M_IX86_FP ) && ( _M_IX86_FP >= 2 ) ) )
+#define IMAGE_HELPER_SIMD	1
+#include <emmintrin.h>
+#include <string.h>
+#endif
+
+/*	keeps [first_row, first_row+rows) inside [0,height)	*/
+static void clip_rows( int height, int *first_row, int *rows )
+{
+	int last = *first_row + *rows;
+	if( *first_row < 0 )
+	{
+		*first_row = 0;
+	}
+	if( last > height )
+	{
+		last = height;
+	}
+	*rows = last - *first_row;
+}
+
 /*	Upscaling the image uses simple bilinear interpolation	*/
 int
 	up_scale_image
@@ -19,6 +44,21 @@ int
 		unsigned char* resampled,
 		int resampled_width, int resampled_height
 	)
+{
+	return up_scale_image_rows( orig, width, height, channels,
+			resampled, resampled_width, resampled_height,
+			0, resampled_height, 0 );
+}
+
+int
+	up_scale_image_rows
+	(
+		const unsigned char* const orig,
+		int width, int height, int channels,
+		unsigned char* resampled,
+		int resampled_width, int resampled_height,
+		int first_row, int rows, int reference
+	)
 {
 	float dx, dy;
 	int x, y, c;
@@ -32,13 +72,86 @@ int
         /*	signify badness	*/
         return 0;
     }
+    clip_rows( resampled_height, &first_row, &rows );
     /*
 		for each given pixel in the new map, find the exact location
 		from the original map which would contribute to this guy
 	*/
     dx = (width - 1.0f) / (resampled_width - 1.0f);
     dy = (height - 1.0f) / (resampled_height - 1.0f);
-    for ( y = 0; y < resampled_height; ++y )
+    #if IMAGE_HELPER_SIMD
+    if( !reference && (channels <= 4) )
+    {
+		/*	the channels of a pixel side by side: each weight is
+			multiplied in, and the 4 terms added, in the order of the
+			loop below, so the floats come out the same	*/
+		const int size = width * height * channels;
+		const __m128i zero = _mm_setzero_si128();
+		for ( y = first_row; y < first_row + rows; ++y )
+		{
+			float sampley = y * dy;
+			int inty = (int)sampley;
+			__m128 wy0, wy1;
+			unsigned char *out = resampled + y*resampled_width*channels;
+			if( inty > height - 2 ) { inty = height - 2; }
+			sampley -= inty;
+			wy0 = _mm_set1_ps( 1.0f - sampley );
+			wy1 = _mm_set1_ps( sampley );
+			for ( x = 0; x < resampled_width; ++x )
+			{
+				float samplex = x * dx;
+				int intx = (int)samplex;
+				int base_index, k, corner[4], packed;
+				__m128 wx0, wx1, value;
+				__m128i p[4];
+				if( intx > width - 2 ) { intx = width - 2; }
+				samplex -= intx;
+				wx0 = _mm_set1_ps( 1.0f - samplex );
+				wx1 = _mm_set1_ps( samplex );
+				base_index = (inty * width + intx) * channels;
+				/*	the 4 pixels around the sample (1 pixel wide or high
+					images read the same one twice, like the loop below)	*/
+				corner[0] = base_index;
+				corner[1] = base_index + channels;
+				corner[2] = base_index + width*channels;
+				corner[3] = base_index + width*channels + channels;
+				for( k = 0; k < 4; ++k )
+				{
+					int bytes = 0;
+					if( corner[k] + 4 <= size )
+					{
+						memcpy( &bytes, orig + corner[k], 4 );
+					} else
+					{
+						for( c = 0; c < channels; ++c )
+						{
+							bytes |= orig[corner[k] + c] << (8*c);
+						}
+					}
+					p[k] = _mm_unpacklo_epi16( _mm_unpacklo_epi8(
+							_mm_cvtsi32_si128( bytes ), zero ), zero );
+				}
+				value = _mm_add_ps( _mm_set1_ps( 0.5f ), _mm_mul_ps( _mm_mul_ps(
+						_mm_cvtepi32_ps( p[0] ), wx0 ), wy0 ) );
+				value = _mm_add_ps( value, _mm_mul_ps( _mm_mul_ps(
+						_mm_cvtepi32_ps( p[1] ), wx1 ), wy0 ) );
+				value = _mm_add_ps( value, _mm_mul_ps( _mm_mul_ps(
+						_mm_cvtepi32_ps( p[2] ), wx0 ), wy1 ) );
+				value = _mm_add_ps( value, _mm_mul_ps( _mm_mul_ps(
+						_mm_cvtepi32_ps( p[3] ), wx1 ), wy1 ) );
+				p[0] = _mm_cvttps_epi32( value );
+				packed = _mm_cvtsi128_si32( _mm_packus_epi16( _mm_packs_epi32( p[0], p[0] ), zero ) );
+				/*	save the new values	*/
+				for( c = 0; c < channels; ++c )
+				{
+					out[x*channels+c] = (unsigned char)(packed >> (8*c));
+				}
+			}
+		}
+		return 1;
+    }
+    #endif
+    for ( y = first_row; y < first_row + rows; ++y )
     {
     	/* find the base y index and fractional offset from that	*/
     	float sampley = y * dy;
@@ -89,6 +202,21 @@ int
 		unsigned char* resampled,
 		int block_size_x, int block_size_y
 	)
+{
+	return mipmap_image_rows( orig, width, height, channels,
+			resampled, block_size_x, block_size_y,
+			0, height, 0 );
+}
+
+int
+	mipmap_image_rows
+	(
+		const unsigned char* const orig,
+		int width, int height, int channels,
+		unsigned char* resampled,
+		int block_size_x, int block_size_y,
+		int first_row, int rows, int reference
+	)
 {
 	int mip_width, mip_height;
 	int i, j, c;
@@ -112,7 +240,109 @@ int
 	{
 		mip_height = 1;
 	}
-	for( j = 0; j < mip_height; ++j )
+	clip_rows( mip_height, &first_row, &rows );
+	#if IMAGE_HELPER_SIMD
+	if( !reference && (channels <= 4) )
+	{
+		/*	the sums of the columns of a row of blocks, 4 lanes
+			past the end so that a pixel can always be read whole,
+			added up 16 bits at a time for up to 257 rows first	*/
+		int *column = (int*)malloc( (width*channels + 4) * sizeof( int ) );
+		unsigned short *column16 = (unsigned short*)malloc( width*channels * sizeof( unsigned short ) );
+		const __m128i zero = _mm_setzero_si128();
+		if( (NULL == column) || (NULL == column16) )
+		{
+			free( column );
+			free( column16 );
+			return 0;
+		}
+		for( j = first_row; j < first_row + rows; ++j )
+		{
+			int v, u;
+			int v_block = block_size_y;
+			if( block_size_y * (j+1) > height )
+			{
+				v_block = height - j*block_size_y;
+			}
+			/*	add up the rows of the blocks, 16 bytes at a time	*/
+			memset( column, 0, (width*channels + 4) * sizeof( int ) );
+			for( v = 0; v < v_block; v += 257 )
+			{
+				int v_end = v + 257 < v_block ? v + 257 : v_block;
+				memset( column16, 0, width*channels * sizeof( unsigned short ) );
+				for( u = v; u < v_end; ++u )
+				{
+					const unsigned char *row = orig + (j*block_size_y + u)*width*channels;
+					for( i = 0; i + 16 <= width*channels; i += 16 )
+					{
+						__m128i bytes = _mm_loadu_si128( (const __m128i*)(row + i) );
+						__m128i *sum = (__m128i*)(column16 + i);
+						_mm_storeu_si128( sum + 0, _mm_add_epi16( _mm_loadu_si128( sum + 0 ), _mm_unpacklo_epi8( bytes, zero ) ) );
+						_mm_storeu_si128( sum + 1, _mm_add_epi16( _mm_loadu_si128( sum + 1 ), _mm_unpackhi_epi8( bytes, zero ) ) );
+					}
+					for( ; i < width*channels; ++i )
+					{
+						column16[i] += row[i];
+					}
+				}
+				for( i = 0; i + 8 <= width*channels; i += 8 )
+				{
+					__m128i sums = _mm_loadu_si128( (const __m128i*)(column16 + i) );
+					__m128i *sum = (__m128i*)(column + i);
+					_mm_storeu_si128( sum + 0, _mm_add_epi32( _mm_loadu_si128( sum + 0 ), _mm_unpacklo_epi16( sums, zero ) ) );
+					_mm_storeu_si128( sum + 1, _mm_add_epi32( _mm_loadu_si128( sum + 1 ), _mm_unpackhi_epi16( sums, zero ) ) );
+				}
+				for( ; i < width*channels; ++i )
+				{
+					column[i] += column16[i];
+				}
+			}
+			/*	then the columns of each block, the channels of a
+				pixel side by side	*/
+			for( i = 0; i < mip_width; ++i )
+			{
+				int u_block = block_size_x;
+				int block_area, sums[4];
+				__m128i sum = zero;
+				if( block_size_x * (i+1) > width )
+				{
+					u_block = width - i*block_size_y;
+				}
+				block_area = u_block*v_block;
+				for( u = 0; u < u_block; ++u )
+				{
+					sum = _mm_add_epi32( sum, _mm_loadu_si128(
+							(const __m128i*)(column + (i*block_size_x + u)*channels) ) );
+				}
+				/*	start at the rounding value, like below; the sums are
+					positive, so a power of two area is a shift	*/
+				_mm_storeu_si128( (__m128i*)sums, _mm_add_epi32( sum, _mm_set1_epi32( block_area >> 1 ) ) );
+				if( (block_area & (block_area - 1)) == 0 )
+				{
+					int shift = 0;
+					while( (1 << shift) < block_area )
+					{
+						++shift;
+					}
+					for( c = 0; c < channels; ++c )
+					{
+						resampled[j*mip_width*channels + i*channels + c] = sums[c] >> shift;
+					}
+				} else
+				{
+					for( c = 0; c < channels; ++c )
+					{
+						resampled[j*mip_width*channels + i*channels + c] = sums[c] / block_area;
+					}
+				}
+			}
+		}
+		free( column );
+		free( column16 );
+		return 1;
+	}
+	#endif
+	for( j = first_row; j < first_row + rows; ++j )
 	{
 		for( i = 0; i < mip_width; ++i )
 		{
@@ -157,10 +387,22 @@ int
 		unsigned char* orig,
 		int width, int height, int channels
 	)
+{
+	return scale_image_RGB_to_NTSC_safe_rows( orig, width, height, channels,
+			0, height, 0 );
+}
+
+int
+	scale_image_RGB_to_NTSC_safe_rows
+	(
+		unsigned char* orig,
+		int width, int height, int channels,
+		int first_row, int rows, int reference
+	)
 {
 	const float scale_lo = 16.0f - 0.499f;
 	const float scale_hi = 235.0f + 0.499f;
-	int i, j;
+	int i, j, end;
 	int nc = channels;
 	unsigned char scale_LUT[256];
 	/*	error check	*/
@@ -170,6 +412,7 @@ int
 		/*	nothing to do	*/
 		return 0;
 	}
+	clip_rows( height, &first_row, &rows );
 	/*	set up the scaling Look Up Table	*/
 	for( i = 0; i < 256; ++i )
 	{
@@ -177,8 +420,50 @@ int
 	}
 	/*	for channels = 2 or 4, ignore the alpha component	*/
 	nc -= 1 - (channels & 1);
+	i = first_row*width*channels;
+	end = (first_row + rows)*width*channels;
+	#if IMAGE_HELPER_SIMD
+	if( !reference && (channels <= 4) )
+	{
+		/*	the table as arithmetic, 16 bytes at a time, with the
+			same float operations; alpha is every 2nd or 4th byte	*/
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 scale = _mm_set1_ps( scale_hi - scale_lo );
+		const __m128 lo = _mm_set1_ps( scale_lo );
+		const __m128 div = _mm_set1_ps( 255.0f );
+		const __m128i alpha = (channels & 1) ? zero :
+			_mm_set1_epi32( (channels == 2) ? (int)0xFF00FF00 : (int)0xFF000000 );
+		for( ; i + 16 <= end; i += 16 )
+		{
+			__m128i bytes = _mm_loadu_si128( (const __m128i*)(orig + i) );
+			__m128i half[2], words[2];
+			int k;
+			half[0] = _mm_unpacklo_epi8( bytes, zero );
+			half[1] = _mm_unpackhi_epi8( bytes, zero );
+			for( k = 0; k < 2; ++k )
+			{
+				__m128i a = _mm_cvttps_epi32( _mm_add_ps( _mm_div_ps( _mm_mul_ps( scale,
+						_mm_cvtepi32_ps( _mm_unpacklo_epi16( half[k], zero ) ) ), div ), lo ) );
+				__m128i b = _mm_cvttps_epi32( _mm_add_ps( _mm_div_ps( _mm_mul_ps( scale,
+						_mm_cvtepi32_ps( _mm_unpackhi_epi16( half[k], zero ) ) ), div ), lo ) );
+				words[k] = _mm_packs_epi32( a, b );
+			}
+			words[0] = _mm_packus_epi16( words[0], words[1] );
+			_mm_storeu_si128( (__m128i*)(orig + i), _mm_or_si128(
+					_mm_and_si128( alpha, bytes ), _mm_andnot_si128( alpha, words[0] ) ) );
+		}
+		/*	16 bytes are not whole pixels of 3: the rest byte by byte	*/
+		if( channels & 1 )
+		{
+			for( ; i < end; ++i )
+			{
+				orig[i] = scale_LUT[orig[i]];
+			}
+		}
+	}
+	#endif
 	/*	OK, go through the image and scale any non-alpha components	*/
-	for( i = 0; i < width*height*channels; i += channels )
+	for( ; i < end; i += channels )
 	{
 		for( j = 0; j < nc; ++j )
 		{
@@ -28,6 +28,22 @@ int
 		int resampled_width, int resampled_height
 	);
 
+/**
+	up_scale_image for the rows [first_row, first_row+rows) of the
+	resampled image only, so threads can share an image.
+	reference = 1 uses the plain C loops instead of the SIMD ones
+	(the same bytes, only slower).
+**/
+int
+	up_scale_image_rows
+	(
+		const unsigned char* const orig,
+		int width, int height, int channels,
+		unsigned char* resampled,
+		int resampled_width, int resampled_height,
+		int first_row, int rows, int reference
+	);
+
 /**
 	This function downscales an image.
 	Used for creating MIPmaps,
@@ -43,6 +59,20 @@ int
 		int block_size_x, int block_size_y
 	);
 
+/**
+	mipmap_image for the rows [first_row, first_row+rows) of the
+	MIPmap only.  reference: see up_scale_image_rows.
+**/
+int
+	mipmap_image_rows
+	(
+		const unsigned char* const orig,
+		int width, int height, int channels,
+		unsigned char* resampled,
+		int block_size_x, int block_size_y,
+		int first_row, int rows, int reference
+	);
+
 /**
 	This function takes the RGB components of the image
 	and scales each channel from [0,255] to [16,235].
@@ -57,6 +87,19 @@ int
 		int width, int height, int channels
 	);
 
+/**
+	scale_image_RGB_to_NTSC_safe for the rows
+	[first_row, first_row+rows) only.
+	reference: see up_scale_image_rows.
+**/
+int
+	scale_image_RGB_to_NTSC_safe_rows
+	(
+		unsigned char* orig,
+		int width, int height, int channels,
+		int first_row, int rows, int reference
+	);
+
 /**
 	This function takes the RGB components of the image
 	and converts them into YCoCg.  3 components will be
@@ -94,6 +94,7 @@ typedef   signed short  int16;
 typedef unsigned int   uint32;
 typedef   signed int    int32;
 typedef unsigned int   uint;
+typedef unsigned long long uint64;
 
 // should produce compiler error if size is wrong
 typedef unsigned char validate_uint32[sizeof(uint32)==4];
@@ -106,6 +107,16 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4];
 #include "stbi_DDS_aug.h"
 #endif
 
+// SSE2 PNG unfiltering, giving the same bytes as the plain C loops; used
+// when the compiler targets SSE2 (always on x64) unless STBI_NO_PNG_SIMD
+#if !defined(STBI_NO_PNG_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+   (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)))
+#define STBI_PNG_SIMD 1
+#include <emmintrin.h>
+#else
+#define STBI_PNG_SIMD 0
+#endif
+
 //	I (JLD) want full messages for SOIL
 #define STBI_FAILURE_USERMSG 1
 
@@ -114,8 +125,14 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4];
 // Generic API that works on all image types
 //
 
-// this is not threadsafe
-static char *failure_reason;
+// one per thread: the texture loaders decode on several at once
+#if defined(_MSC_VER)
+static __declspec(thread) char *failure_reason;
+#elif defined(__GNUC__)
+static __thread char *failure_reason;
+#else
+static char *failure_reason; // not threadsafe
+#endif
 
 char *stbi_failure_reason(void)
 {
@@ -1681,6 +1698,25 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
    return 1;
 }
 
+// fast inflate: a 64-bit bit buffer refilled 8 bytes at a time without
+// branches, tables that give two literals or a length with its extra bit
+// count in one lookup, and match copies 8 bytes at a time. It runs while
+// there are 8 input bytes and room for the longest match left, then hands
+// over to the plain loop for the end of the stream or buffer
+#define ZLFAST_BITS  11
+#define ZLFAST_MASK  ((1 << ZLFAST_BITS) - 1)
+#define ZDFAST_BITS  10
+#define ZDFAST_MASK  ((1 << ZDFAST_BITS) - 1)
+#define ZFAST_ROOM   (258 + 8) // a match, and the 8-byte copy overshoot
+
+// fast table entries: bits 0..7 the code bits to consume, 8..9 the number
+// of literals, 10 a length, 11 the end of block, 12..15 the extra bits of
+// a length or distance, 16..31 the literals or the base length/distance;
+// 0 for codes longer than the table, looked up the slow way
+#define ZF_LITERALS  0x300
+#define ZF_LENGTH    0x400
+#define ZF_END       0x800
+
 // zlib-from-memory implementation for PNG reading
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
@@ -1699,6 +1735,10 @@ typedef struct
    int   z_expandable;
 
    zhuffman z_length, z_distance;
+
+   int reference; // only the plain loops, to check the fast ones against
+   uint32 zlfast[1 << ZLFAST_BITS]; // see zbuild_fast_tables
+   uint32 zdfast[1 << ZDFAST_BITS];
 } zbuf;
 
 __forceinline static int zget8(zbuf *z)
@@ -1784,38 +1824,206 @@ static int dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
 static int dist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
-static int parse_huffman_block(zbuf *a)
+// one literal or match the plain way: 0 on error, 1 at the end of the
+// block, 2 to go on
+static int parse_huffman_symbol(zbuf *a)
 {
-   for(;;) {
-      int z = zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
-         *a->zout++ = (char) z;
+   int z = zhuffman_decode(a, &a->z_length);
+   if (z < 256) {
+      if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
+      if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
+      *a->zout++ = (char) z;
+   } else {
+      uint8 *p;
+      int len,dist;
+      if (z == 256) return 1;
+      z -= 257;
+      len = length_base[z];
+      if (length_extra[z]) len += zreceive(a, length_extra[z]);
+      z = zhuffman_decode(a, &a->z_distance);
+      if (z < 0) return e("bad huffman code","Corrupt PNG");
+      dist = dist_base[z];
+      if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
+      if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
+      if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
+      p = (uint8 *) (a->zout - dist);
+      while (len--)
+         *a->zout++ = *p++;
+   }
+   return 2;
+}
+
+static uint32 zlength_entry(int symbol, int size)
+{
+   if (symbol < 256) return size | 0x100 | (symbol << 16);
+   if (symbol == 256) return size | ZF_END;
+   symbol -= 257;
+   if (symbol >= 29) return 0; // 286 and 287 are not used
+   return size | ZF_LENGTH | (length_extra[symbol] << 12) | ((uint32) length_base[symbol] << 16);
+}
+
+static uint32 zdistance_entry(int symbol, int size)
+{
+   if (symbol >= 30) return 0; // 30 and 31 are not used
+   return size | (dist_extra[symbol] << 12) | ((uint32) dist_base[symbol] << 16);
+}
+
+// the codes of up to bits bits, repeated over the bits above them
+static void zfill_fast(uint32 *table, int bits, zhuffman *z, int length)
+{
+   int s,k,j;
+   memset(table, 0, sizeof(uint32) << bits);
+   for (s=1; s <= bits; ++s) {
+      int count = (z->maxcode[s] >> (16-s)) - z->firstcode[s];
+      for (k=0; k < count; ++k) {
+         int c = z->firstsymbol[s] + k;
+         uint32 entry = length ? zlength_entry(z->value[c], s) : zdistance_entry(z->value[c], s);
+         for (j = bit_reverse(z->firstcode[s] + k, s); j < (1 << bits); j += 1 << s)
+            table[j] = entry;
+      }
+   }
+}
+
+static void zbuild_fast_tables(zbuf *a)
+{
+   int i;
+   zfill_fast(a->zlfast, ZLFAST_BITS, &a->z_length, 1);
+   zfill_fast(a->zdfast, ZDFAST_BITS, &a->z_distance, 0);
+   // a literal followed by another that fits in the bits left; from the top,
+   // so the entry looked at for the second one is still a single literal
+   for (i = (1 << ZLFAST_BITS) - 1; i >= 0; --i) {
+      uint32 first = a->zlfast[i], second;
+      int s = first & 255;
+      if (!(first & ZF_LITERALS) || s >= ZLFAST_BITS) continue;
+      second = a->zlfast[i >> s];
+      if ((second & ZF_LITERALS) && s + (int) (second & 255) <= ZLFAST_BITS)
+         a->zlfast[i] = (s + (second & 255)) | 0x200 | (first & 0xff0000) | ((second & 0xff0000) << 8);
+   }
+}
+
+// a code longer than the fast tables, as zhuffman_decode does it
+static int zhuffman_decode_slowly(zhuffman *z, uint32 code, int *size)
+{
+   int b,s,k = bit_reverse(code & 0xffff, 16);
+   for (s=ZFAST_BITS+1; ; ++s)
+      if (k < z->maxcode[s])
+         break;
+   if (s == 16) return -1; // invalid code!
+   b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
+   *size = s;
+   return z->value[b];
+}
+
+__forceinline static uint64 zload64(uint8 *p)
+{
+   #if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+   uint64 v;
+   memcpy(&v, p, 8); // little endian, unaligned loads are fine
+   return v;
+   #else
+   return (uint64) p[0]       | ((uint64) p[1] <<  8) | ((uint64) p[2] << 16) | ((uint64) p[3] << 24) |
+         ((uint64) p[4] << 32) | ((uint64) p[5] << 40) | ((uint64) p[6] << 48) | ((uint64) p[7] << 56);
+   #endif
+}
+
+// as parse_huffman_symbol, as long as it can: 0 on error, 1 at the end of
+// the block, 2 to go on the plain way
+static int parse_huffman_fast(zbuf *a)
+{
+   uint8 *in = a->zbuffer, *in_end = a->zbuffer_end;
+   char *out = a->zout, *out_end = a->zout_end;
+   uint64 bits;
+   int n, result = 2;
+   if (in_end - in < 8 || out_end - out < ZFAST_ROOM) return 2;
+   bits = a->code_buffer;
+   n = a->num_bits;
+   do {
+      uint32 entry;
+      int len, dist, extra;
+      char *p;
+      // to 56..63 bits; the bits above n are those of the next byte, which
+      // the next refill ors in again at the same place
+      bits |= zload64(in) << n;
+      in += (63 - n) >> 3;
+      n |= 56;
+
+      entry = a->zlfast[bits & ZLFAST_MASK];
+      if (!entry) {
+         int size, z = zhuffman_decode_slowly(&a->z_length, (uint32) bits, &size);
+         entry = z < 0 ? 0 : zlength_entry(z, size);
+         if (!entry) { result = e("bad huffman code","Corrupt PNG"); break; }
+      }
+      bits >>= entry & 255;
+      n -= entry & 255;
+      if (entry & ZF_LITERALS) {
+         out[0] = (char) (entry >> 16);
+         out[1] = (char) (entry >> 24);
+         out += (entry >> 8) & 3;
+         continue;
+      }
+      if (entry & ZF_END) { result = 1; break; }
+      extra = (entry >> 12) & 15;
+      len = (entry >> 16) + (int) (bits & ((1 << extra) - 1));
+      bits >>= extra;
+      n -= extra;
+
+      entry = a->zdfast[bits & ZDFAST_MASK];
+      if (!entry) {
+         int size, z = zhuffman_decode_slowly(&a->z_distance, (uint32) bits, &size);
+         entry = z < 0 ? 0 : zdistance_entry(z, size);
+         if (!entry) { result = e("bad huffman code","Corrupt PNG"); break; }
+      }
+      bits >>= entry & 255;
+      n -= entry & 255;
+      extra = (entry >> 12) & 15;
+      dist = (entry >> 16) + (int) (bits & ((1 << extra) - 1));
+      bits >>= extra;
+      n -= extra;
+
+      if (out - a->zout_start < dist) { result = e("bad dist","Corrupt PNG"); break; }
+      p = out - dist;
+      if (dist >= 8) {
+         // 8 bytes at a time, each read before it is written over
+         char *end = out + len;
+         do {
+            memcpy(out, p, 8);
+            out += 8;
+            p += 8;
+         } while (out < end);
+         out = end;
+      } else if (dist == 1) {
+         memset(out, *p, len);
+         out += len;
       } else {
-         uint8 *p;
-         int len,dist;
-         if (z == 256) return 1;
-         z -= 257;
-         len = length_base[z];
-         if (length_extra[z]) len += zreceive(a, length_extra[z]);
-         z = zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return e("bad huffman code","Corrupt PNG");
-         dist = dist_base[z];
-         if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
-         if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
-         if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
-         p = (uint8 *) (a->zout - dist);
          while (len--)
-            *a->zout++ = *p++;
+            *out++ = *p++;
       }
+   } while (in_end - in >= 8 && out_end - out >= ZFAST_ROOM);
+   // the whole bytes left in the bit buffer go back to the input
+   in -= n >> 3;
+   n &= 7;
+   a->zbuffer = in;
+   a->zout = out;
+   a->code_buffer = (uint32) bits & ((1 << n) - 1);
+   a->num_bits = n;
+   return result;
+}
+
+static int parse_huffman_block(zbuf *a)
+{
+   if (!a->reference)
+      zbuild_fast_tables(a);
+   for(;;) {
+      int r = a->reference ? 2 : parse_huffman_fast(a);
+      if (r == 2) r = parse_huffman_symbol(a);
+      if (r != 2) return r;
    }
 }
 
 static int compute_huffman_codes(zbuf *a)
 {
    static uint8 length_dezigzag[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
-   static zhuffman z_codelength; // static just to save stack space
+   zhuffman z_codelength; // not static: images are decoded on several threads
    uint8 lencodes[286+32+137];//padding for maximum single op
    uint8 codelength_sizes[19];
    int i,n;
@@ -1900,18 +2108,26 @@ static int parse_zlib_header(zbuf *a)
    return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static uint8 default_length[288], default_distance[32];
-static void init_defaults(void)
+// statically initialized, so threads decoding at once never see them half built
+#define STBI_8X(v)   v,v,v,v,v,v,v,v
+static uint8 default_length[288] =
+{
+   // 0..143: 8
+   STBI_8X(8),STBI_8X(8),STBI_8X(8),STBI_8X(8),STBI_8X(8),STBI_8X(8),
+   STBI_8X(8),STBI_8X(8),STBI_8X(8),STBI_8X(8),STBI_8X(8),STBI_8X(8),
+   STBI_8X(8),STBI_8X(8),STBI_8X(8),STBI_8X(8),STBI_8X(8),STBI_8X(8),
+   // 144..255: 9
+   STBI_8X(9),STBI_8X(9),STBI_8X(9),STBI_8X(9),STBI_8X(9),STBI_8X(9),STBI_8X(9),
+   STBI_8X(9),STBI_8X(9),STBI_8X(9),STBI_8X(9),STBI_8X(9),STBI_8X(9),STBI_8X(9),
+   // 256..279: 7, 280..287: 8
+   STBI_8X(7),STBI_8X(7),STBI_8X(7),
+   STBI_8X(8)
+};
+static uint8 default_distance[32] =
 {
-   int i;   // use <= to match clearly with spec
-   for (i=0; i <= 143; ++i)     default_length[i]   = 8;
-   for (   ; i <= 255; ++i)     default_length[i]   = 9;
-   for (   ; i <= 279; ++i)     default_length[i]   = 7;
-   for (   ; i <= 287; ++i)     default_length[i]   = 8;
-
-   for (i=0; i <=  31; ++i)     default_distance[i] = 5;
-}
+   STBI_8X(5),STBI_8X(5),STBI_8X(5),STBI_8X(5)
+};
+#undef STBI_8X
 
 static int parse_zlib(zbuf *a, int parse_header)
 {
@@ -1930,7 +2146,6 @@ static int parse_zlib(zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!default_distance[31]) init_defaults();
             if (!zbuild_huffman(&a->z_length  , default_length  , 288)) return 0;
             if (!zbuild_huffman(&a->z_distance, default_distance,  32)) return 0;
          } else {
@@ -1952,11 +2167,12 @@ static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header)
    return parse_zlib(a, parse_header);
 }
 
-char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
+static char *zlib_decode_malloc(const char *buffer, int len, int initial_size, int *outlen, int reference)
 {
    zbuf a;
    char *p = (char *) malloc(initial_size);
    if (p == NULL) return NULL;
+   a.reference = reference;
    a.zbuffer = (uint8 *) buffer;
    a.zbuffer_end = (uint8 *) buffer + len;
    if (do_zlib(&a, p, initial_size, 1, 1)) {
@@ -1968,6 +2184,11 @@ char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial
    }
 }
 
+char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
+{
+   return zlib_decode_malloc(buffer, len, initial_size, outlen, 0);
+}
+
 char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
 {
    return stbi_zlib_decode_malloc_guesssize(buffer, len, 16384, outlen);
@@ -1976,6 +2197,7 @@ char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
 int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int ilen)
 {
    zbuf a;
+   a.reference = 0;
    a.zbuffer = (uint8 *) ibuffer;
    a.zbuffer_end = (uint8 *) ibuffer + ilen;
    if (do_zlib(&a, obuffer, olen, 0, 1))
@@ -1989,6 +2211,7 @@ char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int *outlen)
    zbuf a;
    char *p = (char *) malloc(16384);
    if (p == NULL) return NULL;
+   a.reference = 0;
    a.zbuffer = (uint8 *) buffer;
    a.zbuffer_end = (uint8 *) buffer+len;
    if (do_zlib(&a, p, 16384, 1, 0)) {
@@ -2003,6 +2226,7 @@ char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int *outlen)
 int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffer, int ilen)
 {
    zbuf a;
+   a.reference = 0;
    a.zbuffer = (uint8 *) ibuffer;
    a.zbuffer_end = (uint8 *) ibuffer + ilen;
    if (do_zlib(&a, obuffer, olen, 0, 0))
@@ -2051,6 +2275,7 @@ typedef struct
 {
    stbi s;
    uint8 *idata, *expanded, *out;
+   int reference; // the plain inflate and unfiltering loops
 } png;
 
 
@@ -2075,6 +2300,90 @@ static int paeth(int a, int b, int c)
    return c;
 }
 
+#if STBI_PNG_SIMD
+// a pixel of n = 3 or 4 bytes in the low lanes; 3 bytes are put together
+// in registers, as going through memory stalls the 4-byte read
+__forceinline static __m128i png_load_pixel(uint8 *p, int n)
+{
+   int v;
+   if (n == 4) memcpy(&v, p, 4);
+   else v = p[0] | (p[1] << 8) | (p[2] << 16);
+   return _mm_cvtsi32_si128(v);
+}
+
+__forceinline static void png_store_pixel(uint8 *p, __m128i x, int n)
+{
+   int v = _mm_cvtsi128_si32(x);
+   if (n == 4) memcpy(p, &v, 4);
+   else {
+      p[0] = (uint8) v;
+      p[1] = (uint8) (v >> 8);
+      p[2] = (uint8) (v >> 16);
+   }
+}
+
+// a row of pixels of n = 3 or 4 bytes; the first row has a row of zeros
+// for prior, which makes the first row filters of create_png_image
+static void unfilter_row_simd(uint8 *cur, uint8 *prior, uint8 *raw, int filter, int n, uint32 x)
+{
+   const __m128i zero = _mm_setzero_si128();
+   __m128i a = zero; // the pixel to the left
+   uint32 i, bytes = x * n;
+   switch (filter) {
+      case F_none:
+         memcpy(cur, raw, bytes);
+         break;
+      case F_up:
+         for (i=0; i + 16 <= bytes; i += 16)
+            _mm_storeu_si128((__m128i *) (cur+i), _mm_add_epi8(_mm_loadu_si128((__m128i *) (raw+i)),
+                                                               _mm_loadu_si128((__m128i *) (prior+i))));
+         for (; i < bytes; ++i)
+            cur[i] = raw[i] + prior[i];
+         break;
+      case F_sub:
+         for (i=0; i < bytes; i += n) {
+            a = _mm_add_epi8(a, png_load_pixel(raw+i, n));
+            png_store_pixel(cur+i, a, n);
+         }
+         break;
+      case F_avg:
+         // (a + b) >> 1 is the rounding up average less the low bit of a ^ b
+         for (i=0; i < bytes; i += n) {
+            __m128i b = png_load_pixel(prior+i, n);
+            __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+            a = _mm_add_epi8(png_load_pixel(raw+i, n), avg);
+            png_store_pixel(cur+i, a, n);
+         }
+         break;
+      case F_paeth: {
+         // in 16 bits: pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|, and
+         // a, b or c by the first smallest of them, as paeth() does
+         __m128i c = zero;
+         for (i=0; i < bytes; i += n) {
+            __m128i b = _mm_unpacklo_epi8(png_load_pixel(prior+i, n), zero);
+            __m128i pa = _mm_sub_epi16(b, c);
+            __m128i pb = _mm_sub_epi16(a, c);
+            __m128i pc = _mm_add_epi16(pa, pb);
+            __m128i smallest, use_a, use_b, pred;
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            use_a = _mm_cmpeq_epi16(smallest, pa);
+            use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(smallest, pb));
+            pred = _mm_or_si128(_mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)),
+                                _mm_andnot_si128(_mm_or_si128(use_a, use_b), c));
+            a = _mm_add_epi8(png_load_pixel(raw+i, n), _mm_packus_epi16(pred, zero));
+            png_store_pixel(cur+i, a, n);
+            a = _mm_unpacklo_epi8(a, zero);
+            c = b;
+         }
+         break;
+      }
+   }
+}
+#endif
+
 // create the png data from post-deflated data
 static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n)
 {
@@ -2086,6 +2395,21 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n)
    a->out = (uint8 *) malloc(s->img_x * s->img_y * out_n);
    if (!a->out) return e("outofmem", "Out of memory");
    if (raw_len != (img_n * s->img_x + 1) * s->img_y) return e("not enough pixels","Corrupt PNG");
+   #if STBI_PNG_SIMD
+   if (!a->reference && img_n == out_n && (img_n == 3 || img_n == 4)) {
+      uint8 *zero = (uint8 *) calloc(stride, 1);
+      if (!zero) return e("outofmem", "Out of memory");
+      for (j=0; j < s->img_y; ++j) {
+         uint8 *cur = a->out + stride*j;
+         int filter = *raw++;
+         if (filter > 4) { free(zero); return e("invalid filter","Corrupt PNG"); }
+         unfilter_row_simd(cur, j ? cur - stride : zero, raw, filter, img_n, s->img_x);
+         raw += stride;
+      }
+      free(zero);
+      return 1;
+   }
+   #endif
    for (j=0; j < s->img_y; ++j) {
       uint8 *cur = a->out + stride*j;
       uint8 *prior = cur - stride;
@@ -2311,7 +2635,9 @@ static int parse_png_file(png *z, int scan, int req_comp)
             uint32 raw_len;
             if (scan != SCAN_load) return 1;
             if (z->idata == NULL) return e("no IDAT","Corrupt PNG");
-            z->expanded = (uint8 *) stbi_zlib_decode_malloc((char *) z->idata, ioff, (int *) &raw_len);
+            // the fast way starts with the exact size, the filtered rows
+            z->expanded = (uint8 *) zlib_decode_malloc((char *) z->idata, ioff,
+               z->reference ? 16384 : (s->img_n * s->img_x + 1) * s->img_y, (int *) &raw_len, z->reference);
             if (z->expanded == NULL) return 0; // zlib should set error
             free(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
@@ -2384,6 +2710,7 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
 unsigned char *stbi_png_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
    png p;
+   p.reference = 0;
    start_file(&p.s, f);
    return do_png(&p, x,y,comp,req_comp);
 }
@@ -2400,8 +2727,14 @@ unsigned char *stbi_png_load(char const *filename, int *x, int *y, int *comp, in
 #endif
 
 unsigned char *stbi_png_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   return stbi_png_load_from_memory_ex(buffer, len, x, y, comp, req_comp, 0);
+}
+
+unsigned char *stbi_png_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int reference)
 {
    png p;
+   p.reference = reference;
    start_mem(&p.s, buffer,len);
    return do_png(&p, x,y,comp,req_comp);
 }
@@ -2411,6 +2744,7 @@ int stbi_png_test_file(FILE *f)
 {
    png p;
    int n,r;
+   p.reference = 0;
    n = ftell(f);
    start_file(&p.s, f);
    r = parse_png_file(&p, SCAN_type,STBI_default);
@@ -2422,6 +2756,7 @@ int stbi_png_test_file(FILE *f)
 int stbi_png_test_memory(stbi_uc const *buffer, int len)
 {
    png p;
+   p.reference = 0;
    start_mem(&p.s, buffer, len);
    return parse_png_file(&p, SCAN_type,STBI_default);
 }
@@ -212,8 +212,8 @@ extern void   stbi_ldr_to_hdr_scale(float scale);
 
 #endif // STBI_NO_HDR
 
-// get a VERY brief reason for failure
-// NOT THREADSAFE
+// get a VERY brief reason for failure, of the last failure on the calling
+// thread (with MSVC and gcc; NOT THREADSAFE elsewhere)
 extern char    *stbi_failure_reason  (void); 
 
 // free the loaded image -- this is just free()
@@ -256,6 +256,9 @@ extern int      stbi_jpeg_info_from_file  (FILE *f,                  int *x, int
 // is it a png?
 extern int      stbi_png_test_memory      (stbi_uc const *buffer, int len);
 extern stbi_uc *stbi_png_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+// reference = 1 decodes with the plain inflate and unfiltering loops instead
+// of the fast ones, which give the same pixels
+extern stbi_uc *stbi_png_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int reference);
 extern int      stbi_png_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 
 #ifndef STBI_NO_STDIO
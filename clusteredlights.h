@@ -0,0 +1,329 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <utility>
+#include <math.h>
+#include <string.h>
+#include "gl/glew.h"
+#include "glm/glm.hpp"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <xmmintrin.h>
+#define CLUSTERS_SSE
+#endif
+
+using namespace std;
+
+// clustered forward lighting: the view frustum is cut into a grid of
+// froxels, CLUSTER_X x CLUSTER_Y screen tiles by CLUSTER_Z depth slices
+// (exponential, so near slices are thin). Every frame the point lights are
+// binned into the froxels their sphere touches, on the CPU, 4 froxels at a
+// time with SSE, and each fragment only loops over the lights of its own
+// froxel. Lights, froxel ranges and the light index list go to the shader
+// as buffer textures
+#define CLUSTER_X 16	// multiple of 4, for the SSE loop
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define N_CLUSTERS (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+
+// a point light in world space; its light fades to zero at m_radius
+typedef struct SPointLight
+{
+	glm::vec3 m_position;
+	float m_radius;
+	glm::vec3 m_color;
+	int m_object;	// the light follows this object (-1: fixed)
+	glm::vec3 m_offset;	// from the object position, when m_object >= 0
+	int m_shadow;	// first face in the shadow atlas, -1: no shadows
+
+	SPointLight()
+	{
+		m_radius = 0.0f;
+		m_object = -1;
+		m_shadow = -1;
+	}
+
+	SPointLight(const glm::vec3 &position, float radius, const glm::vec3 &color, int object = -1)
+	{
+		m_position = m_offset = position;
+		m_radius = radius;
+		m_color = color;
+		m_object = object;
+		m_shadow = -1;
+	}
+} SPointLight;
+
+// counters of the last bin call
+typedef struct SClusterLightStats
+{
+	int lights;		// in the frustum
+	int references;	// light indices over all the froxels
+	int maxPerCluster;
+	int occupied;	// froxels with at least a light
+	double ms;		// binning time
+} SClusterLightStats;
+
+class CClusteredLights
+{
+public:
+	CClusteredLights()
+	{
+		m_ok = false;
+		for (int i = 0; i < 3; i++)
+			m_buffers[i] = m_textures[i] = 0;
+		m_near = m_far = 1.0f;
+		m_width = m_height = 1;
+		memset(&m_stats, 0, sizeof(m_stats));
+	}
+
+	// buffer textures need OpenGL 3.1, the shaders GLSL 3.30
+	bool create()
+	{
+		if (!GLEW_VERSION_3_3)
+			return false;
+		GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+		glGenBuffers(3, m_buffers);
+		glGenTextures(3, m_textures);
+		for (int i = 0; i < 3; i++)
+		{
+			glBindBuffer(GL_TEXTURE_BUFFER, m_buffers[i]);
+			glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+			glBindTexture(GL_TEXTURE_BUFFER, m_textures[i]);
+			glTexBuffer(GL_TEXTURE_BUFFER, formats[i], m_buffers[i]);
+		}
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		m_ok = true;
+		return true;
+	}
+
+	// froxel bounds in view space, for a symmetric perspective projection
+	void setProjection(const glm::mat4 &projection, int width, int height, float zNear, float zFar)
+	{
+		m_projection = projection;
+		m_width = width;
+		m_height = height;
+		m_near = zNear;
+		m_far = zFar;
+		for (int z = 0; z < CLUSTER_Z; z++)
+		{
+			float d0 = sliceDepth(z), d1 = sliceDepth(z + 1);
+			for (int y = 0; y < CLUSTER_Y; y++)
+			{
+				for (int x = 0; x < CLUSTER_X; x++)
+				{
+					float nx0 = 2.0f * x / CLUSTER_X - 1.0f, nx1 = 2.0f * (x + 1) / CLUSTER_X - 1.0f;
+					float ny0 = 2.0f * y / CLUSTER_Y - 1.0f, ny1 = 2.0f * (y + 1) / CLUSTER_Y - 1.0f;
+					// x = nx * d / P00 grows with d on the right, shrinks on the left
+					int c = index(x, y, z);
+					m_minX[c] = glm::min(nx0 * d0, nx0 * d1) / projection[0][0];
+					m_maxX[c] = glm::max(nx1 * d0, nx1 * d1) / projection[0][0];
+					m_minY[c] = glm::min(ny0 * d0, ny0 * d1) / projection[1][1];
+					m_maxY[c] = glm::max(ny1 * d0, ny1 * d1) / projection[1][1];
+					m_minZ[c] = -d1;
+					m_maxZ[c] = -d0;
+				}
+			}
+		}
+	}
+
+	// bins the lights into the froxels and uploads the result
+	void bin(const vector<SPointLight> &lights, const glm::mat4 &view)
+	{
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		m_lightData.clear();
+		m_hits.clear();
+		memset(m_counts, 0, sizeof(m_counts));
+		int visible = 0;
+		for (int i = 0; i < lights.size(); i++)
+		{
+			glm::vec3 c(view * glm::vec4(lights[i].m_position, 1.0f));
+			float r = lights[i].m_radius;
+			int before = (int)m_hits.size();
+			binSphere(c, r, (int)m_lightData.size() / 8);
+			if ((int)m_hits.size() == before)
+				continue;
+			visible++;
+			float data[8] = { c.x, c.y, c.z, r, lights[i].m_color.r, lights[i].m_color.g, lights[i].m_color.b, (float)lights[i].m_shadow };
+			m_lightData.insert(m_lightData.end(), data, data + 8);
+		}
+
+		// counting sort of the (froxel, light) pairs into one index list
+		unsigned int offset = 0;
+		m_stats.maxPerCluster = m_stats.occupied = 0;
+		for (int c = 0; c < N_CLUSTERS; c++)
+		{
+			m_ranges[2 * c] = offset;
+			m_ranges[2 * c + 1] = 0;
+			offset += m_counts[c];
+			m_stats.maxPerCluster = glm::max(m_stats.maxPerCluster, (int)m_counts[c]);
+			if (m_counts[c])
+				m_stats.occupied++;
+		}
+		m_indices.resize(glm::max(offset, 1u));
+		for (int i = 0; i < m_hits.size(); i++)
+		{
+			unsigned int c = m_hits[i].first;
+			m_indices[m_ranges[2 * c] + m_ranges[2 * c + 1]++] = m_hits[i].second;
+		}
+		m_stats.lights = visible;
+		m_stats.references = offset;
+		m_stats.ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+
+		if (!m_ok)
+			return;
+		if (m_lightData.empty())
+			m_lightData.resize(8, 0.0f);
+		upload(0, m_lightData.data(), m_lightData.size() * sizeof(float));
+		upload(1, m_ranges, sizeof(m_ranges));
+		upload(2, m_indices.data(), m_indices.size() * sizeof(unsigned int));
+	}
+
+	// 0: lights, 1: froxel ranges, 2: light indices (GL_TEXTURE_BUFFER)
+	GLuint texture(int i)
+	{
+		return m_textures[i];
+	}
+
+	// size of the target the frame is drawn to, when it is not the window
+	// (dynamic resolution): only the tiles change, not the froxels
+	void setViewport(int width, int height)
+	{
+		m_width = width;
+		m_height = height;
+	}
+
+	// for the Frame block: tile size in pixels, then scale and bias that
+	// turn log(view depth) into a slice
+	glm::vec4 params()
+	{
+		float scale = CLUSTER_Z / logf(m_far / m_near);
+		return glm::vec4((float)m_width / CLUSTER_X, (float)m_height / CLUSTER_Y, scale, -logf(m_near) * scale);
+	}
+
+	bool m_ok;
+	SClusterLightStats m_stats;
+
+private:
+	static int index(int x, int y, int z)
+	{
+		return (z * CLUSTER_Y + y) * CLUSTER_X + x;
+	}
+
+	// view distance where slice z starts
+	float sliceDepth(int z)
+	{
+		return m_near * powf(m_far / m_near, (float)z / CLUSTER_Z);
+	}
+
+	int slice(float depth)
+	{
+		int z = (int)floorf(logf(depth / m_near) / logf(m_far / m_near) * CLUSTER_Z);
+		return glm::clamp(z, 0, CLUSTER_Z - 1);
+	}
+
+	// tile range covered by [a, b] in normalized device coordinates
+	static void tiles(float a, float b, int n, int &t0, int &t1)
+	{
+		t0 = glm::clamp((int)floorf((a + 1.0f) * 0.5f * n), 0, n - 1);
+		t1 = glm::clamp((int)floorf((b + 1.0f) * 0.5f * n), 0, n - 1);
+	}
+
+	// adds light to every froxel touched by the sphere (c, r) in view space
+	void binSphere(const glm::vec3 &c, float r, unsigned int light)
+	{
+		float d0 = -c.z - r, d1 = -c.z + r;
+		if (d1 < m_near || d0 > m_far)
+			return;
+		int z0 = slice(glm::max(d0, m_near)), z1 = slice(glm::min(d1, m_far));
+
+		// screen rectangle of the sphere box, all of it if the box crosses
+		// the near plane
+		int x0 = 0, x1 = CLUSTER_X - 1, y0 = 0, y1 = CLUSTER_Y - 1;
+		if (d0 > m_near)
+		{
+			float ax = (c.x - r) * m_projection[0][0], bx = (c.x + r) * m_projection[0][0];
+			float ay = (c.y - r) * m_projection[1][1], by = (c.y + r) * m_projection[1][1];
+			float nx0 = glm::min(ax / d0, ax / d1), nx1 = glm::max(bx / d0, bx / d1);
+			float ny0 = glm::min(ay / d0, ay / d1), ny1 = glm::max(by / d0, by / d1);
+			if (nx1 < -1.0f || nx0 > 1.0f || ny1 < -1.0f || ny0 > 1.0f)
+				return;
+			tiles(nx0, nx1, CLUSTER_X, x0, x1);
+			tiles(ny0, ny1, CLUSTER_Y, y0, y1);
+		}
+
+		float r2 = r * r;
+		for (int z = z0; z <= z1; z++)
+		{
+			for (int y = y0; y <= y1; y++)
+			{
+				for (int x = x0 & ~3; x <= x1; x += 4)
+				{
+					int first = index(x, y, z);
+					int mask = test4(first, c, r2);
+					for (int k = 0; k < 4; k++)
+					{
+						if ((mask & (1 << k)) && x + k >= x0 && x + k <= x1)
+						{
+							m_counts[first + k]++;
+							m_hits.push_back(make_pair((unsigned int)(first + k), light));
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// bit k: the sphere touches the box of froxel first+k
+	int test4(int first, const glm::vec3 &c, float r2)
+	{
+#ifdef CLUSTERS_SSE
+		__m128 zero = _mm_setzero_ps();
+		__m128 cx = _mm_set1_ps(c.x), cy = _mm_set1_ps(c.y), cz = _mm_set1_ps(c.z);
+		// distance to the box along each axis, 0 inside
+		__m128 dx = _mm_max_ps(zero, _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&m_minX[first]), cx), _mm_sub_ps(cx, _mm_loadu_ps(&m_maxX[first]))));
+		__m128 dy = _mm_max_ps(zero, _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&m_minY[first]), cy), _mm_sub_ps(cy, _mm_loadu_ps(&m_maxY[first]))));
+		__m128 dz = _mm_max_ps(zero, _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&m_minZ[first]), cz), _mm_sub_ps(cz, _mm_loadu_ps(&m_maxZ[first]))));
+		__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		return _mm_movemask_ps(_mm_cmple_ps(d2, _mm_set1_ps(r2)));
+#else
+		int mask = 0;
+		for (int k = 0; k < 4; k++)
+		{
+			int i = first + k;
+			float dx = glm::max(0.0f, glm::max(m_minX[i] - c.x, c.x - m_maxX[i]));
+			float dy = glm::max(0.0f, glm::max(m_minY[i] - c.y, c.y - m_maxY[i]));
+			float dz = glm::max(0.0f, glm::max(m_minZ[i] - c.z, c.z - m_maxZ[i]));
+			if (dx * dx + dy * dy + dz * dz <= r2)
+				mask |= 1 << k;
+		}
+		return mask;
+#endif
+	}
+
+	void upload(int i, const void *data, size_t size)
+	{
+		glBindBuffer(GL_TEXTURE_BUFFER, m_buffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+
+	glm::mat4 m_projection;
+	int m_width, m_height;
+	float m_near, m_far;
+
+	// froxel boxes in view space, structure of arrays
+	float m_minX[N_CLUSTERS], m_maxX[N_CLUSTERS];
+	float m_minY[N_CLUSTERS], m_maxY[N_CLUSTERS];
+	float m_minZ[N_CLUSTERS], m_maxZ[N_CLUSTERS];
+
+	// per frame: the visible lights in view space (2 texels each), the
+	// first index and count of each froxel, and the light indices
+	vector<float> m_lightData;
+	unsigned int m_counts[N_CLUSTERS];
+	unsigned int m_ranges[2 * N_CLUSTERS];
+	vector<unsigned int> m_indices;
+	vector<pair<unsigned int, unsigned int> > m_hits;
+
+	GLuint m_buffers[3], m_textures[3];
+};
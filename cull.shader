@@ -0,0 +1,72 @@
+#version 430 core
+
+// one invocation per draw: frustum test of the world bounds, then the
+// indirect command of the draw is written (instanceCount 0 when culled).
+// The frustum comes from the camera of the Frame block
+layout (local_size_x = 64) in;
+
+struct DrawRecord
+{
+	vec4 bmin;
+	vec4 bmax;
+	uvec4 info;		// transform index, material index, has normal
+	uvec4 range;	// count, first index, base vertex
+};
+
+struct DrawCommand
+{
+	uint count;
+	uint instanceCount;
+	uint firstIndex;
+	int  baseVertex;
+	uint baseInstance;
+};
+
+layout (std430, binding = 0) readonly buffer Draws { DrawRecord draws[]; };
+layout (std430, binding = 1) readonly buffer Transforms { mat4 transforms[]; };
+layout (std430, binding = 3) writeonly buffer Commands { DrawCommand commands[]; };
+
+layout (std140, binding = 0) uniform Frame
+{
+	mat4 view;
+	mat4 projection;
+	mat4 viewProjection;
+};
+
+uniform uint drawCount;
+uniform int cull;
+
+void main()
+{
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= drawCount)
+		return;
+
+	DrawRecord d = draws[i];
+	bool visible = true;
+	if (cull == 1)
+	{
+		// world space box around the transformed object space box
+		mat4 model = transforms[2 * d.info.x];
+		vec3 c = (d.bmin.xyz + d.bmax.xyz) * 0.5;
+		vec3 e = (d.bmax.xyz - d.bmin.xyz) * 0.5;
+		vec3 wc = (model * vec4(c, 1.0)).xyz;
+		mat3 m = mat3(model);
+		vec3 we = abs(m[0]) * e.x + abs(m[1]) * e.y + abs(m[2]) * e.z;
+		// planes pointing inside, as CGpuScene::frustumPlanes makes them
+		mat4 t = transpose(viewProjection);
+		vec4 planes[6] = vec4[6](t[3] + t[0], t[3] - t[0], t[3] + t[1], t[3] - t[1], t[3] + t[2], t[3] - t[2]);
+		for (int p = 0; p < 6 && visible; p++)
+		{
+			vec4 plane = planes[p] / length(planes[p].xyz);
+			if (dot(plane.xyz, wc) + plane.w + dot(abs(plane.xyz), we) < 0.0)
+				visible = false;
+		}
+	}
+
+	commands[i].count = d.range.x;
+	commands[i].instanceCount = visible ? 1u : 0u;
+	commands[i].firstIndex = d.range.y;
+	commands[i].baseVertex = int(d.range.z);
+	commands[i].baseInstance = i;
+}
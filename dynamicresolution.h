@@ -0,0 +1,194 @@
+#pragma once
+
+#include <chrono>
+#include <math.h>
+#include "gl/glew.h"
+#include "glm/glm.hpp"
+
+using namespace std;
+
+// dynamic resolution: the scene is drawn into an offscreen target at scale
+// times the window size, then stretched to the window. After each frame the
+// GPU time of the scene (timer queries, read some frames later without
+// waiting; without them the CPU time from frame to frame) moves the scale
+// toward the frame time budget. Pixels go with scale^2, so the new scale is
+// scale * sqrt(budget / time), in steps of 1/16. Hysteresis: the scale only
+// moves when the time leaves [m_lowBand, m_highBand] x budget, and then
+// stays for m_holdFrames frames, long enough for the queries to catch up
+#define DYNRES_QUERIES 4
+
+class CDynamicResolution
+{
+public:
+	CDynamicResolution()
+	{
+		m_ok = false;
+		m_timer = false;
+		m_fbo = m_color = m_depth = 0;
+		m_windowWidth = m_windowHeight = 1;
+		m_scale = 1.0f;
+		m_budgetMs = 1000.0f / 60.0f;
+		m_minScale = 0.5f;
+		m_maxScale = 1.0f;
+		m_lowBand = 0.8f;
+		m_highBand = 1.0f;
+		m_holdFrames = 8;
+		m_hold = 0;
+		m_lastMs = 0.0f;
+		m_query = 0;
+		m_timing = false;
+		for (int i = 0; i < DYNRES_QUERIES; i++)
+			m_pending[i] = false;
+	}
+
+	// needs framebuffer objects with blits (OpenGL 3.0)
+	bool create(int width, int height)
+	{
+		if (!GLEW_VERSION_3_0 && !GLEW_ARB_framebuffer_object)
+			return false;
+		glGenFramebuffers(1, &m_fbo);
+		glGenTextures(1, &m_color);
+		glGenRenderbuffers(1, &m_depth);
+		m_timer = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+		if (m_timer)
+			glGenQueries(DYNRES_QUERIES, m_queries);
+		return resize(width, height);
+	}
+
+	// the target is as big as the window, and only partly used below scale 1
+	bool resize(int width, int height)
+	{
+		m_windowWidth = width;
+		m_windowHeight = height;
+		glBindTexture(GL_TEXTURE_2D, m_color);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glBindRenderbuffer(GL_RENDERBUFFER, m_depth);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_color, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depth);
+		m_ok = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return m_ok;
+	}
+
+	// size the scene is drawn at
+	int width()
+	{
+		return glm::max(1, (int)(m_windowWidth * m_scale + 0.5f));
+	}
+
+	int height()
+	{
+		return glm::max(1, (int)(m_windowHeight * m_scale + 0.5f));
+	}
+
+	// binds the target (again, after a pass drew somewhere else)
+	void bind()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		glViewport(0, 0, width(), height());
+	}
+
+	// starts timing the scene of the frame
+	void beginFrame()
+	{
+		if (m_timer && !m_pending[m_query])
+		{
+			glBeginQuery(GL_TIME_ELAPSED, m_queries[m_query]);
+			m_timing = true;
+		}
+	}
+
+	// stops timing, stretches the scene to the window and adapts the scale
+	void endFrame()
+	{
+		float ms = -1.0f;
+		if (m_timing)
+		{
+			glEndQuery(GL_TIME_ELAPSED);
+			m_pending[m_query] = true;
+			m_query = (m_query + 1) % DYNRES_QUERIES;
+			m_timing = false;
+		}
+		if (m_timer)
+		{
+			// oldest first; the first one not done yet stops the reading
+			for (int i = 0; i < DYNRES_QUERIES; i++)
+			{
+				int q = (m_query + i) % DYNRES_QUERIES;
+				if (!m_pending[q])
+					continue;
+				GLuint available = 0;
+				glGetQueryObjectuiv(m_queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available)
+					break;
+				GLuint64 ns = 0;
+				glGetQueryObjectui64v(m_queries[q], GL_QUERY_RESULT, &ns);
+				ms = ns / 1000000.0f;
+				m_pending[q] = false;
+			}
+		}
+		else
+		{
+			// frame to frame, swap included: the GPU time shows up there
+			chrono::steady_clock::time_point now = chrono::steady_clock::now();
+			float frame = chrono::duration<float, milli>(now - m_cpuEnd).count();
+			m_cpuEnd = now;
+			if (frame < 250.0f)
+				ms = frame;
+		}
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, width(), height(), 0, 0, m_windowWidth, m_windowHeight, GL_COLOR_BUFFER_BIT,
+			m_scale == 1.0f ? GL_NEAREST : GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, m_windowWidth, m_windowHeight);
+		if (ms >= 0.0f)
+			adapt(ms);
+	}
+
+	bool m_ok;
+	bool m_timer;		// GPU time from timer queries
+	float m_scale;		// of the window size, now
+	float m_lastMs;		// last time measured
+	float m_budgetMs;
+	float m_minScale, m_maxScale;
+	float m_lowBand, m_highBand;	// of the budget
+	int m_holdFrames;
+
+private:
+	void adapt(float ms)
+	{
+		m_lastMs = ms;
+		if (m_hold > 0)
+		{
+			m_hold--;
+			return;
+		}
+		bool over = ms > m_budgetMs * m_highBand, under = ms < m_budgetMs * m_lowBand;
+		if (!over && !under)
+			return;
+		float s = m_scale * sqrtf(m_budgetMs / glm::max(ms, 0.01f));
+		s = glm::clamp(floorf(s * 16.0f + 0.5f) / 16.0f, m_minScale, m_maxScale);
+		if (s != m_scale)
+		{
+			m_scale = s;
+			m_hold = m_holdFrames;
+		}
+	}
+
+	GLuint m_fbo, m_color, m_depth;
+	int m_windowWidth, m_windowHeight;
+	int m_hold;
+	GLuint m_queries[DYNRES_QUERIES];
+	bool m_pending[DYNRES_QUERIES];
+	int m_query;		// the next one to start
+	bool m_timing;
+	chrono::steady_clock::time_point m_cpuEnd;
+};
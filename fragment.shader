@@ -1,56 +1,181 @@
 #version 330 core
+// permutations, see CShaderCache: TEXTURED, NORMALS, SPECULAR, LIGHTS, SHADOWS, TEXTURE_ARRAY, DEPTH_ONLY
 
+in vec4 outPosition;
+flat in int outMaterial;
+#ifdef TEXTURED
 in vec2 outTex;
+#ifdef TEXTURE_ARRAY
+// packed with the maps of the same size and format, see CTextureArrays
+uniform sampler2DArray texture_diffuse1;
+#else
+uniform sampler2D texture_diffuse1;
+#endif
+#endif
+#ifdef NORMALS
 in vec3 outNormal;
-in vec4 outPosition;
+#endif
 
 out vec4 color;
 
-uniform vec4 ka;
-uniform vec4 kd;
-uniform vec4 ks;
-uniform float shine;
-uniform sampler2D texture_diffuse1;
-uniform int hasTexture;
-uniform int hasNormal;
+struct Material
+{
+    vec4 ka;
+    vec4 kd;
+    vec4 ks;
+    vec4 params;    // shine, has texture, layer in the texture array
+};
 
-void main()
+// every material of the scene, indexed by material id
+layout (std140) uniform Materials
 {
-    if (hasTexture == 1)
-    {
-        if (hasNormal == 1)
-        {
-            // assuming light in eye position
-            vec4 texel = texture(texture_diffuse1, outTex);
-            vec3 L = normalize(-outPosition.xyz);
-            vec3 N = normalize(outNormal);
-            vec3 V = normalize(-outPosition.xyz);
-            vec3 R = normalize(reflect(L, N));
-
-            float diff_coef = abs(dot(N, L));
-            float spec_coef = pow(abs(dot(R, V)), shine);
-
-            color = ka + (texel * (kd*diff_coef + ks*spec_coef));
-            color.a = 1.0;
-        }
-        else
-            color = kd * texture(texture_diffuse1, outTex);
-    }
-    else if (hasNormal == 1)
-    {
-        // assuming light in eye position
-        vec3 L = normalize(-outPosition.xyz);
-        vec3 N = normalize(outNormal);
-        vec3 V = normalize(-outPosition.xyz);
-        vec3 R = normalize(reflect(L, N));
+    Material materials[256];
+};
+
+#ifdef TEXTURED
+// the diffuse map, in the layer of the material when packed
+vec4 diffuse()
+{
+#ifdef TEXTURE_ARRAY
+    return texture(texture_diffuse1, vec3(outTex, materials[outMaterial].params.z));
+#else
+    return texture(texture_diffuse1, outTex);
+#endif
+}
+#endif
+
+#ifdef LIGHTS
+// camera of the frame, see SFrameBlock
+layout (std140) uniform Frame
+{
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    vec4 clusterParams;     // tile size in pixels, log(depth) to slice scale and bias
+};
+
+// clustered point lights, see CClusteredLights
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+uniform samplerBuffer lightData;       // per light: eye position and radius, color and first shadow face
+uniform usamplerBuffer clusterRanges;  // per froxel: first index and count
+uniform usamplerBuffer lightIndices;
+
+#ifdef SHADOWS
+// cached shadow maps, see CShadowAtlas
+#define MAX_SHADOW_FACES 144
+layout (std140) uniform Shadows
+{
+    vec4 sunDirection;      // eye space, towards the sun
+    vec4 sunColor;
+    mat4 sunMatrix;         // eye space to atlas
+    mat4 faceMatrices[MAX_SHADOW_FACES];   // 6 per light: +x, -x, +y, -y, +z, -z
+};
+uniform sampler2DShadow shadowAtlas;
+
+// 0 in the shadow, 1 in the light, filtered in between
+float shadow(mat4 m, vec3 P)
+{
+    vec4 s = m * vec4(P, 1.0);
+    return texture(shadowAtlas, s.xyz / s.w);
+}
 
-        float diff_coef = dot(N, L);
-        float spec_coef = pow(abs(dot(R, V)), shine);
+// the cube face of a point light that sees the direction D (world space)
+int face(vec3 D)
+{
+    vec3 a = abs(D);
+    if (a.x >= a.y && a.x >= a.z)
+        return D.x > 0.0 ? 0 : 1;
+    if (a.y >= a.z)
+        return D.y > 0.0 ? 2 : 3;
+    return D.z > 0.0 ? 4 : 5;
+}
+#endif
 
-        color = ka + diff_coef  * kd + spec_coef * ks;
-        color.a = 1.0;
+// diffuse light of the point lights in the froxel of the fragment
+// (and of the sun, with shadows)
+vec3 pointLights(vec3 P, vec3 N)
+{
+    ivec3 c = ivec3(gl_FragCoord.xy / clusterParams.xy, log(-P.z) * clusterParams.z + clusterParams.w);
+    c = clamp(c, ivec3(0), ivec3(CLUSTER_X - 1, CLUSTER_Y - 1, CLUSTER_Z - 1));
+    uvec2 range = texelFetch(clusterRanges, (c.z * CLUSTER_Y + c.y) * CLUSTER_X + c.x).xy;
+    // lit on the side facing the camera, as the light in the eye
+    N = faceforward(N, P, N);
+    vec3 sum = vec3(0.0);
+    for (uint i = 0u; i < range.y; i++)
+    {
+        int l = int(texelFetch(lightIndices, int(range.x + i)).x);
+        vec4 light = texelFetch(lightData, 2 * l);
+        vec4 color = texelFetch(lightData, 2 * l + 1);
+        vec3 D = light.xyz - P;
+        float d2 = dot(D, D);
+        float fade = clamp(1.0 - d2 / (light.w * light.w), 0.0, 1.0);
+        float lit = fade * fade * max(dot(N, D * inversesqrt(d2)), 0.0);
+#ifdef SHADOWS
+        // view is a rotation and a translation: its transpose turns back to
+        // world. The point moves along the normal about a texel of the face
+        // (256 texels for 90 degrees), against acne
+        if (color.w >= 0.0 && lit > 0.0)
+            lit *= shadow(faceMatrices[int(color.w) + face(transpose(mat3(view)) * -D)], P + N * (0.012 * sqrt(d2)));
+#endif
+        sum += color.rgb * lit;
     }
-    else
-        color = kd;
+#ifdef SHADOWS
+    float sun = max(dot(N, sunDirection.xyz), 0.0);
+    if (sun > 0.0)
+        sum += sunColor.rgb * sun * shadow(sunMatrix, P + N * 15.0);
+#endif
+    return sum;
+}
+#endif
+
+void main()
+{
+    // the depth pre-pass writes no color
+#ifndef DEPTH_ONLY
+    vec4 ka = materials[outMaterial].ka;
+    vec4 kd = materials[outMaterial].kd;
 
+#ifdef NORMALS
+    // assuming light in eye position
+    vec3 L = normalize(-outPosition.xyz);
+    vec3 N = normalize(outNormal);
+#ifdef SPECULAR
+    vec4 ks = materials[outMaterial].ks;
+    float shine = materials[outMaterial].params.x;
+    vec3 V = normalize(-outPosition.xyz);
+    vec3 R = normalize(reflect(L, N));
+    float spec_coef = pow(abs(dot(R, V)), shine);
+#endif
+#ifdef TEXTURED
+    vec4 texel = diffuse();
+    float diff_coef = abs(dot(N, L));
+#ifdef SPECULAR
+    color = ka + (texel * (kd*diff_coef + ks*spec_coef));
+#else
+    color = ka + (texel * (kd*diff_coef));
+#endif
+#else
+    float diff_coef = dot(N, L);
+#ifdef SPECULAR
+    color = ka + diff_coef  * kd + spec_coef * ks;
+#else
+    color = ka + diff_coef  * kd;
+#endif
+#endif
+#ifdef LIGHTS
+#ifdef TEXTURED
+    color.rgb += texel.rgb * kd.rgb * pointLights(outPosition.xyz, N);
+#else
+    color.rgb += kd.rgb * pointLights(outPosition.xyz, N);
+#endif
+#endif
+    color.a = 1.0;
+#elif defined(TEXTURED)
+    color = kd * diffuse();
+#else
+    color = kd;
+#endif
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,72 @@
+#version 430 core
+
+in vec2 outTex;
+in vec3 outNormal;
+in vec4 outPosition;
+flat in uint outMaterial;
+flat in uint outHasNormal;
+
+out vec4 color;
+
+struct Material
+{
+	vec4 ka;
+	vec4 kd;
+	vec4 ks;
+	vec4 params;	// shine, has texture, layer in the texture array (-1: 2D)
+};
+
+layout (std430, binding = 2) readonly buffer Materials { Material materials[]; };
+
+uniform sampler2D texture_diffuse1;
+uniform sampler2DArray texture_layers;	// packed maps, see CTextureArrays
+
+// the diffuse map of a material
+vec4 diffuse(Material m)
+{
+	if (m.params.z >= 0.0)
+		return texture(texture_layers, vec3(outTex, m.params.z));
+	return texture(texture_diffuse1, outTex);
+}
+
+void main()
+{
+	Material m = materials[outMaterial];
+	float shine = m.params.x;
+	if (m.params.y > 0.5)
+	{
+		if (outHasNormal == 1u)
+		{
+			// assuming light in eye position
+			vec4 texel = diffuse(m);
+			vec3 L = normalize(-outPosition.xyz);
+			vec3 N = normalize(outNormal);
+			vec3 V = normalize(-outPosition.xyz);
+			vec3 R = normalize(reflect(L, N));
+
+			float diff_coef = abs(dot(N, L));
+			float spec_coef = pow(abs(dot(R, V)), shine);
+
+			color = m.ka + (texel * (m.kd*diff_coef + m.ks*spec_coef));
+			color.a = 1.0;
+		}
+		else
+			color = m.kd * diffuse(m);
+	}
+	else if (outHasNormal == 1u)
+	{
+		// assuming light in eye position
+		vec3 L = normalize(-outPosition.xyz);
+		vec3 N = normalize(outNormal);
+		vec3 V = normalize(-outPosition.xyz);
+		vec3 R = normalize(reflect(L, N));
+
+		float diff_coef = dot(N, L);
+		float spec_coef = pow(abs(dot(R, V)), shine);
+
+		color = m.ka + diff_coef * m.kd + spec_coef * m.ks;
+		color.a = 1.0;
+	}
+	else
+		color = m.kd;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <chrono>
+#include "glm/glm.hpp"
+
+using namespace std;
+
+// frame pacing on a monotonic clock. beginFrame tells how many fixed
+// simulation steps the time since the last frame is worth, so motion does
+// not depend on the frame rate; endFrame tells how long to wait before the
+// next frame for the target rate, the render and swap time taken off. With
+// vsync the swap already waits for the display and the wait comes out 0.
+// A target of 0 Hz is uncapped (benchmark mode)
+class CFrameScheduler
+{
+public:
+	typedef chrono::steady_clock clock;
+
+	CFrameScheduler()
+	{
+		m_targetHz = 60;
+		m_stepHz = 60;
+		m_idle = true;
+		m_accumulator = 0.0;
+		m_fps = m_cpuMs = 0.0;
+		m_frames = 0;
+		m_cpuSum = 0.0;
+		m_windowStart = m_last = m_frameStart = clock::now();
+	}
+
+	// steps: simulation steps per second
+	void init(int targetHz, int stepHz)
+	{
+		m_targetHz = targetHz;
+		m_stepHz = stepHz;
+	}
+
+	// starts a frame, returns the number of steps to simulate
+	int beginFrame()
+	{
+		m_frameStart = clock::now();
+		double step = 1.0 / m_stepHz;
+		if (m_idle)
+		{
+			// nothing ran while idle: one step now, the clock starts again
+			m_idle = false;
+			m_accumulator = step;
+		}
+		else
+		{
+			// a long stall (a load, a breakpoint) is not caught up
+			m_accumulator += glm::min(seconds(m_frameStart - m_last), 0.25);
+		}
+		m_last = m_frameStart;
+		int steps = 0;
+		while (m_accumulator >= step)
+		{
+			m_accumulator -= step;
+			steps++;
+		}
+		return steps;
+	}
+
+	// ends a frame (after the swap), returns the milliseconds to wait before
+	// the next one, 0 for right away
+	int endFrame()
+	{
+		clock::time_point now = clock::now();
+		double cpu = seconds(now - m_frameStart);
+		m_cpuSum += cpu;
+		m_frames++;
+		double window = seconds(now - m_windowStart);
+		if (window >= 1.0)
+		{
+			m_fps = m_frames / window;
+			m_cpuMs = 1000.0 * m_cpuSum / m_frames;
+			m_frames = 0;
+			m_cpuSum = 0.0;
+			m_windowStart = now;
+		}
+		if (m_targetHz <= 0)
+			return 0;
+		double wait = 1.0 / m_targetHz - cpu;
+		return wait > 0.0 ? (int)(wait * 1000.0 + 0.5) : 0;
+	}
+
+	// no frame follows: the next one starts the clock again
+	void idle()
+	{
+		m_idle = true;
+	}
+
+	int m_targetHz;		// 0: uncapped
+	int m_stepHz;
+	double m_fps;		// measured over the last second of frames
+	double m_cpuMs;		// average render + swap time of those frames
+
+private:
+	static double seconds(clock::duration d)
+	{
+		return chrono::duration<double>(d).count();
+	}
+
+	bool m_idle;
+	double m_accumulator;	// time not simulated yet, in seconds
+	clock::time_point m_last, m_frameStart, m_windowStart;
+	int m_frames;
+	double m_cpuSum;
+};
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <string.h>
+#include "gl/glew.h"
+
+using namespace std;
+
+// thin wrapper over the GL calls issued every frame. It remembers the
+// current program, vao, buffers, bound textures, enabled attribute arrays,
+// face culling, uniform values and attribute locations, and skips calls that would not
+// change anything. Code calling GL directly must call invalidate() after
+class CGLState
+{
+public:
+	// kind of call, for the statistics
+	enum
+	{
+		PROGRAM,
+		VAO,
+		BUFFER,
+		TEXTURE,
+		UNIFORM,
+		ATTRIB_ARRAY,
+		ATTRIB_LOCATION,
+		CULL_FACE,
+		N_KINDS
+	};
+
+	enum { MAX_UNITS = 16, MAX_ATTRIBS = 16 };
+
+	CGLState()
+	{
+		invalidate();
+		resetStats();
+	}
+
+	// forget everything, the next call of each kind is always issued
+	void invalidate()
+	{
+		m_program = ~0u;
+		m_vao = ~0u;
+		m_arrayBuffer = ~0u;
+		m_unit = -1;
+		for (int i = 0; i < MAX_UNITS; i++)
+			m_textures[i] = ~0u;
+		m_attribsKnown = 0;
+		m_attribs = 0;
+		m_cullFace = -1;
+		m_uniforms.clear();
+	}
+
+	// textures were bound behind our back (e.g. by SOIL)
+	void invalidateTextures()
+	{
+		m_unit = -1;
+		for (int i = 0; i < MAX_UNITS; i++)
+			m_textures[i] = ~0u;
+	}
+
+	// a program was (re)linked: its uniforms and attribute locations are new
+	void invalidateProgram(GLuint p)
+	{
+		for (map<unsigned long long, SUniform>::iterator it = m_uniforms.begin(); it != m_uniforms.end();)
+		{
+			if ((GLuint)(it->first >> 32) == p)
+				m_uniforms.erase(it++);
+			else
+				++it;
+		}
+		for (map<pair<GLuint, string>, GLint>::iterator it = m_attribLocations.begin(); it != m_attribLocations.end();)
+		{
+			if (it->first.first == p)
+				m_attribLocations.erase(it++);
+			else
+				++it;
+		}
+	}
+
+	void useProgram(GLuint p)
+	{
+		if (!count(PROGRAM, m_program != p))
+			return;
+		m_program = p;
+		glUseProgram(p);
+	}
+
+	void bindVertexArray(GLuint vao)
+	{
+		if (!count(VAO, m_vao != vao))
+			return;
+		m_vao = vao;
+		glBindVertexArray(vao);
+	}
+
+	// only GL_ARRAY_BUFFER is tracked, element buffers belong to the vao
+	void bindArrayBuffer(GLuint b)
+	{
+		if (!count(BUFFER, m_arrayBuffer != b))
+			return;
+		m_arrayBuffer = b;
+		glBindBuffer(GL_ARRAY_BUFFER, b);
+	}
+
+	// a unit is always used with the same target
+	void bindTexture(int unit, GLuint t, GLenum target = GL_TEXTURE_2D)
+	{
+		if (!count(TEXTURE, m_textures[unit] != t))
+			return;
+		if (m_unit != unit)
+		{
+			m_unit = unit;
+			glActiveTexture(GL_TEXTURE0 + unit);
+		}
+		m_textures[unit] = t;
+		glBindTexture(target, t);
+	}
+
+	// attribute arrays outside of a vao (the GLSL 1.20 path)
+	void enableAttrib(GLint loc, bool enable)
+	{
+		if (loc < 0 || loc >= MAX_ATTRIBS)
+			return;
+		unsigned int bit = 1u << loc;
+		bool known = (m_attribsKnown & bit) != 0;
+		bool enabled = (m_attribs & bit) != 0;
+		if (!count(ATTRIB_ARRAY, !known || enabled != enable))
+			return;
+		m_attribsKnown |= bit;
+		if (enable)
+		{
+			m_attribs |= bit;
+			glEnableVertexAttribArray(loc);
+		}
+		else
+		{
+			m_attribs &= ~bit;
+			glDisableVertexAttribArray(loc);
+		}
+	}
+
+	// GL_CULL_FACE, on for the meshes whose back faces can not be seen
+	void cullFace(bool enable)
+	{
+		if (!count(CULL_FACE, m_cullFace != (int)enable))
+			return;
+		m_cullFace = enable;
+		if (enable)
+			glEnable(GL_CULL_FACE);
+		else
+			glDisable(GL_CULL_FACE);
+	}
+
+	GLint attribLocation(GLuint p, const char *name)
+	{
+		pair<GLuint, string> key(p, name);
+		map<pair<GLuint, string>, GLint>::iterator it = m_attribLocations.find(key);
+		if (!count(ATTRIB_LOCATION, it == m_attribLocations.end()))
+			return it->second;
+		GLint loc = glGetAttribLocation(p, name);
+		m_attribLocations[key] = loc;
+		return loc;
+	}
+
+	// uniforms of the current program
+	void uniform1i(GLint loc, int x)
+	{
+		float v[1] = { (float)x };
+		if (changed(loc, v, 1))
+			glUniform1i(loc, x);
+	}
+
+	void uniform1f(GLint loc, float x)
+	{
+		float v[1] = { x };
+		if (changed(loc, v, 1))
+			glUniform1f(loc, x);
+	}
+
+	void uniform4f(GLint loc, float x, float y, float z, float w)
+	{
+		float v[4] = { x, y, z, w };
+		if (changed(loc, v, 4))
+			glUniform4f(loc, x, y, z, w);
+	}
+
+	void uniformMatrix4fv(GLint loc, const float *m)
+	{
+		if (changed(loc, m, 16))
+			glUniformMatrix4fv(loc, 1, GL_FALSE, m);
+	}
+
+	void resetStats()
+	{
+		for (int i = 0; i < N_KINDS; i++)
+			m_issued[i] = m_skipped[i] = 0;
+	}
+
+	// calls issued and skipped since resetStats, per kind
+	int m_issued[N_KINDS];
+	int m_skipped[N_KINDS];
+
+private:
+	typedef struct SUniform
+	{
+		float v[16];
+		int n;
+	} SUniform;
+
+	bool count(int kind, bool needed)
+	{
+		if (needed)
+			m_issued[kind]++;
+		else
+			m_skipped[kind]++;
+		return needed;
+	}
+
+	// true (and cached) if the uniform value differs from the last one set
+	bool changed(GLint loc, const float *v, int n)
+	{
+		if (loc < 0)
+			return false;
+		if (m_program == ~0u)
+			return count(UNIFORM, true);	// unknown program, nothing to compare with
+		SUniform &u = m_uniforms[((unsigned long long)m_program << 32) | (GLuint)loc];
+		if (!count(UNIFORM, u.n != n || memcmp(u.v, v, n * sizeof(float)) != 0))
+			return false;
+		u.n = n;
+		memcpy(u.v, v, n * sizeof(float));
+		return true;
+	}
+
+	GLuint m_program, m_vao, m_arrayBuffer;
+	int m_unit;
+	GLuint m_textures[MAX_UNITS];
+	unsigned int m_attribsKnown, m_attribs;
+	int m_cullFace;	// -1 unknown
+	map<unsigned long long, SUniform> m_uniforms;
+	map<pair<GLuint, string>, GLint> m_attribLocations;
+};
@@ -0,0 +1,687 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <unordered_map>
+#include <string.h>
+#include "gl/glew.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/type_ptr.hpp"
+#include "shader.h"
+
+// GPU-driven rendering: every mesh of the scene lives inside a few big
+// vertex/index arenas, per-draw data lives in storage buffers and the whole
+// scene is submitted with one glMultiDrawElementsIndirect per pipeline state
+// (arena + diffuse texture, or texture array for packed maps). Needs OpenGL 4.3 (multi draw indirect, SSBO and
+// compute shaders), which Mesa llvmpipe provides.
+
+// vertex format used by the arenas (interleaved, 32 bytes)
+typedef struct SArenaVertex
+{
+	float px, py, pz;
+	float nx, ny, nz;
+	float s, t;
+} SArenaVertex;
+
+// layout of one indirect command, as expected by glMultiDrawElementsIndirect
+typedef struct SDrawCommand
+{
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint  baseVertex;
+	GLuint baseInstance;
+} SDrawCommand;
+
+// per-draw data read by the cull and vertex shaders (std430, 64 bytes)
+typedef struct SGpuDrawRecord
+{
+	float  bmin[4], bmax[4];	// object space bounds
+	GLuint transformIndex;		// object slot, model matrix is transforms[2*slot]
+	GLuint materialIndex;		// index in the material buffer
+	GLuint hasNormal;
+	GLuint pad0;
+	GLuint count;				// range in the arena
+	GLuint firstIndex;
+	GLint  baseVertex;
+	GLuint pad1;
+} SGpuDrawRecord;
+
+// material as seen by fragment_mdi.shader (std430, 64 bytes)
+typedef struct SGpuMaterial
+{
+	float ka[4];
+	float kd[4];
+	float ks[4];
+	float shine, hasTexture;
+	float layer;	// of the diffuse map in its texture array, -1 for a 2D texture
+	float pad1;
+} SGpuMaterial;
+
+// first-fit allocator of [offset, offset+size) ranges inside a buffer
+class CRangeAllocator
+{
+public:
+	CRangeAllocator()
+	{
+		m_capacity = 0;
+	}
+
+	void reset(GLuint capacity)
+	{
+		m_capacity = capacity;
+		m_free.clear();
+		m_free[0] = capacity;
+	}
+
+	// returns false if there is no free range big enough
+	bool alloc(GLuint size, GLuint &offset)
+	{
+		for (map<GLuint, GLuint>::iterator it = m_free.begin(); it != m_free.end(); ++it)
+		{
+			if (it->second >= size)
+			{
+				offset = it->first;
+				GLuint left = it->second - size;
+				m_free.erase(it);
+				if (left)
+					m_free[offset + size] = left;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// gives a range back, merging it with its neighbours
+	void release(GLuint offset, GLuint size)
+	{
+		if (!size)
+			return;
+		map<GLuint, GLuint>::iterator next = m_free.lower_bound(offset);
+		if (next != m_free.begin())
+		{
+			map<GLuint, GLuint>::iterator prev = next;
+			--prev;
+			if (prev->first + prev->second == offset)
+			{
+				offset = prev->first;
+				size += prev->second;
+				m_free.erase(prev);
+			}
+		}
+		if (next != m_free.end() && offset + size == next->first)
+		{
+			size += next->second;
+			m_free.erase(next);
+		}
+		m_free[offset] = size;
+	}
+
+	GLuint m_capacity;
+
+	// free ranges: offset -> size
+	map<GLuint, GLuint> m_free;
+};
+
+// one big vertex + index buffer pair with its vao
+class CGeometryArena
+{
+public:
+	CGeometryArena()
+	{
+		m_vao = m_vbo = m_ibo = 0;
+	}
+
+	void create(GLuint vertexCapacity, GLuint indexCapacity, GLuint drawIdBuffer)
+	{
+		m_vertices.reset(vertexCapacity);
+		m_indices.reset(indexCapacity);
+
+		glGenVertexArrays(1, &m_vao);
+		glGenBuffers(1, &m_vbo);
+		glGenBuffers(1, &m_ibo);
+		glBindVertexArray(m_vao);
+
+		glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertexCapacity * sizeof(SArenaVertex), NULL, GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SArenaVertex), (void*)0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(SArenaVertex), (void*)(3 * sizeof(float)));
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(SArenaVertex), (void*)(6 * sizeof(float)));
+
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCapacity * sizeof(GLuint), NULL, GL_STATIC_DRAW);
+
+		bindDrawIds(drawIdBuffer);
+		glBindVertexArray(0);
+	}
+
+	// the draw id is an instanced attribute, so it is offset by baseInstance
+	void bindDrawIds(GLuint drawIdBuffer)
+	{
+		glBindVertexArray(m_vao);
+		glBindBuffer(GL_ARRAY_BUFFER, drawIdBuffer);
+		glEnableVertexAttribArray(3);
+		glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, 0, (void*)0);
+		glVertexAttribDivisor(3, 1);
+		glBindVertexArray(0);
+	}
+
+	void destroy()
+	{
+		if (m_vao)
+		{
+			glDeleteVertexArrays(1, &m_vao);
+			glDeleteBuffers(1, &m_vbo);
+			glDeleteBuffers(1, &m_ibo);
+		}
+		m_vao = m_vbo = m_ibo = 0;
+	}
+
+	GLuint m_vao, m_vbo, m_ibo;
+	CRangeAllocator m_vertices, m_indices;
+};
+
+// the gpu-driven scene
+class CGpuScene
+{
+public:
+	// default arena size, bigger meshes get an arena of their own
+	enum { ARENA_VERTICES = 1 << 18, ARENA_INDICES = 3 << 18 };
+
+	CGpuScene()
+	{
+		m_ok = false;
+		m_dirty = true;
+		m_drawBuffer = m_transformBuffer = m_materialBuffer = m_commandBuffer = m_drawIdBuffer = 0;
+		m_drawCapacity = m_transformCapacity = m_materialCapacity = 0;
+	}
+
+	// compiles the shaders; returns false when OpenGL 4.3 is not there
+	bool init()
+	{
+		if (!GLEW_VERSION_4_3)
+		{
+			printf("GPU-driven rendering needs OpenGL 4.3\n");
+			return false;
+		}
+		if (!m_shader.loadShader("vertex_mdi.shader", "fragment_mdi.shader") ||
+			!m_cullShader.loadComputeShader("cull.shader"))
+			return false;
+
+		m_iLocTexture = glGetUniformLocation(m_shader.getProgram(), "texture_diffuse1");
+		m_iLocLayers = glGetUniformLocation(m_shader.getProgram(), "texture_layers");
+		m_iLocDrawCount = glGetUniformLocation(m_cullShader.getProgram(), "drawCount");
+		m_iLocCull = glGetUniformLocation(m_cullShader.getProgram(), "cull");
+
+		glGenBuffers(1, &m_drawBuffer);
+		glGenBuffers(1, &m_transformBuffer);
+		glGenBuffers(1, &m_materialBuffer);
+		glGenBuffers(1, &m_commandBuffer);
+		glGenBuffers(1, &m_drawIdBuffer);
+		m_ok = true;
+		return true;
+	}
+
+	// versions of the object slot last seen by the scene
+	unsigned int geometryVersion(int slot)
+	{
+		return slot < (int)m_objects.size() ? m_objects[slot].m_geometryVersion : ~0u;
+	}
+
+	unsigned int transformVersion(int slot)
+	{
+		return slot < (int)m_objects.size() ? m_objects[slot].m_transformVersion : ~0u;
+	}
+
+	// drops the geometry of an object slot, before feeding it again
+	void beginObject(int slot, unsigned int geometryVersion)
+	{
+		if (slot >= (int)m_objects.size())
+			m_objects.resize(slot + 1);
+		SObject &o = m_objects[slot];
+		for (int i = 0; i < (int)o.m_draws.size(); i++)
+		{
+			SDraw &d = o.m_draws[i];
+			m_arenas[d.m_arena].m_vertices.release(d.m_baseVertex, d.m_vertexCount);
+			m_arenas[d.m_arena].m_indices.release(d.m_firstIndex, d.m_indexCount);
+		}
+		o.m_draws.clear();
+		o.m_materials.clear();
+		o.m_textures.clear();
+		o.m_geometryVersion = geometryVersion;
+		o.m_transformVersion = ~0u;
+		m_dirty = true;
+	}
+
+	// adds a material to the current object, returns its local index.
+	// layer: of texture when it is a texture array, else -1
+	int addMaterial(int slot, const float ka[3], const float kd[3], const float ks[3], float shine, GLuint texture, int layer)
+	{
+		SGpuMaterial m;
+		for (int i = 0; i < 3; i++)
+		{
+			m.ka[i] = ka[i];
+			m.kd[i] = kd[i];
+			m.ks[i] = ks[i];
+		}
+		m.ka[3] = m.kd[3] = m.ks[3] = 1.0f;
+		m.shine = shine;
+		m.hasTexture = texture ? 1.0f : 0.0f;
+		m.layer = (float)layer;
+		m.pad1 = 0.0f;
+		m_objects[slot].m_materials.push_back(m);
+		m_objects[slot].m_textures.push_back(texture);
+		return (int)m_objects[slot].m_materials.size() - 1;
+	}
+
+	// the diffuse map of a material moved (into a texture array or back)
+	void setTexture(int slot, int material, GLuint texture, int layer)
+	{
+		SObject &o = m_objects[slot];
+		if (o.m_textures[material] == texture && o.m_materials[material].layer == (float)layer)
+			return;
+		o.m_textures[material] = texture;
+		o.m_materials[material].layer = (float)layer;
+		m_dirty = true;
+	}
+
+	// adds a non indexed triangle list to the object; vertices are welded
+	// and the result is suballocated inside an arena.
+	// normals and texCoords may be NULL
+	void addMesh(int slot, int material, const float *positions, const float *normals, const float *texCoords,
+		int vertexCount, const float bmin[3], const float bmax[3])
+	{
+		vector<SArenaVertex> verts;
+		vector<GLuint> indices;
+		weld(positions, normals, texCoords, vertexCount, verts, indices);
+		if (indices.empty())
+			return;
+
+		SDraw d;
+		d.m_material = material;
+		d.m_hasNormal = normals != NULL;
+		d.m_vertexCount = (GLuint)verts.size();
+		d.m_indexCount = (GLuint)indices.size();
+		for (int i = 0; i < 3; i++)
+		{
+			d.m_bmin[i] = bmin[i];
+			d.m_bmax[i] = bmax[i];
+		}
+
+		// first arena with enough room, or a new one
+		d.m_arena = -1;
+		for (int a = 0; a < (int)m_arenas.size() && d.m_arena < 0; a++)
+		{
+			GLuint v, i;
+			if (!m_arenas[a].m_vertices.alloc(d.m_vertexCount, v))
+				continue;
+			if (!m_arenas[a].m_indices.alloc(d.m_indexCount, i))
+			{
+				m_arenas[a].m_vertices.release(v, d.m_vertexCount);
+				continue;
+			}
+			d.m_arena = a;
+			d.m_baseVertex = v;
+			d.m_firstIndex = i;
+		}
+		if (d.m_arena < 0)
+		{
+			CGeometryArena arena;
+			arena.create(glm::max((GLuint)ARENA_VERTICES, d.m_vertexCount), glm::max((GLuint)ARENA_INDICES, d.m_indexCount), m_drawIdBuffer);
+			arena.m_vertices.alloc(d.m_vertexCount, d.m_baseVertex);
+			arena.m_indices.alloc(d.m_indexCount, d.m_firstIndex);
+			d.m_arena = (int)m_arenas.size();
+			m_arenas.push_back(arena);
+		}
+
+		// uploading into the arena
+		CGeometryArena &arena = m_arenas[d.m_arena];
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, arena.m_vbo);
+		glBufferSubData(GL_ARRAY_BUFFER, d.m_baseVertex * sizeof(SArenaVertex), verts.size() * sizeof(SArenaVertex), verts.data());
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.m_ibo);
+		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, d.m_firstIndex * sizeof(GLuint), indices.size() * sizeof(GLuint), indices.data());
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+		m_objects[slot].m_draws.push_back(d);
+		m_dirty = true;
+	}
+
+	// updates the model and normal matrices of an object slot
+	void setTransform(int slot, unsigned int version, const glm::mat4 &model, const glm::mat4 &normalMat)
+	{
+		m_objects[slot].m_transformVersion = version;
+		m_objects[slot].m_model = model;
+		m_objects[slot].m_normalMat = normalMat;
+		if ((GLuint)slot >= m_transformCapacity)
+			m_dirty = true;
+		if (m_dirty)
+			return;	// the whole buffer will be uploaded by build()
+		glm::mat4 m[2] = { model, normalMat };
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_transformBuffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, slot * sizeof(m), sizeof(m), m);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	// renders the whole scene. The indirect commands are written by
+	// cull.shader; with gpuCull off every draw is kept visible.
+	// The camera comes from the Frame uniform block (binding 0), which
+	// the caller has filled for the frame
+	void render(bool gpuCull)
+	{
+		if (!m_ok)
+			return;
+		if (m_dirty)
+			build();
+		if (m_records.empty())
+			return;
+		GLuint n = (GLuint)m_records.size();
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_drawBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_transformBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_materialBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_commandBuffer);
+
+		// frustum culling: one thread per draw writes its indirect command
+		m_cullShader.setCurrent();
+		glUniform1ui(m_iLocDrawCount, n);
+		glUniform1i(m_iLocCull, gpuCull ? 1 : 0);
+		glDispatchCompute((n + 63) / 64, 1, 1);
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+		m_shader.setCurrent();
+		glUniform1i(m_iLocTexture, 0);
+		glUniform1i(m_iLocLayers, 1);
+		glActiveTexture(GL_TEXTURE0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+
+		// one submission per pipeline state
+		int arena = -1;
+		for (int i = 0; i < (int)m_batches.size(); i++)
+		{
+			const SBatch &b = m_batches[i];
+			if (b.m_arena != arena)
+			{
+				arena = b.m_arena;
+				glBindVertexArray(m_arenas[arena].m_vao);
+			}
+			if (b.m_array)
+			{
+				glActiveTexture(GL_TEXTURE1);
+				glBindTexture(GL_TEXTURE_2D_ARRAY, b.m_texture);
+				glActiveTexture(GL_TEXTURE0);
+			}
+			else
+				glBindTexture(GL_TEXTURE_2D, b.m_texture);
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(b.m_first * sizeof(SDrawCommand)), b.m_count, 0);
+		}
+		glBindVertexArray(0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+
+	// number of draws and batches, for statistics
+	int drawCount() { return (int)m_records.size(); }
+	int batchCount() { return (int)m_batches.size(); }
+
+	bool m_ok;
+
+	// frustum planes (pointing inside) of a view-projection matrix
+	static void frustumPlanes(const glm::mat4 &vp, glm::vec4 planes[6])
+	{
+		glm::vec4 r0(vp[0][0], vp[1][0], vp[2][0], vp[3][0]);
+		glm::vec4 r1(vp[0][1], vp[1][1], vp[2][1], vp[3][1]);
+		glm::vec4 r2(vp[0][2], vp[1][2], vp[2][2], vp[3][2]);
+		glm::vec4 r3(vp[0][3], vp[1][3], vp[2][3], vp[3][3]);
+		planes[0] = r3 + r0;
+		planes[1] = r3 - r0;
+		planes[2] = r3 + r1;
+		planes[3] = r3 - r1;
+		planes[4] = r3 + r2;
+		planes[5] = r3 - r2;
+		for (int i = 0; i < 6; i++)
+			planes[i] /= glm::length(glm::vec3(planes[i]));
+	}
+
+	// false when the box is fully outside one of the planes
+	static bool boxVisible(const glm::vec4 planes[6], const glm::vec3 &bmin, const glm::vec3 &bmax)
+	{
+		for (int i = 0; i < 6; i++)
+		{
+			// corner of the box farthest along the plane normal
+			glm::vec3 p(planes[i].x > 0 ? bmax.x : bmin.x, planes[i].y > 0 ? bmax.y : bmin.y, planes[i].z > 0 ? bmax.z : bmin.z);
+			if (glm::dot(glm::vec3(planes[i]), p) + planes[i].w < 0)
+				return false;
+		}
+		return true;
+	}
+
+private:
+	// one mesh of one object, inside an arena
+	typedef struct SDraw
+	{
+		int m_arena;
+		int m_material;
+		GLuint m_hasNormal;
+		GLuint m_baseVertex, m_vertexCount;
+		GLuint m_firstIndex, m_indexCount;
+		float m_bmin[3], m_bmax[3];
+	} SDraw;
+
+	typedef struct SObject
+	{
+		vector<SDraw> m_draws;
+		vector<SGpuMaterial> m_materials;
+		vector<GLuint> m_textures;
+		glm::mat4 m_model, m_normalMat;
+		unsigned int m_geometryVersion, m_transformVersion;
+
+		SObject()
+		{
+			m_geometryVersion = m_transformVersion = ~0u;
+		}
+	} SObject;
+
+	// consecutive commands sharing the same pipeline state
+	typedef struct SBatch
+	{
+		int m_arena;
+		GLuint m_texture;
+		bool m_array;	// m_texture is a texture array
+		GLuint m_first, m_count;
+	} SBatch;
+
+	struct SVertexHash
+	{
+		size_t operator()(const SArenaVertex &v) const
+		{
+			const unsigned int *p = (const unsigned int *)&v;
+			size_t h = 2166136261u;
+			for (int i = 0; i < 8; i++)
+				h = (h ^ p[i]) * 16777619u;
+			return h;
+		}
+	};
+
+	struct SVertexEqual
+	{
+		bool operator()(const SArenaVertex &a, const SArenaVertex &b) const
+		{
+			return memcmp(&a, &b, sizeof(SArenaVertex)) == 0;
+		}
+	};
+
+	// builds an indexed mesh out of a triangle soup
+	void weld(const float *positions, const float *normals, const float *texCoords, int n,
+		vector<SArenaVertex> &verts, vector<GLuint> &indices)
+	{
+		unordered_map<SArenaVertex, GLuint, SVertexHash, SVertexEqual> lookup;
+		lookup.reserve(n);
+		verts.reserve(n);
+		indices.reserve(n);
+		for (int i = 0; i < n; i++)
+		{
+			SArenaVertex v;
+			memset(&v, 0, sizeof(v));
+			v.px = positions[3 * i + 0];
+			v.py = positions[3 * i + 1];
+			v.pz = positions[3 * i + 2];
+			if (normals)
+			{
+				v.nx = normals[3 * i + 0];
+				v.ny = normals[3 * i + 1];
+				v.nz = normals[3 * i + 2];
+			}
+			if (texCoords)
+			{
+				v.s = texCoords[2 * i + 0];
+				v.t = texCoords[2 * i + 1];
+			}
+			pair<unordered_map<SArenaVertex, GLuint, SVertexHash, SVertexEqual>::iterator, bool> r =
+				lookup.insert(make_pair(v, (GLuint)verts.size()));
+			if (r.second)
+				verts.push_back(v);
+			indices.push_back(r.first->second);
+		}
+	}
+
+	// resizes a buffer if it is too small for size bytes
+	void reserve(GLenum target, GLuint buffer, GLuint &capacity, GLuint needed, GLuint elementSize)
+	{
+		if (needed <= capacity)
+			return;
+		capacity = glm::max(needed, capacity * 2);
+		glBindBuffer(target, buffer);
+		glBufferData(target, capacity * elementSize, NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(target, 0);
+	}
+
+	// lays out draw records, materials and transforms after a geometry change.
+	// Records are sorted by pipeline state so every batch is a contiguous
+	// range of commands; record i always writes command i
+	void build()
+	{
+		m_dirty = false;
+		m_records.clear();
+		m_batches.clear();
+
+		// global material table
+		vector<SGpuMaterial> materials;
+		vector<GLuint> firstMaterial(m_objects.size());
+		for (int o = 0; o < (int)m_objects.size(); o++)
+		{
+			firstMaterial[o] = (GLuint)materials.size();
+			materials.insert(materials.end(), m_objects[o].m_materials.begin(), m_objects[o].m_materials.end());
+		}
+
+		// sort keys: arena, texture, then the draw itself
+		vector<pair<pair<int, GLuint>, pair<int, int> > > order;
+		for (int o = 0; o < (int)m_objects.size(); o++)
+		{
+			for (int i = 0; i < (int)m_objects[o].m_draws.size(); i++)
+			{
+				const SDraw &d = m_objects[o].m_draws[i];
+				order.push_back(make_pair(make_pair(d.m_arena, m_objects[o].m_textures[d.m_material]), make_pair(o, i)));
+			}
+		}
+		sort(order.begin(), order.end());
+
+		vector<SDrawCommand> commands;
+		for (int k = 0; k < (int)order.size(); k++)
+		{
+			int o = order[k].second.first;
+			const SDraw &d = m_objects[o].m_draws[order[k].second.second];
+			SGpuDrawRecord r;
+			memset(&r, 0, sizeof(r));
+			for (int i = 0; i < 3; i++)
+			{
+				r.bmin[i] = d.m_bmin[i];
+				r.bmax[i] = d.m_bmax[i];
+			}
+			r.transformIndex = o;
+			r.materialIndex = firstMaterial[o] + d.m_material;
+			r.hasNormal = d.m_hasNormal;
+			r.count = d.m_indexCount;
+			r.firstIndex = d.m_firstIndex;
+			r.baseVertex = d.m_baseVertex;
+			m_records.push_back(r);
+
+			SDrawCommand c;
+			c.count = d.m_indexCount;
+			c.instanceCount = 1;
+			c.firstIndex = d.m_firstIndex;
+			c.baseVertex = d.m_baseVertex;
+			c.baseInstance = (GLuint)k;
+			commands.push_back(c);
+
+			if (m_batches.empty() || m_batches.back().m_arena != order[k].first.first || m_batches.back().m_texture != order[k].first.second)
+			{
+				SBatch b;
+				b.m_arena = order[k].first.first;
+				b.m_texture = order[k].first.second;
+				b.m_array = m_objects[o].m_materials[d.m_material].layer >= 0.0f;
+				b.m_first = (GLuint)k;
+				b.m_count = 0;
+				m_batches.push_back(b);
+			}
+			m_batches.back().m_count++;
+		}
+
+		GLuint n = (GLuint)m_records.size();
+		if (n == 0)
+			return;
+
+		// draw ids 0..n-1, read through baseInstance
+		if (n > m_drawCapacity)
+		{
+			reserve(GL_SHADER_STORAGE_BUFFER, m_drawBuffer, m_drawCapacity, n, sizeof(SGpuDrawRecord));
+			GLuint cap = 0;
+			reserve(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer, cap, m_drawCapacity, sizeof(SDrawCommand));
+			vector<GLuint> ids(m_drawCapacity);
+			for (GLuint i = 0; i < m_drawCapacity; i++)
+				ids[i] = i;
+			glBindBuffer(GL_ARRAY_BUFFER, m_drawIdBuffer);
+			glBufferData(GL_ARRAY_BUFFER, ids.size() * sizeof(GLuint), ids.data(), GL_STATIC_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			for (int a = 0; a < (int)m_arenas.size(); a++)
+				m_arenas[a].bindDrawIds(m_drawIdBuffer);
+		}
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_drawBuffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, n * sizeof(SGpuDrawRecord), m_records.data());
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, n * sizeof(SDrawCommand), commands.data());
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+		reserve(GL_SHADER_STORAGE_BUFFER, m_materialBuffer, m_materialCapacity, (GLuint)materials.size(), sizeof(SGpuMaterial));
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_materialBuffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, materials.size() * sizeof(SGpuMaterial), materials.data());
+
+		vector<glm::mat4> transforms(2 * m_objects.size());
+		for (int o = 0; o < (int)m_objects.size(); o++)
+		{
+			transforms[2 * o] = m_objects[o].m_model;
+			transforms[2 * o + 1] = m_objects[o].m_normalMat;
+		}
+		reserve(GL_SHADER_STORAGE_BUFFER, m_transformBuffer, m_transformCapacity, (GLuint)m_objects.size(), 2 * sizeof(glm::mat4));
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_transformBuffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, transforms.size() * sizeof(glm::mat4), transforms.data());
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	vector<CGeometryArena> m_arenas;
+	vector<SObject> m_objects;
+	vector<SGpuDrawRecord> m_records;
+	vector<SBatch> m_batches;
+	bool m_dirty;
+
+	// buffers (capacities are in elements)
+	GLuint m_drawBuffer, m_transformBuffer, m_materialBuffer, m_commandBuffer, m_drawIdBuffer;
+	GLuint m_drawCapacity, m_transformCapacity, m_materialCapacity;
+
+	CShader m_shader, m_cullShader;
+	GLint m_iLocTexture, m_iLocLayers;
+	GLint m_iLocDrawCount, m_iLocCull;
+};
@@ -1,5 +1,20 @@
 ﻿
 #include "shader.h"
+#include "gpuscene.h"
+#include "renderqueue.h"
+#include "glstate.h"
+#include "uniformbuffers.h"
+#include "shadercache.h"
+#include "meshlets.h"
+#include "winding.h"
+#include "clusteredlights.h"
+#include "shadowatlas.h"
+#include "framescheduler.h"
+#include "triplebuffer.h"
+#include "workerpool.h"
+#include "dynamicresolution.h"
+#include "texturestreamer.h"
+#include "texturearrays.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <list>
@@ -7,7 +22,12 @@
 #include <map>
 #include <string>
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <math.h>
+#include <float.h>
 
 // SOIL to load textures
 #include "SOIL/SOIL.h"
@@ -35,15 +55,26 @@
 // how fast is the rotation per mouse "delta"
 #define SPEED_ROTATE 0.005f
 
-// how fast the user can be moved with the keyboard, in millimeters
+// how fast the user can be moved with the keyboard, in millimeters per 1/60 s
 #define SPEED_MOVE 100.0f
 
+// the camera moves in fixed steps, CAMERA_HZ per second, whatever the
+// frame rate
+#define CAMERA_HZ 240
+
 // objects folder relative to current folder
 #define OBJPATH string("./objects/")
 
 // number of objects in the scene
 #define N_OBJECTS 23
 
+// decoded textures uploaded per frame at most (see CTextureStreamer)
+#define TEXTURE_UPLOADS_PER_FRAME 2
+
+// GPU memory for the textures at start, 0 for no budget (see
+// CTextureStreamer); 'V' goes through smaller ones
+#define TEXTURE_BUDGET_MB 0
+
 /*RiGHT-CLICK Menu items Begin */
 //Walls color enum
 #define RED 1
@@ -61,14 +92,11 @@
 
 // libraries to link
 #pragma comment(lib, "glew32.lib")
-#pragma comment(lib, "soil32.lib")
 
 //opengl 3.X & glsl 3XX availability
 bool isOpenGL3Available = true;
 
 // matrices
-glm::mat4 g_model;
-glm::mat4 g_normalMat;
 glm::mat4 g_view;
 glm::mat4 g_projection;
 
@@ -81,19 +109,92 @@ glm::vec3 g_front(0, 0, -1);
 glm::vec3 g_up (0,1,0);
 glm::vec3 g_right (1,0,0);
 
-// last key pressed: 0=left, 1=right, 2=up, 3=down
-int g_lastKeys[4];
-
-// texture map: given a string, return its ID in OpenGL
-map <string, unsigned int> g_texManager;
-
-// shader
-CShader g_shader;
+// last key pressed: 0=left, 1=right, 2=up, 3=down (read by the simulation thread)
+atomic<int> g_lastKeys[4];
+
+// textures: given a path, its ID in OpenGL, a placeholder while it loads
+CTextureStreamer g_textures;
+
+// 'A': once every requested file is in, the maps of the same size and
+// format are packed into texture arrays and the materials sample a layer,
+// so draws with different maps need no bind (GLSL 3.30 path and gpu-driven).
+// Not under a texture budget: the arrays hold every level of every map.
+// g_packedTextures: files of g_textures handed to g_textureArrays
+CTextureArrays g_textureArrays;
+bool g_packTextures = false;
+int g_packedTextures = 0;
+
+// material ids, shared by every object using the same .mtl entry
+map <string, int> g_materialIds;
+
+// statistics of the last frame, printed with 'i'
+SRenderStats g_stats, g_lastStats;
+
+// shader permutations of the classic path, picked per mesh at load
+CShaderCache g_shaders;
+
+// cached GL state, skips redundant calls of the classic path
+CGLState g_glState;
+
+// gl calls issued/skipped by g_glState in the last frame, per kind
+int g_lastGLIssued[CGLState::N_KINDS];
+int g_lastGLSkipped[CGLState::N_KINDS];
+
+// uniform buffers of the GLSL 3.30 path: the camera once per frame, every
+// material once, and one block per draw taken from a ring
+bool g_uniformBuffers = false;
+GLuint g_frameUBO = 0, g_materialUBO = 0;
+CUniformRing g_drawRing;
+vector<SGpuMaterial> g_materialTable(MAX_UBO_MATERIALS);
+bool g_materialTableDirty = true;
+
+// gpu-driven rendering (multi draw indirect), toggled with 'g'.
+// 'c' toggles the compute shader frustum culling
+CGpuScene g_gpuScene;
+bool g_gpuDriven = false;
+bool g_gpuCull = true;
+
+// on-demand rendering, toggled with 'r': a frame is drawn only when
+// something asks for one (input, the menu, an asset still loading) and glut
+// blocks on the events in between. Off, frames follow each other at the
+// rate of g_scheduler ('p' cycles it). g_frameIncomplete: the last frame
+// skipped something not ready yet, so another one follows
+CFrameScheduler g_scheduler;
+bool g_onDemand = true;
+bool g_frameIncomplete = false;
+bool g_tickPending = false;
 
 // window size
 int   g_width = 1024;
 int   g_height = 768;
 
+// dynamic resolution, toggled with 'd': the scene is drawn smaller than the
+// window when it takes longer than the budget ('[' and ']' change it)
+CDynamicResolution g_resolution;
+bool g_dynamicResolution = false;
+
+// the target the scene is drawn to, and its size
+void bindSceneTarget()
+{
+	if (g_dynamicResolution)
+		g_resolution.bind();
+	else
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, g_width, g_height);
+	}
+}
+
+int sceneWidth()
+{
+	return g_dynamicResolution ? g_resolution.width() : g_width;
+}
+
+int sceneHeight()
+{
+	return g_dynamicResolution ? g_resolution.height() : g_height;
+}
+
 // indicated if the left mouse click is pressed
 bool g_leftPressed = false;
 
@@ -240,23 +341,6 @@ typedef struct STexCoord
 
 
 
-// shader stuff: location of each shader item
-GLuint iLocPosition;
-GLuint iLocNormal;
-GLuint iLocTexCoord;
-GLuint iLocModel;
-GLuint iLocNormalMat;
-GLuint iLocView;
-GLuint iLocProjection;
-GLuint iLocKa;
-GLuint iLocKd;
-GLuint iLocKs;
-GLuint iLocShine;
-GLuint iLocTexture_diffuse1;
-GLuint iLocHasTexture;
-GLuint iLocHasNormal;
-
-
 // a material
 typedef struct SMaterial
 {
@@ -267,10 +351,22 @@ typedef struct SMaterial
 	float   m_shininess;
 	string  m_diffuseFileName;
 
+	// id used to sort and to skip redundant material changes, see g_materialIds
+	int     m_id;
+
+	// texture() of the frame, for the draw list workers (see resolveTextures)
+	GLuint  m_textureId;
+
+	// layer of the diffuse map when texture() is a texture array, else -1
+	int     m_layer;
+
 	SMaterial()
 	{
 		m_name = string("");
 		m_shininess = 0;
+		m_id = 0;
+		m_textureId = 0;
+		m_layer = -1;
 	}
 
 
@@ -278,62 +374,74 @@ typedef struct SMaterial
 	{
 		m_name = name;
 		m_shininess = 0;
+		m_id = 0;
+		m_textureId = 0;
+		m_layer = -1;
 	}
 
-	// given a texture path, return the opengl ID...
-	// of the texture has not been loaded, it loads it just 1 time
-	unsigned int getTexture(const string &path)
+	// diffuse map of the material, 0 if there is none. The first call
+	// queues the file and gets a placeholder, the same ID later holds the
+	// real texture (see CTextureStreamer). Once packed, the texture array
+	// holding it, and m_layer goes into the Materials block
+	GLuint texture()
 	{
-		if (g_texManager.find(path) == g_texManager.end())
+		if (!m_diffuseFileName.compare(""))
+			return 0;
+		int known = g_textures.size();
+		GLuint t = g_textures.request(m_diffuseFileName);
+		if (g_textures.size() != known)
+			g_glState.invalidateTextures();
+		GLuint array = 0;
+		int layer = -1;
+		if (g_packTextures && !g_textures.m_budget && g_textureArrays.find(t, array, layer))
+			t = array;
+		if (layer != m_layer)
 		{
-			unsigned int ret = SOIL_load_OGL_texture((OBJPATH + path).c_str(),
-				SOIL_LOAD_AUTO,
-				SOIL_CREATE_NEW_ID,
-				SOIL_FLAG_MIPMAPS | SOIL_FLAG_POWER_OF_TWO | SOIL_FLAG_DDS_LOAD_DIRECT);
-			if (ret)
-			{
-				g_texManager[path] = ret;
-				return ret;
-			}
-			else
+			m_layer = layer;
+			if (m_id < MAX_UBO_MATERIALS)
 			{
-				printf("Error loading %s\nPress enter too finish-->", path.c_str());
-				getchar();
-				exit(1);
-				return 0;
+				g_materialTable[m_id].layer = (float)layer;
+				g_materialTableDirty = true;
 			}
-
 		}
-		return g_texManager[path];
+		return t;
 	}
 
-	// set all values into a program shader
-	void set(GLuint p)
+	// shader features the material needs, see shadercache.h
+	unsigned int variantBits()
 	{
-		// material properties
-		glUniform4f(iLocKa, m_ambient.x, m_ambient.y, m_ambient.z, 1.0f);
-		glUniform4f(iLocKd, m_diffuse.x, m_diffuse.y, m_diffuse.z, 1.0f);
-		glUniform4f(iLocKs, m_specular.x, m_specular.y, m_specular.z, 1.0f);
-		glUniform1f(iLocShine, m_shininess / 4.0);
-
-		// we check if the material includes a diuffuse map or notr
+		unsigned int bits = 0;
 		if (m_diffuseFileName.compare(""))
-		{
-			GLuint t = getTexture(m_diffuseFileName);
-			if (t != 0)
-			{
-				// setting the texture ID
-				glUniform1i(iLocTexture_diffuse1, 0);
-				glActiveTexture(GL_TEXTURE0);
-				glBindTexture(GL_TEXTURE_2D, t);
-				glUniform1i(iLocHasTexture, 1);
-			}
-			else
-				glUniform1i(iLocHasTexture, 0);
-		}
-		else
-			glUniform1i(iLocHasTexture, 0);
+			bits |= VARIANT_TEXTURED;
+		if (m_specular.x != 0.0f || m_specular.y != 0.0f || m_specular.z != 0.0f)
+			bits |= VARIANT_SPECULAR;
+		return bits;
+	}
+
+	// set the material values into a shader variant. The diffuse map
+	// itself is bound by the caller, on texture unit 0
+	void set(SShaderVariant &v)
+	{
+		// material properties
+		g_glState.uniform4f(v.m_ka, m_ambient.x, m_ambient.y, m_ambient.z, 1.0f);
+		g_glState.uniform4f(v.m_kd, m_diffuse.x, m_diffuse.y, m_diffuse.z, 1.0f);
+		g_glState.uniform4f(v.m_ks, m_specular.x, m_specular.y, m_specular.z, 1.0f);
+		g_glState.uniform1f(v.m_shine, m_shininess / 4.0);
+		g_stats.uniformUpdates += 4;
+	}
 
+	// the material as an entry of the Materials uniform block
+	SGpuMaterial uniformBlock()
+	{
+		SGpuMaterial m;
+		m.ka[0] = m_ambient.x; m.ka[1] = m_ambient.y; m.ka[2] = m_ambient.z; m.ka[3] = 1.0f;
+		m.kd[0] = m_diffuse.x; m.kd[1] = m_diffuse.y; m.kd[2] = m_diffuse.z; m.kd[3] = 1.0f;
+		m.ks[0] = m_specular.x; m.ks[1] = m_specular.y; m.ks[2] = m_specular.z; m.ks[3] = 1.0f;
+		m.shine = m_shininess / 4.0f;
+		m.hasTexture = m_diffuseFileName.compare("") ? 1.0f : 0.0f;
+		m.layer = (float)m_layer;
+		m.pad1 = 0.0f;
+		return m;
 	}
 } SMaterial;
 
@@ -347,19 +455,38 @@ typedef struct SMesh
 	// bounding box
 	SVertex m_min, m_max;
 
+	// tex coords per unit of length, for the size of the texture on screen
+	float m_uvDensity;
+
 	GLuint m_vao, m_v, m_t, m_n;
 	int m_materialIndex;
 
+	// shader permutation for the mesh and its material, set by loadMTL
+	SShaderVariant *m_variant;
+
+	// clusters of triangles, culled every frame
+	CMeshlets m_meshlets;
+	// back faces can not be seen (closed shells wound outwards, see
+	// C3DObject::orientMeshes): GL_CULL_FACE is on, and meshlets facing
+	// away are culled too
+	bool m_cullBackFaces;
+
 	SMesh()
 	{
 		m_materialIndex = -1;
+		m_uvDensity = 0.0f;
 		m_vao = 0;
+		m_variant = NULL;
+		m_cullBackFaces = false;
 	}
 
 	SMesh(int matIndex)
 	{
 		m_materialIndex = matIndex;
+		m_uvDensity = 0.0f;
 		m_vao = 0;
+		m_variant = NULL;
+		m_cullBackFaces = false;
 	}
 
 	SMesh & operator = (const SMesh &m)
@@ -369,9 +496,84 @@ typedef struct SMesh
 		this->m_texCoords = m.m_texCoords;
 		this->m_min = m.m_min;
 		this->m_max = m.m_max;
+		this->m_uvDensity = m.m_uvDensity;
 		this->m_materialIndex = m.m_materialIndex;
 		this->m_vao = m.m_vao;
+		this->m_variant = m.m_variant;
+		this->m_meshlets = m.m_meshlets;
+		this->m_cullBackFaces = m.m_cullBackFaces;
+
+	}
+
+	// m_uvDensity from the areas of the triangles in both spaces; 0 without
+	// a tex coord per vertex
+	void computeUvDensity()
+	{
+		double area = 0.0, uvArea = 0.0;
+		int n = m_verteces.size();
+		if (m_texCoords.size() == n)
+		{
+			for (int i = 0; i + 2 < n; i += 3)
+			{
+				const SVertex &a = m_verteces[i], &b = m_verteces[i + 1], &c = m_verteces[i + 2];
+				const STexCoord &ta = m_texCoords[i], &tb = m_texCoords[i + 1], &tc = m_texCoords[i + 2];
+				area += glm::length(glm::cross(glm::vec3(b.x - a.x, b.y - a.y, b.z - a.z), glm::vec3(c.x - a.x, c.y - a.y, c.z - a.z)));
+				uvArea += fabs((tb.s - ta.s) * (tc.t - ta.t) - (tc.s - ta.s) * (tb.t - ta.t));
+			}
+		}
+		m_uvDensity = area > 0.0 ? (float)sqrt(uvArea / area) : 0.0f;
+	}
+
+	// cut the mesh into meshlets. The triangles are reordered to keep the
+	// meshlets compact, unless some vertex lacks its normal or tex coord
+	// (then the arrays do not match triangle by triangle)
+	void buildMeshlets()
+	{
+		int n = m_verteces.size();
+		if (n == 0)
+			return;
+		bool reorder = (m_normals.empty() || m_normals.size() == n) && (m_texCoords.empty() || m_texCoords.size() == n);
+		vector<int> order;
+		m_meshlets.build(&m_verteces[0].x, n, reorder, order);
+		if (reorder)
+		{
+			permute(m_verteces, order);
+			permute(m_normals, order);
+			permute(m_texCoords, order);
+		}
+	}
+
+	// put the triangles of a vertex array in a new order
+	template <class T> static void permute(vector<T> &a, const vector<int> &order)
+	{
+		if (a.empty())
+			return;
+		vector<T> b;
+		b.reserve(a.size());
+		for (int i = 0; i < order.size(); i++)
+		{
+			b.push_back(a[3 * order[i]]);
+			b.push_back(a[3 * order[i] + 1]);
+			b.push_back(a[3 * order[i] + 2]);
+		}
+		a.swap(b);
+	}
 
+	// free the copy in the GPU, the next render uploads the mesh again
+	void releaseGPU()
+	{
+		if (!m_vao)
+			return;
+		if (isOpenGL3Available)
+			glDeleteVertexArrays(1, &m_vao);
+		else
+			glDeleteBuffers(1, &m_vao);
+		glDeleteBuffers(1, &m_v);
+		glDeleteBuffers(1, &m_n);
+		glDeleteBuffers(1, &m_t);
+		m_vao = 0;
+		// the names may come back from glGen* for other objects
+		g_glState.invalidate();
 	}
 
 	// load the mesh into the GPU, if it has not been loaded before
@@ -393,7 +595,7 @@ typedef struct SMesh
 		// setting vao as current
 		GLint pos0, pos1, pos2;
 		if (isOpenGL3Available) {
-			glBindVertexArray(m_vao);
+			g_glState.bindVertexArray(m_vao);
 			//for GLSL 3xx: positions are defined in shaders itself.
 			pos0 = 0;
 			pos1 = 1;
@@ -401,96 +603,266 @@ typedef struct SMesh
 		}
 		else {
 			//for GLSL 1xx: positions depend on runtime.
-			glBindBuffer(GL_ARRAY_BUFFER, m_vao);
-			pos0 = glGetAttribLocation(p, "inPosition");
-			pos1 = glGetAttribLocation(p, "inNormal");
-			pos2 = glGetAttribLocation(p, "inTex");
+			pos0 = g_glState.attribLocation(p, "inPosition");
+			pos1 = g_glState.attribLocation(p, "inNormal");
+			pos2 = g_glState.attribLocation(p, "inTex");
 		}
 
+		// with a vao the enabled arrays are recorded in it, so render()
+		// only has to bind it. Without vao render() sets them every draw
 		if (m_verteces.size())
 		{
 			// uploading vertexes
-			glBindBuffer(GL_ARRAY_BUFFER, m_v);
-			glEnableVertexAttribArray(pos0);
+			g_glState.bindArrayBuffer(m_v);
 			glBufferData(GL_ARRAY_BUFFER, m_verteces.size() * sizeof(SVertex), m_verteces.data(), GL_STATIC_DRAW);
-			glVertexAttribPointer(pos0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+			if (isOpenGL3Available)
+			{
+				glEnableVertexAttribArray(pos0);
+				glVertexAttribPointer(pos0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+			}
 		}
 		if (m_normals.size())
 		{
 			// upload normals
-			glBindBuffer(GL_ARRAY_BUFFER, m_n);
-			glEnableVertexAttribArray(pos1);
+			g_glState.bindArrayBuffer(m_n);
 			glBufferData(GL_ARRAY_BUFFER, m_normals.size() * sizeof(SVertex), m_normals.data(), GL_STATIC_DRAW);
-			glVertexAttribPointer(pos1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+			if (isOpenGL3Available)
+			{
+				glEnableVertexAttribArray(pos1);
+				glVertexAttribPointer(pos1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+			}
 		}
 		if (m_texCoords.size())
 		{
 			// upload texture coordinates
-			glBindBuffer(GL_ARRAY_BUFFER, m_t);
-			glEnableVertexAttribArray(pos2);
+			g_glState.bindArrayBuffer(m_t);
 			glBufferData(GL_ARRAY_BUFFER, m_texCoords.size() * sizeof(STexCoord), m_texCoords.data(), GL_STATIC_DRAW);
-			glVertexAttribPointer(pos2, 2, GL_FLOAT, GL_FALSE, 0, 0);
+			if (isOpenGL3Available)
+			{
+				glEnableVertexAttribArray(pos2);
+				glVertexAttribPointer(pos2, 2, GL_FLOAT, GL_FALSE, 0, 0);
+			}
 		}
-
-		// unbinding
-		if (isOpenGL3Available)
-			glBindVertexArray(NULL);
 	}
 
-	// render the mesh using a program p and a material mat
-	void render(GLuint p, SMaterial &mat)
+	// render vertex ranges of the mesh using a program p, the material is
+	// already set
+	void render(GLuint p, const GLint *firsts, const GLsizei *counts, int ranges)
 	{
 		loadIntoGPU(p);
-		mat.set(p);
-		glUniform1i(iLocHasNormal,  m_normals.size() ? 1 : 0);
-		GLint pos0, pos1, pos2;
+		g_stats.draws++;
 		if (isOpenGL3Available)
-		{
-			glBindVertexArray(m_vao);
-			pos0 = 0;
-			pos1 = 1;
-			pos2 = 2;
-		}
-		else {
-			glBindBuffer(GL_ARRAY_BUFFER, m_vao);
-			pos0 = glGetAttribLocation(p, "inPosition");
-			pos1 = glGetAttribLocation(p, "inNormal");
-			pos2 = glGetAttribLocation(p, "inTex");
-		}
-
-		// pos
-		glBindBuffer(GL_ARRAY_BUFFER, m_v);
-		glEnableVertexAttribArray(pos0);
-		glVertexAttribPointer(pos0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		// normal
-		if (m_normals.size())
-		{
-			glBindBuffer(GL_ARRAY_BUFFER, m_n);
-			glEnableVertexAttribArray(pos1);
-			glVertexAttribPointer(pos1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		}
+			g_glState.bindVertexArray(m_vao);
 		else
-			glDisableVertexAttribArray(pos1);
-		// tex
-		if (m_texCoords.size())
 		{
-			glBindBuffer(GL_ARRAY_BUFFER, m_t);
-			glEnableVertexAttribArray(pos2);
-			glVertexAttribPointer(pos2, 2, GL_FLOAT, GL_FALSE, 0, 0);
+			GLint pos0 = g_glState.attribLocation(p, "inPosition");
+			GLint pos1 = g_glState.attribLocation(p, "inNormal");
+			GLint pos2 = g_glState.attribLocation(p, "inTex");
+
+			// pos
+			g_glState.bindArrayBuffer(m_v);
+			g_glState.enableAttrib(pos0, true);
+			glVertexAttribPointer(pos0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+			// normal
+			if (m_normals.size() && pos1 >= 0)
+			{
+				g_glState.bindArrayBuffer(m_n);
+				g_glState.enableAttrib(pos1, true);
+				glVertexAttribPointer(pos1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+			}
+			else
+				g_glState.enableAttrib(pos1, false);
+			// tex
+			if (m_texCoords.size() && pos2 >= 0)
+			{
+				g_glState.bindArrayBuffer(m_t);
+				g_glState.enableAttrib(pos2, true);
+				glVertexAttribPointer(pos2, 2, GL_FLOAT, GL_FALSE, 0, 0);
+			}
+			else
+				g_glState.enableAttrib(pos2, false);
 		}
-		else
-			glDisableVertexAttribArray(pos2);
 		// render here
-		glDrawArrays(GL_TRIANGLES, 0, m_verteces.size());
+		if (ranges == 1)
+			glDrawArrays(GL_TRIANGLES, firsts[0], counts[0]);
+		else
+			glMultiDrawArrays(GL_TRIANGLES, firsts, counts, ranges);
+	}
+} SMesh;
 
-		glDisableVertexAttribArray(pos0);
-		glDisableVertexAttribArray(pos1);
-		glDisableVertexAttribArray(pos2);
-		if (isOpenGL3Available)
-			glBindVertexArray(0);
+// a draw emitted by C3DObject::render, submitted later by submitRenderQueue
+typedef struct SDrawPacket
+{
+	// model and normal matrices, owned by the object (or g_identity)
+	const glm::mat4 *m_model;
+	const glm::mat4 *m_normalMat;
+	SMesh *m_mesh;
+	SMaterial *m_material;
+	SShaderVariant *m_variant;	// the mesh variant, or its lit one
+	GLuint m_texture;
+	// vertex ranges to draw, in g_rangeFirsts/g_rangeCounts
+	int m_firstRange, m_ranges;
+	// distance from the camera to the world bounding box, over FCP
+	float m_depth;
+	// back faces culled: the mesh allows it and the model is no mirror
+	bool m_cull;
+} SDrawPacket;
+
+// per-frame queue of draws, sorted by key unless 's' turned sorting off.
+// Merged from the draw lists of the frame
+vector<SDrawPacket> g_packets;
+CRenderQueue g_renderQueue;
+bool g_sortDraws = true;
+
+// the draws one thread found for the frame: packets, their vertex ranges
+// and their keys (payload: index in m_packets), sorted by that thread
+typedef struct SDrawList
+{
+	vector<SDrawPacket> m_packets;
+	vector<GLint> m_firsts;
+	vector<GLsizei> m_counts;
+	CRenderQueue m_queue;
+	SClusterStats m_clusterStats;
+	bool m_incomplete;	// something was skipped because it is not ready
+
+	void clear()
+	{
+		m_packets.clear();
+		m_firsts.clear();
+		m_counts.clear();
+		m_queue.clear();
+		m_clusterStats.reset();
+		m_incomplete = false;
+	}
+} SDrawList;
+
+// frame front-end: the objects are spread over g_workers in tasks of
+// FRONT_END_BATCH, each worker filling its own draw list; the lists are
+// merged for the submission on the GL thread. g_frameVariants: the variant
+// of each mesh variant this frame, NULL while it compiles (the workers can
+// not touch the shader cache); [1] for materials packed into texture arrays
+#define FRONT_END_BATCH 64
+CWorkerPool g_workers;
+vector<SDrawList> g_drawLists;
+SShaderVariant *g_frameVariants[2][CShaderCache::N_VARIANTS];
+double g_frontEndMs = 0.0;
+
+// 'f': order the opaque draws strictly front to back instead of by state.
+// 'z': lay down the depth of the frame first with the position-only
+// variant, then shade with GL_EQUAL so every pixel is shaded once.
+// Which one pays off depends on the scene: the overdraw (fragments shaded
+// per pixel, from an occlusion query around the color pass) tells
+bool g_frontToBack = false;
+bool g_depthPrepass = false;
+CRenderQueue g_depthQueue;
+GLuint g_overdrawQueries[2];
+int g_overdrawQuery = 0;
+bool g_overdrawPending[2] = { false, false };
+float g_overdraw = 0.0f;
+
+// transform of the geometry already in world space
+const glm::mat4 g_identity(1.0f);
+
+// meshlet culling, toggled with 'm'. The vertex ranges that survive, for
+// all the packets of the frame
+bool g_clusterCulling = true;
+vector<GLint> g_rangeFirsts;
+vector<GLsizei> g_rangeCounts;
+SClusterStats g_clusterStats, g_lastClusterStats;
+
+// set the vertex ranges of a packet from the meshlets of its mesh that
+// survive culling; planes and camera in the space of the mesh.
+// false when nothing is left to draw
+bool cullMeshlets(SDrawList &list, SDrawPacket &packet, const glm::vec4 planes[6], const glm::vec3 &camera)
+{
+	SMesh &mesh = *packet.m_mesh;
+	packet.m_firstRange = list.m_firsts.size();
+	if (g_clusterCulling)
+		mesh.m_meshlets.cull(planes, camera, mesh.m_cullBackFaces, list.m_firsts, list.m_counts, list.m_clusterStats);
+	else
+	{
+		list.m_firsts.push_back(0);
+		list.m_counts.push_back(mesh.m_verteces.size());
+	}
+	packet.m_ranges = list.m_firsts.size() - packet.m_firstRange;
+	return packet.m_ranges > 0;
+}
 
+// world box of a box in object space
+void worldBox(const glm::mat4 &model, const SVertex &bmin, const SVertex &bmax, glm::vec3 &wmin, glm::vec3 &wmax)
+{
+	wmin = glm::vec3(1e30f);
+	wmax = glm::vec3(-1e30f);
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 p(model * glm::vec4(i & 1 ? bmax.x : bmin.x, i & 2 ? bmax.y : bmin.y, i & 4 ? bmax.z : bmin.z, 1.0f));
+		wmin = glm::min(wmin, p);
+		wmax = glm::max(wmax, p);
 	}
-} SMesh;
+}
+
+// distance from the camera to the world box of a mesh box, over FCP.
+// 0 when the camera is inside, so the room around it is drawn first
+float boxDepth(const glm::mat4 &model, const SVertex &bmin, const SVertex &bmax)
+{
+	glm::vec3 wmin, wmax;
+	worldBox(model, bmin, bmax, wmin, wmax);
+	return glm::length(glm::clamp(g_position, wmin, wmax) - g_position) / FCP;
+}
+
+// clustered point lights, toggled with 'l' (GLSL 3.30 path only)
+CClusteredLights g_clusters;
+vector<SPointLight> g_lights;
+bool g_clusteredLighting = false;
+
+// cached shadow maps of the sun and the point lights, toggled with 'h'
+// (with clustered lighting only). g_shadowVersions: the object versions the
+// atlas was drawn with, g_shadowMin/Max their world boxes then
+CShadowAtlas g_shadowAtlas;
+bool g_shadows = false;
+CUniformRing g_shadowRing;
+GLuint g_shadowUBO = 0;
+unsigned int g_shadowVersions[N_OBJECTS];
+glm::vec3 g_shadowMin[N_OBJECTS], g_shadowMax[N_OBJECTS];
+int g_shadowViews = 0, g_shadowDraws = 0;	// drawn in the last update
+double g_shadowMs = 0.0;
+
+// a mesh drawn into a view of the atlas
+typedef struct SShadowPacket
+{
+	int m_view;
+	SMesh *m_mesh;
+	glm::mat4 m_mvp;
+} SShadowPacket;
+
+vector<SShadowPacket> g_shadowPackets;
+
+// the variant a mesh is drawn with in this frame
+SShaderVariant *frameVariant(SShaderVariant *v)
+{
+	if (g_clusteredLighting && (v->m_bits & VARIANT_NORMALS))
+		return g_shaders.get(v->m_bits | VARIANT_LIGHTS | (g_shadows ? VARIANT_SHADOWS : 0));
+	return v;
+}
+
+// add a packet to a draw list, keyed for the current ordering
+void queuePacket(SDrawList &list, const SDrawPacket &packet)
+{
+	unsigned int variant = packet.m_variant->m_bits;
+	unsigned long long key;
+	if (g_frontToBack)
+		key = CRenderQueue::makeDepthKey(variant, packet.m_texture, packet.m_material->m_id, packet.m_depth);
+	else
+		key = CRenderQueue::makeKey(0, variant, packet.m_texture, packet.m_material->m_id, packet.m_depth);
+	list.m_queue.push(key, list.m_packets.size());
+	list.m_packets.push_back(packet);
+}
+
+// view matrix of the camera
+glm::mat4 viewMatrix()
+{
+	return glm::rotate(g_rx, glm::vec3(1.0f, 0.0f, 0.0f)) * glm::lookAt(g_position, g_position + g_front, g_up);
+}
 
 // the mesh object
 class C3DObject
@@ -503,6 +875,10 @@ public:
 		m_position = NULL;
 		m_rotation = NULL;
 		m_euler = NULL;
+		m_geometryVersion = 0;
+		m_transformVersion = 0;
+		m_dynamic = false;
+		m_flippedTriangles = 0;
 	}
 
 	~C3DObject()
@@ -635,6 +1011,45 @@ public:
 			}
 		}
 		fclose(f);
+
+		// ids shared with the other objects using the same material
+		for (int i = 0; i < m_materials.size(); i++)
+		{
+			string key = string(matName) + "/" + m_materials[i].m_name;
+			if (g_materialIds.find(key) == g_materialIds.end())
+			{
+				int id = g_materialIds.size() + 1;
+				g_materialIds[key] = id;
+			}
+			m_materials[i].m_id = g_materialIds[key];
+
+			// a reloaded .mtl may change the values behind an existing id
+			int id = m_materials[i].m_id;
+			if (id < MAX_UBO_MATERIALS)
+			{
+				g_materialTable[id] = m_materials[i].uniformBlock();
+				g_materialTableDirty = true;
+			}
+			else if (g_uniformBuffers)
+				printf("Too many materials, %s is not in the uniform buffer\n", key.c_str());
+		}
+
+		// shader permutation of each mesh (compiled in the background)
+		for (int i = 0; i < m_meshes.size(); i++)
+		{
+			SMesh &mesh = m_meshes[i];
+			unsigned int bits = m_materials[mesh.m_materialIndex].variantBits();
+			if (mesh.m_normals.size())
+				bits |= VARIANT_NORMALS;
+			mesh.m_variant = g_shaders.get(bits);
+			if (mesh.m_variant == NULL)
+			{
+				printf("Error in shaders. Press enter to finish-->\n");
+				getchar();
+				exit(1);
+			}
+		}
+		m_geometryVersion++;
 		return 0;
 	}
 
@@ -704,6 +1119,8 @@ public:
 	{
 		m_meshes.clear();
 		m_materials.clear();
+		m_geometryVersion++;
+		m_transformVersion++;
 		FILE *f = fopen((OBJPATH + filename).c_str(), "rt");
 
 		int error_code = 0;
@@ -831,6 +1248,7 @@ public:
 		if (error_code)
 			return error_code;
 
+		orientMeshes();
 		for (int k = 0; k < m_materials.size(); k++)
 		{
 			const vector<SVertex> &v = m_meshes[k].m_verteces;
@@ -864,10 +1282,57 @@ public:
 				if (m_meshes[k].m_max.y > m_max.y)  m_max.y = m_meshes[k].m_max.y;
 				if (m_meshes[k].m_max.z > m_max.z)  m_max.z = m_meshes[k].m_max.z;
 			}
+			m_meshes[k].computeUvDensity();
+			m_meshes[k].buildMeshlets();
 		}
 		return 0;
 	}
 
+	// wind the closed shells of the object outwards and mark the meshes
+	// made only of closed shells for back face culling. A shell often spans
+	// several materials, so the whole object is analyzed at once
+	void orientMeshes()
+	{
+		vector<float> pos;
+		vector<int> first;
+		for (int k = 0; k < m_meshes.size(); k++)
+		{
+			const vector<SVertex> &v = m_meshes[k].m_verteces;
+			first.push_back(pos.size() / 9);
+			if (v.size())
+				pos.insert(pos.end(), &v[0].x, &v[0].x + 3 * v.size());
+		}
+		CWinding winding;
+		winding.analyze(pos.data(), pos.size() / 3);
+
+		m_flippedTriangles = 0;
+		for (int k = 0; k < m_meshes.size(); k++)
+		{
+			SMesh &mesh = m_meshes[k];
+			int n = mesh.m_verteces.size();
+			// without one normal and tex coord per vertex a triangle can not be flipped
+			bool aligned = (mesh.m_normals.empty() || mesh.m_normals.size() == n) && (mesh.m_texCoords.empty() || mesh.m_texCoords.size() == n);
+			mesh.m_cullBackFaces = n > 0;
+			for (int t = 0; t < n / 3; t++)
+			{
+				int w = first[k] + t;
+				if (!winding.cullable(w))
+					mesh.m_cullBackFaces = false;
+				else if (winding.flipped(w) && !aligned)
+					mesh.m_cullBackFaces = false;
+				else if (winding.flipped(w))
+				{
+					swap(mesh.m_verteces[3 * t + 1], mesh.m_verteces[3 * t + 2]);
+					if (mesh.m_normals.size())
+						swap(mesh.m_normals[3 * t + 1], mesh.m_normals[3 * t + 2]);
+					if (mesh.m_texCoords.size())
+						swap(mesh.m_texCoords[3 * t + 1], mesh.m_texCoords[3 * t + 2]);
+					m_flippedTriangles++;
+				}
+			}
+		}
+	}
+
 	// transform indeces to positive indexes
 	void myAbs(vector<int> &a, vector<int> &n)
 	{
@@ -889,6 +1354,7 @@ public:
 		m_position->x = (x1 + x0) * 0.5f;
 		m_position->y = (y1 + y0) * 0.5f;
 		m_position->z = (z1 + z0) * 0.5f;
+		m_transformVersion++;
 	}
 
 	// set the nobject position in world space
@@ -899,6 +1365,7 @@ public:
 		m_position->x = cx;
 		m_position->y = cy;
 		m_position->z = cz;
+		m_transformVersion++;
 	}
 
 	// set the object scaling
@@ -909,7 +1376,7 @@ public:
 		m_size->x = sx;
 		m_size->y = sy;
 		m_size->z = sz;
-
+		m_transformVersion++;
 	}
 
 	// set the rotation angles of the object
@@ -920,6 +1387,7 @@ public:
 		m_euler->x = x;
 		m_euler->y = y;
 		m_euler->z = z;
+		m_transformVersion++;
 	}
 
 	// set the rotation angle around a given vector
@@ -931,14 +1399,12 @@ public:
 		m_rotation->y = y;
 		m_rotation->z = z;
 		m_rotation->w = angle;
+		m_transformVersion++;
 	}
 
-	// render the object using a shader program p
-	void render(GLuint p)
+	// compute the model and normal matrices of the object
+	void computeMatrices(glm::mat4 &model, glm::mat4 &normalMat)
 	{
-		g_view = glm::rotate(g_rx, glm::vec3(1.0f, 0.0f, 0.0f) ) * glm::lookAt(g_position, g_position + g_front, g_up);
-		glUniformMatrix4fv(iLocView, 1, GL_FALSE, glm::value_ptr(g_view));
-
 		SVertex center((m_min.x + m_max.x) * 0.5f, (m_min.y + m_max.y) * 0.5f, (m_min.z + m_max.z) * 0.5f);
 		SVertex lengths(m_max.x - m_min.x, m_max.y - m_min.y, m_max.z - m_min.z);
 		float maxLength = lengths.x;
@@ -947,43 +1413,83 @@ public:
 		//static float angle = 0.0f;
 		//angle += 0.001f;
 		//if (angle > 360.0f) angle -= 360.0f;
-		g_model = glm::mat4(1.0f);
+		model = glm::mat4(1.0f);
 		if (m_position)
-			g_model *= glm::translate(glm::vec3(m_position->x, m_position->y, m_position->z));
+			model *= glm::translate(glm::vec3(m_position->x, m_position->y, m_position->z));
 			//glm::translate(glm::vec3(0,0,-1.0f)) *
 			//glm::rotate(angle, glm::vec3(0.0f, 1.0f, 0.0f)) *
 			//glm::rotate(angle*0.5f, glm::vec3(1.0f, 0.0f, 0.0f)) *
 			//(m_size ?	glm::scale(glm::vec3(m_size->x / maxLength, m_size->y / maxLength, m_size->z / maxLength)) : glm::scale(glm::vec3(1.0f/maxLength, 1.0f / maxLength, 1.0f / maxLength))) *
 		if (m_rotation)
 		{
-			g_model *= glm::rotate(m_rotation->w, glm::vec3(m_rotation->x, m_rotation->y, m_rotation->z));
-			g_normalMat = glm::rotate(m_rotation->w, glm::vec3(m_rotation->x, m_rotation->y, m_rotation->z));
+			model *= glm::rotate(m_rotation->w, glm::vec3(m_rotation->x, m_rotation->y, m_rotation->z));
+			normalMat = glm::rotate(m_rotation->w, glm::vec3(m_rotation->x, m_rotation->y, m_rotation->z));
 		}
 		else
-			g_normalMat = glm::mat4(1.0f);
+			normalMat = glm::mat4(1.0f);
 
 		if (m_euler)
 		{
-			g_model *= glm::rotate(m_euler->z, glm::vec3(0, 0, 1));
-			g_model *= glm::rotate(m_euler->y, glm::vec3(0, 1, 0));
-			g_model *= glm::rotate(m_euler->x, glm::vec3(1, 0, 0));
+			model *= glm::rotate(m_euler->z, glm::vec3(0, 0, 1));
+			model *= glm::rotate(m_euler->y, glm::vec3(0, 1, 0));
+			model *= glm::rotate(m_euler->x, glm::vec3(1, 0, 0));
 
-			g_normalMat *= glm::rotate(m_euler->z, glm::vec3(0, 0, 1));
-			g_normalMat *= glm::rotate(m_euler->y, glm::vec3(0, 1, 0));
-			g_normalMat *= glm::rotate(m_euler->x, glm::vec3(1, 0, 0));
+			normalMat *= glm::rotate(m_euler->z, glm::vec3(0, 0, 1));
+			normalMat *= glm::rotate(m_euler->y, glm::vec3(0, 1, 0));
+			normalMat *= glm::rotate(m_euler->x, glm::vec3(1, 0, 0));
 		}
 
 		if (m_size)
-			g_model *= glm::scale(glm::vec3(m_size->x / lengths.x, m_size->y / lengths.y, m_size->z / lengths.z));
+			model *= glm::scale(glm::vec3(m_size->x / lengths.x, m_size->y / lengths.y, m_size->z / lengths.z));
 		else
-			g_model *= glm::scale(glm::vec3(1.0f / maxLength, 1.0f / maxLength, 1.0f / maxLength));
-		g_model *= glm::translate(glm::vec3(-center.x, -center.y, -center.z));
-		glUniformMatrix4fv(iLocModel, 1, GL_FALSE, glm::value_ptr(g_model));
-		glUniformMatrix4fv(iLocNormalMat, 1, GL_FALSE, glm::value_ptr(g_normalMat));
+			model *= glm::scale(glm::vec3(1.0f / maxLength, 1.0f / maxLength, 1.0f / maxLength));
+		model *= glm::translate(glm::vec3(-center.x, -center.y, -center.z));
+	}
+
+	// emit the draws of the object into a draw list (g_view must be set).
+	// Runs on the front-end workers: no GL, no shared state written
+	void render(SDrawList &list)
+	{
+		computeMatrices(m_model, m_normalMat);
+		emit(list, m_model, m_normalMat);
+	}
+
+	// the same for a copy of the object placed by model (matrices owned by
+	// the caller until the frame is submitted)
+	void emit(SDrawList &list, const glm::mat4 &model, const glm::mat4 &normalMat)
+	{
+		glm::mat4 modelView = g_view * model;
+
+		// frustum and camera in object space, for the meshlets
+		glm::vec4 planes[6];
+		CGpuScene::frustumPlanes(g_projection * modelView, planes);
+		glm::vec3 camera(glm::inverse(modelView)[3]);
+		// a mirroring model turns the winding around
+		bool mirror = glm::determinant(glm::mat3(model)) < 0.0f;
 
 		for (int i = 0; i < m_meshes.size(); i++) if (m_meshes[i].m_verteces.size() > 0)
 		{
-			m_meshes[i].render(g_shader.getProgram(), m_materials[m_meshes[i].m_materialIndex]);
+			SMesh &mesh = m_meshes[i];
+			// not drawn until the driver has compiled its variant
+			SShaderVariant *variant = g_frameVariants[m_materials[mesh.m_materialIndex].m_layer >= 0 ? 1 : 0][mesh.m_variant->m_bits];
+			if (!variant)
+			{
+				list.m_incomplete = true;
+				continue;
+			}
+			SDrawPacket packet;
+			packet.m_variant = variant;
+			packet.m_model = &model;
+			packet.m_normalMat = &normalMat;
+			packet.m_mesh = &mesh;
+			packet.m_material = &m_materials[mesh.m_materialIndex];
+			packet.m_texture = packet.m_material->m_textureId;
+			if (!cullMeshlets(list, packet, planes, camera))
+				continue;
+
+			packet.m_depth = boxDepth(model, mesh.m_min, mesh.m_max);
+			packet.m_cull = mesh.m_cullBackFaces && !mirror;
+			queuePacket(list, packet);
 		}
 	}
 
@@ -1005,91 +1511,1534 @@ public:
 	// rotation angles
 	SVertex *m_euler;
 	Quaternion *m_rotation;
+
+	// matrices of the current frame
+	glm::mat4 m_model, m_normalMat;
+
+	// bumped every time the meshes/materials or the placement change
+	unsigned int m_geometryVersion;
+	unsigned int m_transformVersion;
+
+	// moved at runtime (menu), so it is kept out of the static batches
+	bool m_dynamic;
+
+	// triangles turned around by orientMeshes
+	int m_flippedTriangles;
 };
 
 
 C3DObject g_obj[N_OBJECTS];
 CollisionMap g_collMap;
 
-// keyboard callback
-void keyboardDown(unsigned char k, int x, int y)
+// static batching, toggled with 'b': the meshes of the objects that never
+// move are transformed to world space once and merged per material and per
+// cell of a grid on the floor plan. About one draw per material, and the
+// cells (a quarter of the apartment) are still small enough to be culled
+#define STATIC_CELL_SIZE 6500.0f
+
+typedef struct SStaticBatch
 {
-	switch(k)
-	{
-		case 'q': case  27: exit(0);
-	}
+	SMesh m_mesh;	// world space triangles
+	SMaterial *m_material;
+} SStaticBatch;
+
+vector<SStaticBatch> g_staticBatches;
+unsigned int g_staticVersion = ~0u;
+bool g_staticBatching = true;
+int g_staticCulled = 0;
+
+// grows every time a static object changes (versions only grow)
+unsigned int staticVersion()
+{
+	unsigned int v = 0;
+	for (int i = 0; i < N_OBJECTS; i++) if (!g_obj[i].m_dynamic)
+		v += g_obj[i].m_geometryVersion + g_obj[i].m_transformVersion;
+	return v;
 }
 
-//update the camera according to the pressed keys
-void updateCamera()
+// rebuild the static batches from the static objects
+void buildStaticBatches()
 {
-	if (g_lastKeys[0])
-		g_front = glm::rotate(4 * SPEED_ROTATE, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(g_front, 0.0f);
+	for (int i = 0; i < g_staticBatches.size(); i++)
+		g_staticBatches[i].m_mesh.releaseGPU();
+	g_staticBatches.clear();
 
-	if (g_lastKeys[1])
-		g_front = glm::rotate(-4 * SPEED_ROTATE, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(g_front, 0.0f);
+	// material, back face culling, normals, texture coordinates and cell -> batch
+	map<unsigned long long, int> batches;
+	for (int i = 0; i < N_OBJECTS; i++)
+	{
+		C3DObject &o = g_obj[i];
+		if (o.m_dynamic)
+			continue;
+		glm::mat4 model, normalMat;
+		o.computeMatrices(model, normalMat);
+		bool mirror = glm::determinant(glm::mat3(model)) < 0.0f;
+		for (int k = 0; k < o.m_meshes.size(); k++)
+		{
+			SMesh &mesh = o.m_meshes[k];
+			int n = mesh.m_verteces.size();
+			if (n == 0)
+				continue;
+			SMaterial &material = o.m_materials[mesh.m_materialIndex];
+			bool normals = mesh.m_normals.size() > 0, texCoords = mesh.m_texCoords.size() > 0;
+			bool cull = mesh.m_cullBackFaces && !mirror;
+			for (int t = 0; t + 2 < n; t += 3)
+			{
+				glm::vec3 p[3];
+				for (int j = 0; j < 3; j++)
+				{
+					const SVertex &v = mesh.m_verteces[t + j];
+					p[j] = glm::vec3(model * glm::vec4(v.x, v.y, v.z, 1.0f));
+				}
 
-	const float userWidth = 200.0f;
-	const float userHeight = 2000.0f;
-	if (g_lastKeys[2])
+				// the triangle goes to the cell of its center
+				glm::vec3 c = (p[0] + p[1] + p[2]) / 3.0f;
+				unsigned long long cx = (unsigned int)((int)floor(c.x / STATIC_CELL_SIZE) + 32768) & 0xffff;
+				unsigned long long cz = (unsigned int)((int)floor(c.z / STATIC_CELL_SIZE) + 32768) & 0xffff;
+				unsigned long long key = ((unsigned long long)material.m_id << 35) | ((unsigned long long)cull << 34) | ((unsigned long long)normals << 33) |
+					((unsigned long long)texCoords << 32) | (cx << 16) | cz;
+				map<unsigned long long, int>::iterator it = batches.find(key);
+				if (it == batches.end())
+				{
+					it = batches.insert(make_pair(key, (int)g_staticBatches.size())).first;
+					g_staticBatches.push_back(SStaticBatch());
+					SStaticBatch &b = g_staticBatches.back();
+					b.m_material = &material;
+					b.m_mesh.m_materialIndex = mesh.m_materialIndex;
+					b.m_mesh.m_variant = mesh.m_variant;
+					b.m_mesh.m_cullBackFaces = cull;
+				}
+				SMesh &batch = g_staticBatches[it->second].m_mesh;
+
+				// attributes missing in the source (it happens) are zero,
+				// as the vertex arrays of the source mesh would read them
+				for (int j = 0; j < 3; j++)
+				{
+					batch.m_verteces.push_back(SVertex(p[j].x, p[j].y, p[j].z));
+					if (normals)
+					{
+						glm::vec3 nv(0.0f);
+						if (t + j < mesh.m_normals.size())
+						{
+							const SVertex &m = mesh.m_normals[t + j];
+							nv = glm::vec3(normalMat * glm::vec4(m.x, m.y, m.z, 0.0f));
+						}
+						batch.m_normals.push_back(SVertex(nv.x, nv.y, nv.z));
+					}
+					if (texCoords)
+						batch.m_texCoords.push_back(t + j < mesh.m_texCoords.size() ? mesh.m_texCoords[t + j] : STexCoord(0.0f, 0.0f));
+				}
+			}
+		}
+	}
+
+	// world space bounding boxes, for culling
+	for (int i = 0; i < g_staticBatches.size(); i++)
 	{
-		SBox b;
-		glm::vec3 newPos = g_position + SPEED_MOVE* (glm::vec3(g_front.x, 0.0f, g_front.z));
-		b.m_pMin.x = newPos.x - userWidth / 2.0f;
-		b.m_pMax.x = newPos.x + userWidth / 2.0f;
-		b.m_pMin.y = newPos.y - userHeight / 2.0f;
-		b.m_pMax.y = newPos.y + userHeight / 2.0f;
-		b.m_pMin.z = newPos.z - userWidth / 2.0f;
-		b.m_pMax.z = newPos.z + userWidth / 2.0f;
-		if (!g_collMap.collide(b))
-			g_position = newPos;
+		SMesh &m = g_staticBatches[i].m_mesh;
+		m.m_min = m.m_max = m.m_verteces[0];
+		for (int j = 1; j < m.m_verteces.size(); j++)
+		{
+			const SVertex &v = m.m_verteces[j];
+			if (v.x < m.m_min.x) m.m_min.x = v.x;
+			if (v.y < m.m_min.y) m.m_min.y = v.y;
+			if (v.z < m.m_min.z) m.m_min.z = v.z;
+			if (v.x > m.m_max.x) m.m_max.x = v.x;
+			if (v.y > m.m_max.y) m.m_max.y = v.y;
+			if (v.z > m.m_max.z) m.m_max.z = v.z;
+		}
+	}
+	for (int i = 0; i < g_staticBatches.size(); i++)
+	{
+		g_staticBatches[i].m_mesh.computeUvDensity();
+		g_staticBatches[i].m_mesh.buildMeshlets();
 	}
+	g_staticVersion = staticVersion();
+	printf("static batches: %d\n", (int)g_staticBatches.size());
+}
 
-	if (g_lastKeys[3])
+// emit the visible static batches into a draw list (g_view must be set)
+void renderStaticBatches(SDrawList &list)
+{
+	if (g_staticVersion != staticVersion())
+		buildStaticBatches();
+	glm::vec4 planes[6];
+	CGpuScene::frustumPlanes(g_projection * g_view, planes);
+	glm::vec3 camera(glm::inverse(g_view)[3]);
+	g_staticCulled = 0;
+	for (int i = 0; i < g_staticBatches.size(); i++)
 	{
-		SBox b;
-		glm::vec3 newPos = g_position - SPEED_MOVE* (glm::vec3(g_front.x, 0.0f, g_front.z));
-		b.m_pMin.x = newPos.x - userWidth / 2.0f;
-		b.m_pMax.x = newPos.x + userWidth / 2.0f;
-		b.m_pMin.y = newPos.y - userHeight / 2.0f;
-		b.m_pMax.y = newPos.y + userHeight / 2.0f;
-		b.m_pMin.z = newPos.z - userWidth / 2.0f;
-		b.m_pMax.z = newPos.z + userWidth / 2.0f;
-		if (!g_collMap.collide(b))
-			g_position = newPos;
+		SStaticBatch &b = g_staticBatches[i];
+		SShaderVariant *variant = g_frameVariants[b.m_material->m_layer >= 0 ? 1 : 0][b.m_mesh.m_variant->m_bits];
+		if (!variant)
+		{
+			list.m_incomplete = true;
+			continue;
+		}
+		glm::vec3 bmin(b.m_mesh.m_min.x, b.m_mesh.m_min.y, b.m_mesh.m_min.z);
+		glm::vec3 bmax(b.m_mesh.m_max.x, b.m_mesh.m_max.y, b.m_mesh.m_max.z);
+		if (!CGpuScene::boxVisible(planes, bmin, bmax))
+		{
+			g_staticCulled++;
+			continue;
+		}
+		SDrawPacket packet;
+		packet.m_model = &g_identity;
+		packet.m_normalMat = &g_identity;
+		packet.m_mesh = &b.m_mesh;
+		packet.m_variant = variant;
+		packet.m_material = b.m_material;
+		packet.m_texture = b.m_material->texture();
+		if (!cullMeshlets(list, packet, planes, camera))
+			continue;
+
+		packet.m_depth = boxDepth(g_identity, b.m_mesh.m_min, b.m_mesh.m_max);
+		packet.m_cull = b.m_mesh.m_cullBackFaces;
+		queuePacket(list, packet);
 	}
 }
 
-// draw callback
-void drawCallback()
+// procedural building for the front-end, toggled with 'B': the apartment
+// repeated on BUILDING_FLOORS floors of BUILDING_UNITS x 2 apartments. The
+// first apartment is the scene itself, every object of the others is an
+// instance with its own matrices (about 10k of them)
+#define BUILDING_FLOORS 20
+#define BUILDING_UNITS 11
+
+typedef struct SInstance
 {
-	glClearColor(sky_color[0],sky_color[1], sky_color[2], 1.0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	int m_object;
+	glm::mat4 m_model, m_normalMat;
+	glm::vec3 m_min, m_max;	// world box
+} SInstance;
 
-	updateCamera();
-	for (int i = 0; i < N_OBJECTS; i++)
-		g_obj[i].render(g_shader.getProgram());
+vector<SInstance> g_instances;
+unsigned int g_buildingVersion = ~0u;
+bool g_building = false;
 
-	glutSwapBuffers();
-	Sleep(1000 / 60);
+// grows every time an object changes
+unsigned int sceneVersion()
+{
+	unsigned int v = 0;
+	for (int i = 0; i < N_OBJECTS; i++)
+		v += g_obj[i].m_geometryVersion + g_obj[i].m_transformVersion;
+	return v;
 }
 
-//resize callback
-void reshapeCallback(int w, int h)
+void buildBuilding()
 {
-	if (h == 0)
-		return;
+	g_instances.clear();
+	for (int i = 0; i < N_OBJECTS; i++)
+	{
+		glm::mat4 model, normalMat;
+		g_obj[i].computeMatrices(model, normalMat);
+		for (int f = 0; f < BUILDING_FLOORS; f++)
+		{
+			for (int u = 0; u < BUILDING_UNITS; u++)
+			{
+				for (int r = 0; r < 2; r++)
+				{
+					if (f == 0 && u == 0 && r == 0)
+						continue;
+					SInstance instance;
+					instance.m_object = i;
+					instance.m_model = glm::translate(glm::vec3(u * 12442.0f, f * 2500.0f, r * -8385.0f)) * model;
+					instance.m_normalMat = normalMat;
+					worldBox(instance.m_model, g_obj[i].m_min, g_obj[i].m_max, instance.m_min, instance.m_max);
+					g_instances.push_back(instance);
+				}
+			}
+		}
+	}
+	g_buildingVersion = sceneVersion();
+	printf("building: %d objects\n", (int)g_instances.size() + N_OBJECTS);
+}
+
+// the diffuse maps of the frame, before the Materials block goes up: once
+// the streamer is done with every file requested so far, the new textures
+// are packed into arrays, then every material finds its texture (and layer)
+void resolveTextures()
+{
+	if (g_textureArrays.m_ok && !g_textures.m_budget && !g_textures.pending() && g_textures.size() != g_packedTextures)
+	{
+		vector<GLuint> textures;
+		g_textures.textures(textures);
+		g_textureArrays.pack(textures);
+		g_packedTextures = g_textures.size();
+		g_glState.invalidateTextures();
+	}
+	for (int i = 0; i < N_OBJECTS; i++)
+	{
+		for (int k = 0; k < g_obj[i].m_materials.size(); k++)
+			g_obj[i].m_materials[k].m_textureId = g_obj[i].m_materials[k].texture();
+	}
+}
+
+// tells the streamer how big the textures of the frame are on screen: the
+// pixels one unit of tex coords covers, from the distance to the mesh box
+// and the tex coords per unit of length of the mesh
+void touchTextures()
+{
+	// pixels per unit of length at distance 1
+	float pixels = 0.5f * g_projection[1][1] * sceneHeight();
+	for (int i = 0; i < g_packets.size(); i++)
+	{
+		const SDrawPacket &p = g_packets[i];
+		if (!p.m_texture)
+			continue;
+		float scale = glm::length(glm::vec3((*p.m_model)[0]));
+		float distance = glm::max(p.m_depth * FCP, NCP);
+		float density = p.m_mesh->m_uvDensity;
+		g_textures.touch(p.m_texture, density > 0.0f ? pixels * scale / (density * distance) : 0.0f);
+	}
+}
+
+// fills the draw lists of the frame and merges them into g_packets and
+// g_renderQueue. The GL work (static batches, shader variants) is done
+// first on this thread, then the objects and the instances are spread over
+// the workers
+void buildDrawLists()
+{
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	for (unsigned int bits = 0; bits < CShaderCache::N_VARIANTS; bits++)
+	{
+		SShaderVariant *v = frameVariant(g_shaders.get(bits));
+		g_frameVariants[0][bits] = v && g_shaders.ready(v) ? v : NULL;
+		v = g_packTextures ? frameVariant(g_shaders.get(bits | VARIANT_TEXTURE_ARRAY)) : NULL;
+		g_frameVariants[1][bits] = v && g_shaders.ready(v) ? v : NULL;
+	}
+	if (g_building && g_buildingVersion != sceneVersion())
+		buildBuilding();
+
+	for (int i = 0; i < g_drawLists.size(); i++)
+		g_drawLists[i].clear();
+	if (g_staticBatching)
+		renderStaticBatches(g_drawLists[0]);
+	vector<int> objects;
+	for (int i = 0; i < N_OBJECTS; i++)
+	{
+		if (!g_staticBatching || g_obj[i].m_dynamic)
+			objects.push_back(i);
+	}
+	int instances = g_building ? (int)g_instances.size() : 0;
+	int items = (int)objects.size() + instances;
+	glm::vec4 planes[6];
+	CGpuScene::frustumPlanes(g_projection * g_view, planes);
+	g_workers.run((items + FRONT_END_BATCH - 1) / FRONT_END_BATCH, [&](int task, int worker)
+	{
+		SDrawList &list = g_drawLists[worker];
+		int end = min(items, (task + 1) * FRONT_END_BATCH);
+		for (int i = task * FRONT_END_BATCH; i < end; i++)
+		{
+			if (i < objects.size())
+			{
+				g_obj[objects[i]].render(list);
+				continue;
+			}
+			SInstance &instance = g_instances[i - objects.size()];
+			if (CGpuScene::boxVisible(planes, instance.m_min, instance.m_max))
+				g_obj[instance.m_object].emit(list, instance.m_model, instance.m_normalMat);
+		}
+	});
+	if (g_sortDraws)
+	{
+		g_workers.run(g_drawLists.size(), [&](int task, int worker)
+		{
+			g_drawLists[task].m_queue.sort();
+		});
+	}
+
+	// merge: packets and ranges one after the other, keys merged in order
+	vector<CRenderQueue*> queues;
+	vector<unsigned int> offsets;
+	for (int i = 0; i < g_drawLists.size(); i++)
+	{
+		SDrawList &list = g_drawLists[i];
+		int ranges = g_rangeFirsts.size();
+		offsets.push_back(g_packets.size());
+		queues.push_back(&list.m_queue);
+		for (int k = 0; k < list.m_packets.size(); k++)
+		{
+			g_packets.push_back(list.m_packets[k]);
+			g_packets.back().m_firstRange += ranges;
+		}
+		g_rangeFirsts.insert(g_rangeFirsts.end(), list.m_firsts.begin(), list.m_firsts.end());
+		g_rangeCounts.insert(g_rangeCounts.end(), list.m_counts.begin(), list.m_counts.end());
+		g_clusterStats.tested += list.m_clusterStats.tested;
+		g_clusterStats.frustumCulled += list.m_clusterStats.frustumCulled;
+		g_clusterStats.coneCulled += list.m_clusterStats.coneCulled;
+		g_frameIncomplete = g_frameIncomplete || list.m_incomplete;
+	}
+	if (g_sortDraws)
+		g_renderQueue.merge(queues, offsets);
+	else
+	{
+		for (int i = 0; i < queues.size(); i++)
+			g_renderQueue.append(*queues[i], offsets[i]);
+	}
+	g_frontEndMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+// the packets of the frame counted by model matrix and mesh, which tell
+// the draws apart
+map<pair<const void*, const void*>, int> packetCounts()
+{
+	map<pair<const void*, const void*>, int> counts;
+	for (int i = 0; i < g_packets.size(); i++)
+		counts[make_pair((const void*)g_packets[i].m_model, (const void*)g_packets[i].m_mesh)]++;
+	return counts;
+}
+
+// packets of the frame more often than in reference, and packets missing
+void comparePackets(const map<pair<const void*, const void*>, int> &reference, int &duplicated, int &missing)
+{
+	map<pair<const void*, const void*>, int> counts = packetCounts();
+	for (map<pair<const void*, const void*>, int>::iterator it = counts.begin(); it != counts.end(); ++it)
+	{
+		map<pair<const void*, const void*>, int>::const_iterator r = reference.find(it->first);
+		duplicated += max(0, it->second - (r == reference.end() ? 0 : r->second));
+	}
+	for (map<pair<const void*, const void*>, int>::const_iterator r = reference.begin(); r != reference.end(); ++r)
+	{
+		map<pair<const void*, const void*>, int>::iterator it = counts.find(r->first);
+		missing += max(0, r->second - (it == counts.end() ? 0 : it->second));
+	}
+}
+
+// front-end scaling: the building's draw lists built with 1, 2, 4... workers.
+// Every frame's packets are checked against those of one worker, and the
+// pool runs many small jobs back to back, each task counted, to show
+// tasks run twice or not at all
+void frontEndBenchmark()
+{
+	bool building = g_building;
+	g_building = true;
+	int active = g_workers.active();
+	const int frames = 20;
+	g_view = viewMatrix();
+	printf("workers  front-end ms  speedup  packets  duplicated  missing\n");
+	double first = 0.0;
+	map<pair<const void*, const void*>, int> reference;
+	for (int n = 1;; n = min(n * 2, g_workers.size()))
+	{
+		g_workers.setActive(n);
+		buildDrawLists();
+		double ms = 0.0;
+		int packets = 0, duplicated = 0, missing = 0;
+		for (int f = 0; f < frames; f++)
+		{
+			g_renderQueue.clear();
+			g_packets.clear();
+			g_rangeFirsts.clear();
+			g_rangeCounts.clear();
+			buildDrawLists();
+			ms += g_frontEndMs;
+			packets = g_packets.size();
+			if (n == 1 && f == 0)
+				reference = packetCounts();
+			else
+				comparePackets(reference, duplicated, missing);
+		}
+		ms /= frames;
+		if (n == 1)
+			first = ms;
+		printf("%7d  %12.2f  %7.2f  %7d  %10d  %7d\n", n, ms, first / ms, packets, duplicated, missing);
+		if (n == g_workers.size())
+			break;
+	}
+
+	const int runs = 10000, tasks = 16;
+	vector<atomic<int> > counts(tasks);
+	int twice = 0, missed = 0;
+	for (int r = 0; r < runs; r++)
+	{
+		for (int t = 0; t < tasks; t++)
+			counts[t] = 0;
+		g_workers.run(tasks, [&](int task, int worker)
+		{
+			counts[task]++;
+		});
+		for (int t = 0; t < tasks; t++)
+		{
+			twice += counts[t] > 1;
+			missed += counts[t] == 0;
+		}
+	}
+	printf("worker pool: %d runs of %d tasks on %d workers, %d tasks run twice, %d missed\n", runs, tasks, g_workers.active(), twice, missed);
+	g_renderQueue.clear();
+	g_packets.clear();
+	g_rangeFirsts.clear();
+	g_rangeCounts.clear();
+	g_clusterStats.reset();
+	g_workers.setActive(active);
+	g_building = building;
+}
+
+// the texture files of the scene, each once
+vector<string> texturePaths()
+{
+	vector<string> paths;
+	for (int i = 0; i < N_OBJECTS; i++)
+	{
+		for (int k = 0; k < g_obj[i].m_materials.size(); k++)
+		{
+			const string &path = g_obj[i].m_materials[k].m_diffuseFileName;
+			if (path.compare("") && find(paths.begin(), paths.end(), path) == paths.end())
+				paths.push_back(path);
+		}
+	}
+	return paths;
+}
+
+// decodes the textures of the scene with 1, 2, 4... threads up to the
+// cores ('T'), to see the loading scale
+void textureBenchmark()
+{
+	vector<string> paths = texturePaths();
+	int cores = max(1, (int)thread::hardware_concurrency());
+	printf("%d textures\nthreads  decode ms  speedup  png MB/s  mip chain MB/s\n", (int)paths.size());
+	double first = 0.0;
+	for (int n = 1;; n = min(n * 2, cores))
+	{
+		size_t fileBytes, levelBytes;
+		double ms = g_textures.benchmark(paths, n, fileBytes, levelBytes);
+		if (n == 1)
+			first = ms;
+		printf("%7d  %9.1f  %7.2f  %8.1f  %14.1f\n", n, ms, first / ms, fileBytes / (ms * 1000.0), levelBytes / (ms * 1000.0));
+		if (n == cores)
+			break;
+	}
+}
+
+// decodes the PNG textures of the scene with the plain zlib inflate and
+// unfiltering of stb_image, then with the fast ones ('P'); decoded MB/s
+void pngBenchmark()
+{
+	vector<string> paths = texturePaths();
+	printf("PNG decoding in decoded MB/s, best of 3\n"
+		"texture                    size        plain    fast  speedup  same\n");
+	double megabytes = 0.0, referenceMs = 0.0, fastMs = 0.0;
+	bool same = true;
+	for (int i = 0; i < paths.size(); i++)
+	{
+		CTextureStreamer::SDecodeBenchmark r;
+		if (!g_textures.decodeBenchmark(paths[i], 3, r))
+			continue;
+		char size[32];
+		sprintf(size, "%dx%dx%d", r.m_width, r.m_height, r.m_channels);
+		printf("%-25.25s  %-11s %6.1f  %6.1f  %7.2f  %s\n", paths[i].c_str(), size,
+			r.m_megabytes * 1000.0 / r.m_referenceMs, r.m_megabytes * 1000.0 / r.m_fastMs, r.m_referenceMs / r.m_fastMs,
+			r.m_same ? "yes" : "no");
+		megabytes += r.m_megabytes;
+		referenceMs += r.m_referenceMs;
+		fastMs += r.m_fastMs;
+		same = same && r.m_same;
+	}
+	if (fastMs > 0.0)
+		printf("%.1f MB: plain %.1f ms, fast %.1f ms, %.2fx, %s\n", megabytes, referenceMs, fastMs, referenceMs / fastMs,
+			same ? "the same pixels" : "the pixels differ");
+}
+
+// resamples the textures of the scene on the CPU as the loaders do, with
+// the plain C loops, then the SIMD ones on every core ('M'); megapixels/s
+void resampleBenchmark()
+{
+	vector<string> paths = texturePaths();
+	int cores = max(1, (int)thread::hardware_concurrency());
+	printf("CPU resampling in megapixels/s, SIMD on %d threads\n"
+		"texture                    size         upscale C/SIMD   mip chain C/SIMD  NTSC safe C/SIMD  same\n", cores);
+	for (int i = 0; i < paths.size(); i++)
+	{
+		CTextureStreamer::SResampleBenchmark r;
+		if (!g_textures.resampleBenchmark(paths[i], cores, r))
+			continue;
+		char size[32];
+		sprintf(size, "%dx%dx%d", r.m_width, r.m_height, r.m_channels);
+		printf("%-25.25s  %-11s %7.1f %7.1f   %7.1f %7.1f   %7.1f %7.1f   %s\n", paths[i].c_str(), size,
+			r.m_upMegapixels * 1000.0 / r.m_upReferenceMs, r.m_upMegapixels * 1000.0 / r.m_upSimdMs,
+			r.m_mipMegapixels * 1000.0 / r.m_mipReferenceMs, r.m_mipMegapixels * 1000.0 / r.m_mipSimdMs,
+			r.m_mipMegapixels * 1000.0 / r.m_ntscReferenceMs, r.m_mipMegapixels * 1000.0 / r.m_ntscSimdMs,
+			r.m_same ? "yes" : "no");
+	}
+}
+
+// compresses the mip chains of the textures of the scene to DXT with the
+// plain C block encoders, then the SIMD ones on every core ('X')
+void compressBenchmark()
+{
+	vector<string> paths = texturePaths();
+	int cores = max(1, (int)thread::hardware_concurrency());
+	printf("DXT compression, SIMD on %d threads\n"
+		"texture                    size       C MP/s  SIMD MP/s  speedup  C PSNR  SIMD PSNR  same\n", cores);
+	double megapixels = 0.0, referenceMs = 0.0, simdMs = 0.0;
+	bool same = true;
+	for (int i = 0; i < paths.size(); i++)
+	{
+		CTextureStreamer::SCompressBenchmark r;
+		if (!g_textures.compressBenchmark(paths[i], cores, r))
+			continue;
+		char size[32];
+		sprintf(size, "%dx%dx%d", r.m_width, r.m_height, r.m_channels);
+		printf("%-25.25s  %-11s %6.1f  %9.1f  %7.2f  %6.2f  %9.2f  %s\n", paths[i].c_str(), size,
+			r.m_megapixels * 1000.0 / r.m_referenceMs, r.m_megapixels * 1000.0 / r.m_simdMs, r.m_referenceMs / r.m_simdMs,
+			r.m_referencePsnr, r.m_simdPsnr, r.m_same ? "yes" : "no");
+		megapixels += r.m_megapixels;
+		referenceMs += r.m_referenceMs;
+		simdMs += r.m_simdMs;
+		same = same && r.m_same;
+	}
+	if (simdMs > 0.0)
+		printf("%.1f megapixels: C %.1f ms, SIMD %.1f ms, %.2fx, %s\n", megapixels, referenceMs, simdMs, referenceMs / simdMs,
+			same ? "the same blocks" : "the blocks differ");
+}
+
+// feed the gpu-driven scene with the objects that changed since last frame
+void syncGpuScene()
+{
+	for (int i = 0; i < N_OBJECTS; i++)
+	{
+		C3DObject &o = g_obj[i];
+		if (g_gpuScene.geometryVersion(i) != o.m_geometryVersion)
+		{
+			g_gpuScene.beginObject(i, o.m_geometryVersion);
+			for (int k = 0; k < o.m_materials.size(); k++)
+			{
+				SMaterial &m = o.m_materials[k];
+				GLuint t = m.texture();
+				g_gpuScene.addMaterial(i, &m.m_ambient.x, &m.m_diffuse.x, &m.m_specular.x, m.m_shininess / 4.0f, t, m.m_layer);
+			}
+			for (int k = 0; k < o.m_meshes.size(); k++)
+			{
+				SMesh &m = o.m_meshes[k];
+				int n = m.m_verteces.size();
+				if (n == 0)
+					continue;
+				g_gpuScene.addMesh(i, m.m_materialIndex, &m.m_verteces[0].x,
+					m.m_normals.size() == n ? &m.m_normals[0].x : NULL,
+					m.m_texCoords.size() == n ? &m.m_texCoords[0].s : NULL,
+					n, &m.m_min.x, &m.m_max.x);
+			}
+		}
+		else
+		{
+			// packed into a texture array (or back to 2D) since the feed
+			for (int k = 0; k < o.m_materials.size(); k++)
+				g_gpuScene.setTexture(i, k, o.m_materials[k].m_textureId, o.m_materials[k].m_layer);
+		}
+		if (g_gpuScene.transformVersion(i) != o.m_transformVersion)
+		{
+			glm::mat4 model, normalMat;
+			o.computeMatrices(model, normalMat);
+			g_gpuScene.setTransform(i, o.m_transformVersion, model, normalMat);
+		}
+	}
+}
+
+// upload the Frame block and, when a .mtl was (re)loaded, the Materials block
+void updateUniformBuffers(const glm::mat4 &view)
+{
+	SFrameBlock frame;
+	frame.view = view;
+	frame.projection = g_projection;
+	frame.viewProjection = g_projection * view;
+	frame.clusterParams = g_clusters.params();
+	glBindBuffer(GL_UNIFORM_BUFFER, g_frameUBO);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(SFrameBlock), &frame);
+	g_stats.uniformUpdates++;
+	if (g_materialTableDirty)
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, g_materialUBO);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, MAX_UBO_MATERIALS * sizeof(SGpuMaterial), g_materialTable.data());
+		g_materialTableDirty = false;
+		g_stats.uniformUpdates++;
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// write the Draw block of every queued packet into the ring, in queue order
+void writeDrawBlocks()
+{
+	g_drawRing.begin(g_renderQueue.size());
+	glm::mat4 viewProjection = g_projection * g_view;
+	for (int i = 0; i < g_renderQueue.size(); i++)
+	{
+		SDrawPacket &packet = g_packets[g_renderQueue.payload(i)];
+		SDrawBlock *b = (SDrawBlock*)g_drawRing.block(i);
+		b->mvp = viewProjection * *packet.m_model;
+		b->modelView = g_view * *packet.m_model;
+		b->normalView = g_view * *packet.m_normalMat;
+		b->material = packet.m_material->m_id < MAX_UBO_MATERIALS ? packet.m_material->m_id : 0;
+		b->pad0 = b->pad1 = b->pad2 = 0;
+	}
+	g_drawRing.commit();
+}
+
+// depth of the queued packets, front to back with the position-only
+// variant; then the color pass only passes GL_EQUAL fragments
+void renderDepthPrepass(SShaderVariant &v)
+{
+	// payload: position in the frame queue, which is the draw block index
+	g_depthQueue.clear();
+	for (int i = 0; i < g_renderQueue.size(); i++)
+		g_depthQueue.push(CRenderQueue::makeKey(0, 0, 0, 0, g_packets[g_renderQueue.payload(i)].m_depth), i);
+	g_depthQueue.sort();
+
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	g_glState.useProgram(v.program());
+	g_stats.programChanges++;
+	if (!g_uniformBuffers)
+	{
+		g_glState.uniformMatrix4fv(v.m_view, glm::value_ptr(g_view));
+		g_glState.uniformMatrix4fv(v.m_projection, glm::value_ptr(g_projection));
+		g_stats.uniformUpdates += 2;
+	}
+	const glm::mat4 *model = NULL;
+	for (int i = 0; i < g_depthQueue.size(); i++)
+	{
+		int slot = g_depthQueue.payload(i);
+		SDrawPacket &packet = g_packets[g_renderQueue.payload(slot)];
+		if (g_uniformBuffers)
+		{
+			g_drawRing.bind(UBO_DRAW, slot);
+			g_stats.uniformUpdates++;
+		}
+		else if (packet.m_model != model)
+		{
+			model = packet.m_model;
+			g_glState.uniformMatrix4fv(v.m_model, glm::value_ptr(*model));
+			g_stats.uniformUpdates++;
+		}
+		g_glState.cullFace(packet.m_cull);
+		packet.m_mesh->render(v.program(), &g_rangeFirsts[packet.m_firstRange], &g_rangeCounts[packet.m_firstRange], packet.m_ranges);
+	}
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthFunc(GL_EQUAL);
+	glDepthMask(GL_FALSE);
+}
+
+// draw the packets of the frame queue, skipping redundant state changes
+void submitRenderQueue()
+{
+	if (g_sortDraws)
+		g_renderQueue.sort();
+
+	if (g_uniformBuffers)
+		writeDrawBlocks();
+
+	// the overdraw query of the previous frame, if the GPU is done with it
+	int previous = g_overdrawQuery ^ 1;
+	if (g_overdrawPending[previous])
+	{
+		GLuint available = 0;
+		glGetQueryObjectuiv(g_overdrawQueries[previous], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available)
+		{
+			GLuint samples = 0;
+			glGetQueryObjectuiv(g_overdrawQueries[previous], GL_QUERY_RESULT, &samples);
+			g_overdraw = (float)samples / (sceneWidth() * sceneHeight());
+			g_overdrawPending[previous] = false;
+		}
+	}
+
+	// the depth variant may still be compiling: no pre-pass until it is done
+	SShaderVariant *depthVariant = g_depthPrepass ? g_shaders.get(VARIANT_DEPTH) : NULL;
+	bool prepass = depthVariant && g_shaders.ready(depthVariant);
+	if (prepass)
+		renderDepthPrepass(*depthVariant);
+	if (!g_overdrawPending[g_overdrawQuery])
+		glBeginQuery(GL_SAMPLES_PASSED, g_overdrawQueries[g_overdrawQuery]);
+
+	SShaderVariant *variant = NULL;
+	const glm::mat4 *model = NULL;
+	int material = -1;
+	GLuint texture = 0;
+	for (int i = 0; i < g_renderQueue.size(); i++)
+	{
+		SDrawPacket &packet = g_packets[g_renderQueue.payload(i)];
+		if (packet.m_variant != variant)
+		{
+			// uniforms belong to the program: the ones of the new program
+			// are set again (the state cache skips those already right)
+			variant = packet.m_variant;
+			g_glState.useProgram(variant->program());
+			if (!g_uniformBuffers)
+			{
+				g_glState.uniformMatrix4fv(variant->m_view, glm::value_ptr(g_view));
+				g_glState.uniformMatrix4fv(variant->m_projection, glm::value_ptr(g_projection));
+				g_stats.uniformUpdates += 2;
+			}
+			// texture arrays go on a unit of their own, see bindTexture
+			g_glState.uniform1i(variant->m_texture, (variant->m_bits & VARIANT_TEXTURE_ARRAY) ? 5 : 0);
+			g_stats.uniformUpdates++;
+			if (variant->m_bits & VARIANT_LIGHTS)
+			{
+				g_glState.uniform1i(variant->m_lightData, 1);
+				g_glState.uniform1i(variant->m_clusterRanges, 2);
+				g_glState.uniform1i(variant->m_lightIndices, 3);
+				g_stats.uniformUpdates += 3;
+			}
+			if (variant->m_bits & VARIANT_SHADOWS)
+			{
+				g_glState.uniform1i(variant->m_shadowAtlas, 4);
+				g_stats.uniformUpdates++;
+			}
+			g_stats.programChanges++;
+			model = NULL;
+			material = -1;
+		}
+		if (g_uniformBuffers)
+		{
+			// one range bind replaces the model and material uniforms
+			g_drawRing.bind(UBO_DRAW, i);
+			g_stats.uniformUpdates++;
+		}
+		if (packet.m_model != model)
+		{
+			model = packet.m_model;
+			if (!g_uniformBuffers)
+			{
+				g_glState.uniformMatrix4fv(variant->m_model, glm::value_ptr(*packet.m_model));
+				g_glState.uniformMatrix4fv(variant->m_normalMat, glm::value_ptr(*packet.m_normalMat));
+				g_stats.uniformUpdates += 2;
+			}
+			g_stats.objectChanges++;
+		}
+		// untextured variants do not sample, whatever is bound is fine
+		if (packet.m_texture && packet.m_texture != texture)
+		{
+			texture = packet.m_texture;
+			if (variant->m_bits & VARIANT_TEXTURE_ARRAY)
+				g_glState.bindTexture(5, texture, GL_TEXTURE_2D_ARRAY);
+			else
+				g_glState.bindTexture(0, texture);
+			g_stats.textureBinds++;
+		}
+		if (packet.m_material->m_id != material)
+		{
+			material = packet.m_material->m_id;
+			if (!g_uniformBuffers)
+				packet.m_material->set(*variant);
+			g_stats.materialChanges++;
+		}
+		g_glState.cullFace(packet.m_cull);
+		packet.m_mesh->render(variant->program(), &g_rangeFirsts[packet.m_firstRange], &g_rangeCounts[packet.m_firstRange], packet.m_ranges);
+	}
+	if (!g_overdrawPending[g_overdrawQuery])
+	{
+		glEndQuery(GL_SAMPLES_PASSED);
+		g_overdrawPending[g_overdrawQuery] = true;
+	}
+	g_overdrawQuery ^= 1;
+	g_glState.cullFace(false);
+	if (prepass)
+	{
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+	}
+	if (g_uniformBuffers)
+		g_drawRing.end();
+	g_renderQueue.clear();
+	g_packets.clear();
+	g_rangeFirsts.clear();
+	g_rangeCounts.clear();
+}
+
+// bin the lights for the current view and bind their textures
+void bindLights()
+{
+	for (int i = 0; i < g_lights.size(); i++)
+	{
+		SPointLight &l = g_lights[i];
+		if (l.m_object >= 0 && g_obj[l.m_object].m_position)
+		{
+			const SVertex &p = *g_obj[l.m_object].m_position;
+			l.m_position = glm::vec3(p.x, p.y, p.z) + l.m_offset;
+		}
+	}
+	// the shadow faces go to the light data with the binning
+	if (g_shadows)
+		g_shadowAtlas.setLights(g_lights);
+	g_clusters.bin(g_lights, g_view);
+	for (int i = 0; i < 3; i++)
+		g_glState.bindTexture(1 + i, g_clusters.texture(i), GL_TEXTURE_BUFFER);
+}
+
+// draw again the shadow maps that changed (see CShadowAtlas) and upload the
+// Shadows block of the camera. When nothing moves no map is drawn
+void updateShadows()
+{
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	g_shadowViews = g_shadowDraws = 0;
+
+	// late in the afternoon, over the whole apartment
+	g_shadowAtlas.setSun(glm::vec3(0.5f, -0.6f, -0.4f), glm::vec3(0.35f, 0.3f, 0.22f), glm::vec3(0.0f, 0.0f, -8385.0f), glm::vec3(12442.0f, 2500.0f, 0.0f));
+
+	// the objects that changed touch the maps around where they were and
+	// where they are now
+	for (int i = 0; i < N_OBJECTS; i++)
+	{
+		C3DObject &o = g_obj[i];
+		unsigned int version = o.m_geometryVersion + o.m_transformVersion;
+		if (g_shadowVersions[i] == version)
+			continue;
+		glm::mat4 model, normalMat;
+		o.computeMatrices(model, normalMat);
+		if (g_shadowVersions[i] != ~0u)
+			g_shadowAtlas.touch(g_shadowMin[i], g_shadowMax[i]);
+		worldBox(model, o.m_min, o.m_max, g_shadowMin[i], g_shadowMax[i]);
+		g_shadowAtlas.touch(g_shadowMin[i], g_shadowMax[i]);
+		g_shadowVersions[i] = version;
+	}
+
+	// the depth variant may still be compiling: the maps stay dirty until then
+	SShaderVariant *depthVariant = g_shaders.get(VARIANT_DEPTH);
+	if (depthVariant && g_shaders.ready(depthVariant))
+	{
+		// every mesh in every dirty view, one Draw block each
+		g_shadowPackets.clear();
+		for (int v = 0; v < CShadowAtlas::N_VIEWS; v++)
+		{
+			if (!g_shadowAtlas.dirty(v))
+				continue;
+			glm::vec4 planes[6];
+			CGpuScene::frustumPlanes(g_shadowAtlas.viewProjection(v), planes);
+			for (int i = 0; i < N_OBJECTS; i++)
+			{
+				C3DObject &o = g_obj[i];
+				glm::mat4 model, normalMat;
+				o.computeMatrices(model, normalMat);
+				for (int k = 0; k < o.m_meshes.size(); k++)
+				{
+					SMesh &mesh = o.m_meshes[k];
+					if (mesh.m_verteces.empty())
+						continue;
+					glm::vec3 wmin, wmax;
+					worldBox(model, mesh.m_min, mesh.m_max, wmin, wmax);
+					if (!CGpuScene::boxVisible(planes, wmin, wmax))
+						continue;
+					SShadowPacket p;
+					p.m_view = v;
+					p.m_mesh = &mesh;
+					p.m_mvp = g_shadowAtlas.viewProjection(v) * model;
+					g_shadowPackets.push_back(p);
+				}
+			}
+		}
+
+		if (!g_shadowPackets.empty())
+		{
+			g_shadowRing.begin(g_shadowPackets.size());
+			for (int i = 0; i < g_shadowPackets.size(); i++)
+			{
+				SDrawBlock *b = (SDrawBlock*)g_shadowRing.block(i);
+				b->mvp = g_shadowPackets[i].m_mvp;
+				b->modelView = b->normalView = glm::mat4(1.0f);
+				b->material = b->pad0 = b->pad1 = b->pad2 = 0;
+			}
+			g_shadowRing.commit();
+
+			// both sides cast shadows: walls are often single sided
+			g_glState.useProgram(depthVariant->program());
+			g_glState.cullFace(false);
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			glEnable(GL_POLYGON_OFFSET_FILL);
+			glPolygonOffset(2.0f, 4.0f);
+			int view = -1;
+			for (int i = 0; i < g_shadowPackets.size(); i++)
+			{
+				SShadowPacket &p = g_shadowPackets[i];
+				if (p.m_view != view)
+				{
+					view = p.m_view;
+					g_shadowAtlas.beginView(view);
+					g_shadowViews++;
+				}
+				g_shadowRing.bind(UBO_DRAW, i);
+				GLint first = 0;
+				GLsizei count = p.m_mesh->m_verteces.size();
+				p.m_mesh->render(depthVariant->program(), &first, &count, 1);
+				g_shadowDraws++;
+			}
+			glDisable(GL_POLYGON_OFFSET_FILL);
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+			g_shadowAtlas.end(g_width, g_height);
+			g_shadowRing.end();
+		}
+		// dirty views with nothing in them are empty maps
+		for (int v = 0; v < CShadowAtlas::N_VIEWS; v++)
+		{
+			if (!g_shadowAtlas.dirty(v))
+				continue;
+			g_shadowAtlas.beginView(v);
+			g_shadowViews++;
+		}
+		g_shadowAtlas.end(g_width, g_height);
+		bindSceneTarget();
+	}
+	else
+		g_frameIncomplete = true;
+
+	SShadowBlock block;
+	g_shadowAtlas.fill(block, g_view);
+	glBindBuffer(GL_UNIFORM_BUFFER, g_shadowUBO);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(SShadowBlock), &block);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	g_stats.uniformUpdates++;
+	g_glState.bindTexture(4, g_shadowAtlas.texture());
+	g_shadowMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+void renderFrame();
+
+// light count stress test: frames drawn with n random lights, for growing
+// n. First the lights fill the apartment, so the lights per froxel grow
+// with n; then all but 32 of them are far out of view: the total grows
+// but not the local density, and neither should the frame time
+void lightStressBenchmark()
+{
+	if (!g_clusters.m_ok)
+	{
+		printf("clustered lighting needs OpenGL 3.3\n");
+		return;
+	}
+	vector<SPointLight> lights = g_lights;
+	bool lighting = g_clusteredLighting;
+	g_clusteredLighting = true;
+	for (unsigned int bits = 0; bits < CShaderCache::N_VARIANTS; bits++)
+		while (!g_shaders.ready(frameVariant(g_shaders.get(bits))));
+	srand(1);
+	const int counts[] = { 16, 64, 256, 1024, 4096 };
+	const int frames = 10;
+	printf("lights  placement  in view  per froxel (avg/max)  binning ms  frame ms\n");
+	for (int local = 0; local < 2; local++)
+	{
+		for (int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+		{
+			g_lights.clear();
+			for (int i = 0; i < counts[c]; i++)
+			{
+				glm::vec3 p(12442.0f * rand() / RAND_MAX, 2500.0f * rand() / RAND_MAX, -8385.0f * rand() / RAND_MAX);
+				if (local && i >= 32)
+					p.y -= 100000.0f;
+				glm::vec3 color(rand(), rand(), rand());
+				g_lights.push_back(SPointLight(p, 1500.0f, color * (0.3f / RAND_MAX)));
+			}
+			renderFrame();
+			glFinish();
+			double binning = 0.0;
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			for (int f = 0; f < frames; f++)
+			{
+				renderFrame();
+				binning += g_clusters.m_stats.ms;
+			}
+			glFinish();
+			double ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / frames;
+			SClusterLightStats &s = g_clusters.m_stats;
+			printf("%6d  %-9s  %7d  %10.2f / %-9d  %10.3f  %8.2f\n", counts[c], local ? "local 32" : "spread", s.lights,
+				s.occupied ? (float)s.references / s.occupied : 0.0f, s.maxPerCluster, binning / frames, ms);
+		}
+	}
+	g_lights = lights;
+	g_clusteredLighting = lighting;
+	g_stats.reset();
+	g_clusterStats.reset();
+	g_glState.resetStats();
+}
+
+// keyboard callback
+void keyboardDown(unsigned char k, int x, int y)
+{
+	switch(k)
+	{
+		case 'q': case  27: exit(0);
+		case 'g':
+			if (!g_gpuDriven && !g_gpuScene.m_ok && !g_gpuScene.init())
+				break;
+			g_gpuDriven = !g_gpuDriven;
+			printf("gpu-driven rendering %s\n", g_gpuDriven ? "on" : "off");
+			break;
+		case 'c':
+			g_gpuCull = !g_gpuCull;
+			printf("gpu frustum culling %s\n", g_gpuCull ? "on" : "off");
+			break;
+		case 's':
+			g_sortDraws = !g_sortDraws;
+			printf("draw sorting %s\n", g_sortDraws ? "on" : "off");
+			break;
+		case 'b':
+			g_staticBatching = !g_staticBatching;
+			printf("static batching %s\n", g_staticBatching ? "on" : "off");
+			break;
+		case 'm':
+			g_clusterCulling = !g_clusterCulling;
+			printf("meshlet culling %s\n", g_clusterCulling ? "on" : "off");
+			break;
+		case 'f':
+			g_frontToBack = !g_frontToBack;
+			printf("front to back ordering %s\n", g_frontToBack ? "on" : "off");
+			break;
+		case 'l':
+			if (!g_clusters.m_ok)
+			{
+				printf("clustered lighting needs OpenGL 3.3\n");
+				break;
+			}
+			g_clusteredLighting = !g_clusteredLighting;
+			printf("clustered lighting %s (%d lights)\n", g_clusteredLighting ? "on" : "off", (int)g_lights.size());
+			break;
+		case 'L':
+			lightStressBenchmark();
+			break;
+		case 'B':
+			g_building = !g_building;
+			printf("building %s\n", g_building ? "on" : "off");
+			break;
+		case 'W':
+			frontEndBenchmark();
+			break;
+		case 'T':
+			textureBenchmark();
+			break;
+		case 'X':
+			compressBenchmark();
+			break;
+		case 'M':
+			resampleBenchmark();
+			break;
+		case 'P':
+			pngBenchmark();
+			break;
+		case 'd':
+			if (!g_resolution.m_ok)
+			{
+				printf("dynamic resolution needs OpenGL 3.0\n");
+				break;
+			}
+			g_dynamicResolution = !g_dynamicResolution;
+			printf("dynamic resolution %s (budget %.1f ms)\n", g_dynamicResolution ? "on" : "off", g_resolution.m_budgetMs);
+			break;
+		case '[': case ']':
+			g_resolution.m_budgetMs = glm::max(1.0f, g_resolution.m_budgetMs + (k == '[' ? -1.0f : 1.0f));
+			printf("frame time budget %.1f ms\n", g_resolution.m_budgetMs);
+			break;
+		case 'h':
+			if (!g_shadowAtlas.m_ok)
+			{
+				printf("shadows need OpenGL 3.3\n");
+				break;
+			}
+			g_shadows = !g_shadows;
+			printf("shadows %s%s\n", g_shadows ? "on" : "off", g_clusteredLighting ? "" : " (with clustered lighting, 'l')");
+			break;
+		case 'V':
+			{
+				// halves down to 1 MB, then no budget again
+				size_t mb = g_textures.m_budget >> 20;
+				mb = mb == 0 ? 8 : mb == 1 ? 0 : mb / 2;
+				g_textures.m_budget = mb << 20;
+				if (mb)
+				{
+					// the arrays would keep every level: the maps go back to 2D
+					g_textureArrays.clear();
+					g_packedTextures = 0;
+					printf("texture budget %d MB\n", (int)mb);
+				}
+				else
+					printf("no texture budget\n");
+			}
+			break;
+		case 'A':
+			if (!g_textureArrays.m_ok)
+			{
+				printf("texture arrays need OpenGL 4.3 (or ARB_copy_image and ARB_texture_storage)\n");
+				break;
+			}
+			g_packTextures = !g_packTextures;
+			printf("texture arrays %s\n", g_packTextures ? "on" : "off");
+			break;
+		case 'z':
+			g_depthPrepass = !g_depthPrepass;
+			printf("depth pre-pass %s\n", g_depthPrepass ? "on" : "off");
+			break;
+		case 'r':
+			g_onDemand = !g_onDemand;
+			printf("on-demand rendering %s\n", g_onDemand ? "on" : "off");
+			break;
+		case 'p':
+			{
+				// 0: uncapped, for measuring the real throughput
+				const int rates[] = { 30, 60, 120, 0 };
+				int n = sizeof(rates) / sizeof(rates[0]), r = 0;
+				while (r < n && rates[r] != g_scheduler.m_targetHz)
+					r++;
+				g_scheduler.m_targetHz = rates[(r + 1) % n];
+				if (g_scheduler.m_targetHz)
+					printf("target frame rate %d Hz\n", g_scheduler.m_targetHz);
+				else
+					printf("frame rate uncapped\n");
+			}
+			break;
+		case 'i':
+			printf("last frame: %d draws, %d program changes, %d texture binds, %d uniform updates, %d material changes, %d object changes\n",
+				g_lastStats.draws, g_lastStats.programChanges, g_lastStats.textureBinds, g_lastStats.uniformUpdates, g_lastStats.materialChanges, g_lastStats.objectChanges);
+			printf("front-end: %.2f ms on %d threads\n", g_frontEndMs, g_workers.active());
+			printf("textures: %d loaded (%d through pixel buffers, %d from the DDS cache), %d loading, %d missing, %.1f MB, %.1f ms decoding on %d threads, %.1f ms uploading\n",
+				g_textures.m_loaded, g_textures.m_staged, g_textures.m_cached, g_textures.pending(), g_textures.m_missing, g_textures.m_textureBytes / 1048576.0,
+				g_textures.decodeMs(), g_textures.threads(), g_textures.m_uploadMs);
+			if (g_textureArrays.m_ok)
+			{
+				int arrays, layers;
+				size_t bytes;
+				g_textureArrays.stats(arrays, layers, bytes);
+				printf("texture arrays %s: %d textures packed into %d arrays, %.1f MB\n", g_packTextures ? "on" : "off", layers, arrays, bytes / 1048576.0);
+			}
+			if (g_textures.m_budget)
+				printf("texture budget: %.2f of %.2f MB resident, pressure %.2f, %d textures coarser than they need, %d levels evicted, %d streamed in\n",
+					g_textures.residentBytes() / 1048576.0, g_textures.m_budget / 1048576.0, g_textures.pressure(), g_textures.m_starved,
+					g_textures.m_evictions, g_textures.m_streamIns);
+			else
+				printf("texture budget: none, %.2f MB resident\n", g_textures.residentBytes() / 1048576.0);
+			if (g_dynamicResolution)
+			{
+				CDynamicResolution &r = g_resolution;
+				printf("dynamic resolution: scale %.3f (%dx%d), %s %.2f ms for a %.1f ms budget, band %.2f-%.2f, hold %d frames, scale %.2f-%.2f\n",
+					r.m_scale, r.width(), r.height(), r.m_timer ? "gpu" : "frame", r.m_lastMs, r.m_budgetMs, r.m_lowBand, r.m_highBand, r.m_holdFrames, r.m_minScale, r.m_maxScale);
+			}
+			printf("frame rate: %.1f fps, %.2f ms to render and swap (target %s, on-demand %s)\n", g_scheduler.m_fps, g_scheduler.m_cpuMs,
+				g_scheduler.m_targetHz ? (to_string(g_scheduler.m_targetHz) + " Hz").c_str() : "uncapped", g_onDemand ? "on" : "off");
+			if (g_gpuDriven)
+				printf("gpu-driven: %d draws in %d multi draws\n", g_gpuScene.drawCount(), g_gpuScene.batchCount());
+			if (g_staticBatching)
+				printf("static batches: %d, %d culled\n", (int)g_staticBatches.size(), g_staticCulled);
+			if (g_clusterCulling && g_lastClusterStats.tested)
+				printf("meshlets: %d tested, %d (%.1f%%) outside the frustum, %d (%.1f%%) facing away\n", g_lastClusterStats.tested,
+					g_lastClusterStats.frustumCulled, 100.0f * g_lastClusterStats.frustumCulled / g_lastClusterStats.tested,
+					g_lastClusterStats.coneCulled, 100.0f * g_lastClusterStats.coneCulled / g_lastClusterStats.tested);
+			{
+				int meshes = 0, culled = 0, triangles = 0, culledTriangles = 0, flipped = 0;
+				for (int i = 0; i < N_OBJECTS; i++)
+				{
+					for (int k = 0; k < g_obj[i].m_meshes.size(); k++)
+					{
+						SMesh &mesh = g_obj[i].m_meshes[k];
+						if (mesh.m_verteces.empty())
+							continue;
+						meshes++;
+						triangles += mesh.m_verteces.size() / 3;
+						if (mesh.m_cullBackFaces)
+						{
+							culled++;
+							culledTriangles += mesh.m_verteces.size() / 3;
+						}
+					}
+					flipped += g_obj[i].m_flippedTriangles;
+				}
+				printf("back face culling: %d of %d meshes, %d of %d triangles, %d triangles flipped at load\n", culled, meshes, culledTriangles, triangles, flipped);
+			}
+			if (g_clusteredLighting)
+			{
+				SClusterLightStats &s = g_clusters.m_stats;
+				printf("clustered lights: %d of %d in view, %d in %d froxels (%.1f each, max %d), binned in %.3f ms\n", s.lights, (int)g_lights.size(),
+					s.references, s.occupied, s.occupied ? (float)s.references / s.occupied : 0.0f, s.maxPerCluster, s.ms);
+				if (g_shadows)
+					printf("shadows: %d views (%d draws) drawn again in %.3f ms, %d since start\n", g_shadowViews, g_shadowDraws, g_shadowMs, g_shadowAtlas.m_drawn);
+			}
+			printf("overdraw: %.2f shaded fragments per pixel (depth pre-pass %s, front to back %s)\n",
+				g_overdraw, g_depthPrepass ? "on" : "off", g_frontToBack ? "on" : "off");
+			printf("shader variants: %d (%d from the binary cache), parallel compile %s\n",
+				g_shaders.size(), g_shaders.fromBinary(), CShader::parallelCompile() ? "on" : "off");
+			{
+				const char *kinds[CGLState::N_KINDS] = { "program", "vao", "buffer", "texture", "uniform", "attrib array", "attrib location", "cull face" };
+				printf("gl calls (issued/skipped):");
+				for (int i = 0; i < CGLState::N_KINDS; i++)
+					printf(" %s %d/%d", kinds[i], g_lastGLIssued[i], g_lastGLSkipped[i]);
+				printf("\n");
+			}
+			break;
+	}
+	glutPostRedisplay();
+}
+
+// simulation thread: input and the camera, with its collisions, step at
+// CAMERA_HZ on their own thread and publish the camera through a triple
+// buffer. Frames take the latest camera and never wait for a step, and a
+// slow frame does not slow the steps down. The glut thread hands the input
+// over in g_lastKeys and g_mouseX/Y, and counts it in g_inputSerial; a
+// camera state tells the last input it has seen
+typedef struct SCameraState
+{
+	glm::vec3 m_position;
+	glm::vec3 m_front;
+	float m_rx;
+	unsigned int m_input;
+} SCameraState;
+
+CTripleBuffer<SCameraState> g_cameraStates;
+atomic<int> g_mouseX, g_mouseY;	// mouse drag not applied yet
+atomic<unsigned int> g_inputSerial;
+thread g_simulation;
+mutex g_simulationMutex;
+condition_variable g_simulationWake;
+bool g_simulationStop = false;	// under g_simulationMutex
+
+//update the camera according to the pressed keys, for one step of 1/CAMERA_HZ s
+void updateCamera(SCameraState &c)
+{
+	const float step = 60.0f / CAMERA_HZ;
+	if (g_lastKeys[0])
+		c.m_front = glm::rotate(4 * SPEED_ROTATE * step, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(c.m_front, 0.0f);
+
+	if (g_lastKeys[1])
+		c.m_front = glm::rotate(-4 * SPEED_ROTATE * step, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(c.m_front, 0.0f);
+
+	const float userWidth = 200.0f;
+	const float userHeight = 2000.0f;
+	if (g_lastKeys[2])
+	{
+		SBox b;
+		glm::vec3 newPos = c.m_position + SPEED_MOVE * step * (glm::vec3(c.m_front.x, 0.0f, c.m_front.z));
+		b.m_pMin.x = newPos.x - userWidth / 2.0f;
+		b.m_pMax.x = newPos.x + userWidth / 2.0f;
+		b.m_pMin.y = newPos.y - userHeight / 2.0f;
+		b.m_pMax.y = newPos.y + userHeight / 2.0f;
+		b.m_pMin.z = newPos.z - userWidth / 2.0f;
+		b.m_pMax.z = newPos.z + userWidth / 2.0f;
+		if (!g_collMap.collide(b))
+			c.m_position = newPos;
+	}
+
+	if (g_lastKeys[3])
+	{
+		SBox b;
+		glm::vec3 newPos = c.m_position - SPEED_MOVE * step * (glm::vec3(c.m_front.x, 0.0f, c.m_front.z));
+		b.m_pMin.x = newPos.x - userWidth / 2.0f;
+		b.m_pMax.x = newPos.x + userWidth / 2.0f;
+		b.m_pMin.y = newPos.y - userHeight / 2.0f;
+		b.m_pMax.y = newPos.y + userHeight / 2.0f;
+		b.m_pMin.z = newPos.z - userWidth / 2.0f;
+		b.m_pMax.z = newPos.z + userWidth / 2.0f;
+		if (!g_collMap.collide(b))
+			c.m_position = newPos;
+	}
+}
+
+// draw the scene from the current camera
+void renderFrame()
+{
+	glClearColor(sky_color[0],sky_color[1], sky_color[2], 1.0);
+	bindSceneTarget();
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	g_frameIncomplete = false;
+
+	// textures decoded since the last frame replace their placeholders
+	if (g_textures.update(TEXTURE_UPLOADS_PER_FRAME))
+		g_glState.invalidateTextures();
+	// mip levels in and out for the budget, from the sizes of the last frame
+	if (g_textures.manage())
+		g_glState.invalidateTextures();
+	resolveTextures();
+
+	g_view = viewMatrix();
+	g_clusters.setViewport(sceneWidth(), sceneHeight());
+	if (g_clusteredLighting && !g_gpuDriven)
+	{
+		bindLights();
+		if (g_shadows)
+			updateShadows();
+	}
+	if (g_uniformBuffers)
+		updateUniformBuffers(g_view);
+	if (g_gpuDriven)
+	{
+		syncGpuScene();
+		g_gpuScene.render(g_gpuCull);
+		g_glState.invalidate();
+
+		// culled on the GPU: every texture is drawn, at full size
+		for (int i = 0; i < N_OBJECTS; i++)
+		{
+			for (int k = 0; k < g_obj[i].m_materials.size(); k++)
+				g_textures.touch(g_obj[i].m_materials[k].m_textureId, (float)FLT_MAX);
+		}
+	}
+	else
+	{
+		buildDrawLists();
+		touchTextures();
+		submitRenderQueue();
+	}
+	if (g_textures.pending())
+		g_frameIncomplete = true;
+}
+
+// the arrow keys move the camera every step while they are held
+bool cameraMoving()
+{
+	return g_lastKeys[0] || g_lastKeys[1] || g_lastKeys[2] || g_lastKeys[3];
+}
+
+// turns the camera by the mouse drag since the last step
+void applyMouse(SCameraState &c)
+{
+	int vx = g_mouseX.exchange(0), vy = g_mouseY.exchange(0);
+	if (!vx && !vy)
+		return;
+
+	// computing rotation in Y axis
+	c.m_front = glm::rotate(vx*0.01f, glm::normalize(glm::vec3(0.0f, 1.0f, 0.0f))) * glm::vec4(c.m_front, 0.0f);
+	c.m_front = glm::normalize(c.m_front);
+
+	// computing rotation in x axis
+	c.m_rx -= vy*0.01f;
+	if (c.m_rx > 1.0f)
+		c.m_rx = 1.0f;
+	else if (c.m_rx < -1.0f)
+		c.m_rx = -1.0f;
+}
+
+// the simulation thread: steps while a key is held, sleeps on
+// g_simulationWake otherwise
+void simulationLoop()
+{
+	CFrameScheduler scheduler;
+	scheduler.init(CAMERA_HZ, CAMERA_HZ);
+	SCameraState camera = g_cameraStates.back();
+	for (;;)
+	{
+		{
+			unique_lock<mutex> lock(g_simulationMutex);
+			g_simulationWake.wait(lock, [&] { return g_simulationStop || cameraMoving() || g_inputSerial != camera.m_input; });
+			if (g_simulationStop)
+				return;
+		}
+		camera.m_input = g_inputSerial;
+		applyMouse(camera);
+		int steps = scheduler.beginFrame();
+		for (int i = 0; i < steps; i++)
+			updateCamera(camera);
+		g_cameraStates.back() = camera;
+		g_cameraStates.publish();
+		int wait = scheduler.endFrame();
+		if (!cameraMoving())
+			scheduler.idle();
+		else if (wait > 0)
+			this_thread::sleep_for(chrono::milliseconds(wait));
+	}
+}
+
+// the glut thread got some input for the simulation
+void notifySimulation()
+{
+	{
+		lock_guard<mutex> lock(g_simulationMutex);
+		g_inputSerial++;
+	}
+	g_simulationWake.notify_one();
+}
+
+// ends the simulation thread, at exit
+void stopSimulation()
+{
+	{
+		lock_guard<mutex> lock(g_simulationMutex);
+		g_simulationStop = true;
+	}
+	g_simulationWake.notify_one();
+	if (g_simulation.joinable())
+		g_simulation.join();
+}
+
+// starts the simulation from the current camera
+void startSimulation()
+{
+	SCameraState camera;
+	camera.m_position = g_position;
+	camera.m_front = g_front;
+	camera.m_rx = g_rx;
+	camera.m_input = g_inputSerial;
+	g_cameraStates.back() = camera;
+	g_cameraStates.publish();
+	g_cameraStates.back() = camera;
+	g_simulation = thread(simulationLoop);
+	atexit(stopSimulation);
+}
+
+// timer of the next frame, see drawCallback
+void frameTick(int)
+{
+	g_tickPending = false;
+	glutPostRedisplay();
+}
+
+// draw callback
+void drawCallback()
+{
+	// the steps are the simulation thread's: the frame only takes its camera
+	g_scheduler.beginFrame();
+	const SCameraState &camera = g_cameraStates.read();
+	g_position = camera.m_position;
+	g_front = camera.m_front;
+	g_rx = camera.m_rx;
+	if (g_dynamicResolution)
+	{
+		g_resolution.beginFrame();
+		renderFrame();
+		g_resolution.endFrame();
+	}
+	else
+		renderFrame();
+	glutSwapBuffers();
+	memcpy(g_lastGLIssued, g_glState.m_issued, sizeof(g_lastGLIssued));
+	memcpy(g_lastGLSkipped, g_glState.m_skipped, sizeof(g_lastGLSkipped));
+	g_glState.resetStats();
+	g_lastStats = g_stats;
+	g_stats.reset();
+	g_lastClusterStats = g_clusterStats;
+	g_clusterStats.reset();
+
+	// another frame: always when not on demand, else while the camera moves
+	// (or has input it has not shown yet) or until everything this one
+	// skipped is ready
+	int wait = g_scheduler.endFrame();
+	if (!g_onDemand || cameraMoving() || camera.m_input != g_inputSerial || g_frameIncomplete)
+	{
+		if (wait == 0)
+			glutPostRedisplay();
+		else if (!g_tickPending)
+		{
+			g_tickPending = true;
+			glutTimerFunc(wait, frameTick, 0);
+		}
+	}
+	else
+		g_scheduler.idle();
+}
+
+//resize callback
+void reshapeCallback(int w, int h)
+{
+	if (h == 0)
+		return;
 	glViewport(0, 0, w, h);
 	g_width  = w;
 	g_height = h;
+	if (g_resolution.m_ok)
+	{
+		// binds its target texture on the active unit behind the cache
+		g_resolution.resize(w, h);
+		g_glState.invalidateTextures();
+	}
 	g_projection = glm::perspective(3.14159f / 3.0f, (float)g_width / (float)g_height, NCP, FCP);
-	glUniformMatrix4fv(iLocProjection, 1, GL_FALSE, glm::value_ptr(g_projection));
+	g_clusters.setProjection(g_projection, g_width, g_height, NCP, FCP);
 }
 
 // opengl initialization
 void initOpengl()
 {
-	memset(g_lastKeys, 0, sizeof(int) * 4);
+	for (int i = 0; i < 4; i++)
+		g_lastKeys[i] = 0;
+	g_scheduler.init(60, CAMERA_HZ);
 	glEnable(GL_DEPTH_TEST);
 
 	// loading vertex and fragment shaders
@@ -1097,16 +3046,20 @@ void initOpengl()
 	{
 		 char* vertex_shader;
 		 char* fragment_shader;
-		 if (isOpenGL3Available && 1 == 2) { // disable OpenGL3.X
+		 if (GLEW_VERSION_3_3) {
 			 vertex_shader = "vertex.shader";
-			 fragment_shader = "vertex.shader";
+			 fragment_shader = "fragment.shader";
+			 g_uniformBuffers = true;
 		 }
 		 else {
 			 vertex_shader = "vertex120.shader";
 			 fragment_shader = "fragment120.shader";
 		 }
 
-		 if (g_shader.loadShader(vertex_shader, fragment_shader) == false)
+		 // every variant starts compiling now, in parallel when the driver can
+		 g_shaders.init(vertex_shader, fragment_shader, g_uniformBuffers);
+		 g_shaders.precompile();
+		 if (g_shaders.get(0) == NULL)
 		 {
 			 printf("Error in shaders. Press enter to finish-->\n");
 			 getchar();
@@ -1117,27 +3070,63 @@ void initOpengl()
 		printf("Exception in shaders\n");;
 	}
 
-	g_shader.setCurrent();
-
-	// initializing location of each shader
-	iLocPosition = glGetAttribLocation(g_shader.getProgram(), "inPosition");
-	iLocNormal   = glGetAttribLocation(g_shader.getProgram(), "inNormal");
-	iLocTexCoord = glGetAttribLocation(g_shader.getProgram(), "inTex");
-	iLocModel      = glGetUniformLocation(g_shader.getProgram(), "model");
-	iLocNormalMat  = glGetUniformLocation(g_shader.getProgram(), "normalMat");
-	iLocView       = glGetUniformLocation(g_shader.getProgram(), "view");
-	iLocProjection = glGetUniformLocation(g_shader.getProgram(), "projection");
-	iLocKa = glGetUniformLocation(g_shader.getProgram(), "ka");
-	iLocKd = glGetUniformLocation(g_shader.getProgram(), "kd");
-	iLocKs = glGetUniformLocation(g_shader.getProgram(), "ks");
-	iLocShine = glGetUniformLocation(g_shader.getProgram(), "shine");
-	iLocTexture_diffuse1 = glGetUniformLocation(g_shader.getProgram(), "texture_diffuse1");
-	iLocHasTexture = glGetUniformLocation(g_shader.getProgram(), "hasTexture");
-	iLocHasNormal = glGetUniformLocation(g_shader.getProgram(), "hasNormal");
+	if (g_uniformBuffers)
+	{
+		glGenBuffers(1, &g_frameUBO);
+		glBindBuffer(GL_UNIFORM_BUFFER, g_frameUBO);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(SFrameBlock), NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, UBO_FRAME, g_frameUBO);
+		glGenBuffers(1, &g_materialUBO);
+		glBindBuffer(GL_UNIFORM_BUFFER, g_materialUBO);
+		glBufferData(GL_UNIFORM_BUFFER, MAX_UBO_MATERIALS * sizeof(SGpuMaterial), NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, UBO_MATERIALS, g_materialUBO);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		g_drawRing.create(sizeof(SDrawBlock), 256);
+
+		// their variants compile now, ready when the textures are in
+		if (g_textureArrays.create())
+		{
+			g_packTextures = true;
+			for (unsigned int bits = 0; bits < CShaderCache::N_VARIANTS; bits++)
+				g_shaders.get(bits | VARIANT_TEXTURE_ARRAY);
+		}
+	}
+	glGenQueries(2, g_overdrawQueries);
+	g_resolution.create(g_width, g_height);
+	g_glState.invalidateTextures();
+
+	// the lit variants compile now too, ready when 'l' is pressed
+	if (g_uniformBuffers && g_clusters.create())
+	{
+		for (unsigned int bits = 0; bits < CShaderCache::N_VARIANTS; bits++)
+		{
+			g_shaders.get(bits | VARIANT_LIGHTS);
+			if (g_textureArrays.m_ok)
+				g_shaders.get(bits | VARIANT_LIGHTS | VARIANT_TEXTURE_ARRAY);
+		}
+		if (g_shadowAtlas.create())
+		{
+			for (unsigned int bits = 0; bits < CShaderCache::N_VARIANTS; bits++)
+			{
+				g_shaders.get(bits | VARIANT_LIGHTS | VARIANT_SHADOWS);
+				if (g_textureArrays.m_ok)
+					g_shaders.get(bits | VARIANT_LIGHTS | VARIANT_SHADOWS | VARIANT_TEXTURE_ARRAY);
+			}
+			glGenBuffers(1, &g_shadowUBO);
+			glBindBuffer(GL_UNIFORM_BUFFER, g_shadowUBO);
+			glBufferData(GL_UNIFORM_BUFFER, sizeof(SShadowBlock), NULL, GL_DYNAMIC_DRAW);
+			glBindBufferBase(GL_UNIFORM_BUFFER, UBO_SHADOWS, g_shadowUBO);
+			glBindBuffer(GL_UNIFORM_BUFFER, 0);
+			g_shadowRing.create(sizeof(SDrawBlock), 1024);
+			for (int i = 0; i < N_OBJECTS; i++)
+				g_shadowVersions[i] = ~0u;
+			g_shadows = true;
+		}
+	}
 
 	// default projection  nmatrix
 	g_projection = glm::perspective(3.14159f / 3.0f, (float)g_width / (float)g_height, NCP, FCP);
-	glUniformMatrix4fv(iLocProjection, 1, GL_FALSE, glm::value_ptr(g_projection));
+	g_clusters.setProjection(g_projection, g_width, g_height, NCP, FCP);
 }
 
 // usefull functionm to load object material files
@@ -1187,6 +3176,8 @@ void specialKeyboardDown(int key, int x, int y)
 		g_lastKeys[3] = 1;
 		break;
 	}
+	notifySimulation();
+	glutPostRedisplay();
 }
 
 // releasing a key
@@ -1211,6 +3202,8 @@ void specialKeyboardUp(int key, int x, int y)
 		g_lastKeys[3] = 0;
 		break;
 	}
+	notifySimulation();
+	glutPostRedisplay();
 }
 
 // called when left mouse has been clicked
@@ -1227,19 +3220,11 @@ void MouseMove(int x, int y)
 {
 	if (g_leftPressed)
 	{
-		int vx = g_lastX - x;
-		int vy = g_height - 1 - y - g_lastY;
-
-		// computing rotation in Y axis
-		g_front = glm::rotate(vx*0.01f, glm::normalize(glm::vec3(0.0f, 1.0f, 0.0f))) * glm::vec4(g_front, 0.0f);
-		g_front = glm::normalize(g_front);
-
-		// computing rotation in x axis
-		g_rx -= vy*0.01f;
-		if (g_rx > 1.0f)
-			g_rx = 1.0f;
-		else if (g_rx < -1.0f)
-			g_rx = -1.0f;
+		// the simulation turns the camera, see applyMouse
+		g_mouseX += g_lastX - x;
+		g_mouseY += g_height - 1 - y - g_lastY;
+		notifySimulation();
+		glutPostRedisplay();
 	}
 	g_lastX = x;
 	g_lastY = g_height - 1 - y;
@@ -1247,6 +3232,10 @@ void MouseMove(int x, int y)
 
 void load_default_config()
 {
+	// bed, wardrobe, sofa, tv table and tv: moved by the menu
+	g_obj[4].m_dynamic = g_obj[5].m_dynamic = true;
+	g_obj[17].m_dynamic = g_obj[18].m_dynamic = g_obj[19].m_dynamic = true;
+
 	loadObjMat(g_obj[0], "house.obj", "house.mtl");
 	loadObjMat(g_obj[1], "3dstylish-fbde01.obj", "3dstylish-fbde01.mtl");
 	loadObjMat(g_obj[2], "desk.obj", "desk.mtl");
@@ -1319,6 +3308,23 @@ void load_default_config()
 	g_obj[22].worldLocation((1117 + 1247) / 2.0f, (400 + 2500) / 2.0f, (-5055 - 3327) / 2.0f);
 	g_obj[22].scaleObject(-3327 - (-5055) + 240, 2500 - 400, 1247 - 1117);
 	g_obj[22].setEuler(0, 3.14159f / 2, 0);
+
+	// ceiling lights every room or so, then lamps and the glow of the
+	// tvs, which follow their objects
+	g_lights.clear();
+	for (int x = 0; x < 4; x++)
+	{
+		for (int z = 0; z < 3; z++)
+			g_lights.push_back(SPointLight(glm::vec3(1600 + 2700 * x, 2350, -1400 - 2800 * z), 3500, glm::vec3(0.35f, 0.32f, 0.27f)));
+	}
+	g_lights.push_back(SPointLight(glm::vec3(2200, 2300, -2600), 2000, glm::vec3(0.3f, 0.3f, 0.32f)));	// bathrooms
+	g_lights.push_back(SPointLight(glm::vec3(7000, 2300, -7600), 2000, glm::vec3(0.3f, 0.3f, 0.32f)));
+	g_lights.push_back(SPointLight(glm::vec3(3500, 1600, -600), 1800, glm::vec3(0.3f, 0.3f, 0.35f)));	// kitchen counter
+	g_lights.push_back(SPointLight(glm::vec3(0, 800, 0), 1800, glm::vec3(0.45f, 0.32f, 0.18f), 4));	// bed lamp
+	g_lights.push_back(SPointLight(glm::vec3(0, 600, 0), 1500, glm::vec3(0.45f, 0.4f, 0.3f), 2));	// desk lamp
+	g_lights.push_back(SPointLight(glm::vec3(1100, 1400, 0), 2200, glm::vec3(0.45f, 0.35f, 0.2f), 17));	// sofa lamp
+	g_lights.push_back(SPointLight(glm::vec3(0, 0, 0), 2000, glm::vec3(0.12f, 0.18f, 0.35f), 3));	// tvs
+	g_lights.push_back(SPointLight(glm::vec3(0, 0, 0), 2000, glm::vec3(0.12f, 0.18f, 0.35f), 19));
 }
 
 void reset_to_default()
@@ -1386,6 +3392,7 @@ void processMenuEvents(int option) {
 		reset_to_default(); // in oder to do so, just reload the changed objects
 		break;
 	}
+	glutPostRedisplay();
 }
 
 int main(int argc, char** argv)
@@ -1456,10 +3463,14 @@ int main(int argc, char** argv)
 	}
 	fclose(f);
 	printf("collision map has been created\n");
+	startSimulation();
+	g_workers.start(max(1, (int)thread::hardware_concurrency()) - 1);
+	g_drawLists.resize(g_workers.size());
+	g_textures.m_budget = (size_t)TEXTURE_BUDGET_MB << 20;
+	g_textures.start(OBJPATH, max(1, (int)thread::hardware_concurrency() - 1));
 
 	// glut callbacks!
 	glutDisplayFunc(drawCallback);
-	glutIdleFunc(drawCallback);
 	glutReshapeFunc(reshapeCallback);
 	glutKeyboardFunc(keyboardDown);
 	glutSpecialFunc(specialKeyboardDown);
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include "gl/glew.h"
+#include "glm/glm.hpp"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <xmmintrin.h>
+#define MESHLETS_SSE
+#endif
+
+using namespace std;
+
+// cluster culling: a triangle list is cut into meshlets of up to
+// MESHLET_TRIANGLES contiguous triangles, each one with a bounding sphere
+// and a normal cone. Every frame the meshlets outside the frustum (and,
+// for meshes whose back faces are not visible, the ones facing away) are
+// dropped, 4 at a time with SSE, and the survivors are returned as vertex
+// ranges for glMultiDrawArrays
+#define MESHLET_TRIANGLES 128
+
+// counters of the last cull calls
+typedef struct SClusterStats
+{
+	int tested;
+	int frustumCulled;
+	int coneCulled;
+
+	SClusterStats()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		tested = frustumCulled = coneCulled = 0;
+	}
+} SClusterStats;
+
+class CMeshlets
+{
+public:
+	CMeshlets()
+	{
+		m_count = 0;
+	}
+
+	// builds the meshlets of n/3 triangles (positions xyz, non indexed).
+	// With reorder, order gets a triangle order that keeps the meshlets
+	// compact (grouped by the main axis of the face normal, then along a
+	// Morton curve); the caller must apply it to its vertex arrays.
+	// Without reorder the triangles are cut as they are
+	void build(const float *pos, int n, bool reorder, vector<int> &order)
+	{
+		int triangles = n / 3;
+		order.resize(triangles);
+		for (int i = 0; i < triangles; i++)
+			order[i] = i;
+		vector<glm::vec3> normals(triangles);
+		vector<int> direction(triangles);
+		glm::vec3 bmin(1e30f), bmax(-1e30f);
+		for (int i = 0; i < triangles; i++)
+		{
+			glm::vec3 p0 = vertex(pos, 3 * i), p1 = vertex(pos, 3 * i + 1), p2 = vertex(pos, 3 * i + 2);
+			glm::vec3 nv = glm::cross(p1 - p0, p2 - p0);
+			float l = glm::length(nv);
+			normals[i] = l > 0.0f ? nv / l : glm::vec3(0.0f);
+			direction[i] = mainAxis(normals[i]);
+			bmin = glm::min(bmin, glm::min(p0, glm::min(p1, p2)));
+			bmax = glm::max(bmax, glm::max(p0, glm::max(p1, p2)));
+		}
+
+		bool sorted = reorder && triangles > MESHLET_TRIANGLES;
+		if (sorted)
+		{
+			glm::vec3 scale = 1023.0f / glm::max(bmax - bmin, glm::vec3(1e-6f));
+			vector<pair<unsigned long long, int> > keys(triangles);
+			for (int i = 0; i < triangles; i++)
+			{
+				glm::vec3 c = (vertex(pos, 3 * i) + vertex(pos, 3 * i + 1) + vertex(pos, 3 * i + 2)) / 3.0f;
+				glm::vec3 q = (c - bmin) * scale;
+				unsigned long long code = morton((unsigned int)q.x) | (morton((unsigned int)q.y) << 1) | (morton((unsigned int)q.z) << 2);
+				keys[i] = make_pair(((unsigned long long)direction[i] << 30) | code, i);
+			}
+			sort(keys.begin(), keys.end());
+			for (int i = 0; i < triangles; i++)
+				order[i] = keys[i].second;
+		}
+
+		// cut: a meshlet is full, or the normals turn to another axis
+		m_cx.clear(); m_cy.clear(); m_cz.clear(); m_radius.clear();
+		m_ax.clear(); m_ay.clear(); m_az.clear(); m_cutoff.clear();
+		m_first.clear(); m_triangles.clear();
+		for (int i = 0; i < triangles;)
+		{
+			int j = i + 1;
+			while (j < triangles && j - i < MESHLET_TRIANGLES && (!sorted || direction[order[j]] == direction[order[i]]))
+				j++;
+			addMeshlet(pos, normals, order, i, j);
+			i = j;
+		}
+		m_count = (int)m_first.size();
+
+		// padding, so the SSE loop reads whole groups of 4
+		while (m_cx.size() % 4)
+		{
+			m_cx.push_back(0.0f); m_cy.push_back(0.0f); m_cz.push_back(0.0f); m_radius.push_back(0.0f);
+			m_ax.push_back(0.0f); m_ay.push_back(0.0f); m_az.push_back(0.0f); m_cutoff.push_back(1.0f);
+		}
+	}
+
+	// appends the vertex ranges of the visible meshlets (neighbours merged)
+	// to firsts/counts; planes and camera are in the space of the positions
+	void cull(const glm::vec4 planes[6], const glm::vec3 &camera, bool cone, vector<GLint> &firsts, vector<GLsizei> &counts, SClusterStats &stats)
+	{
+		int previous = -2;
+		for (int i = 0; i < m_count; i += 4)
+		{
+			int frustum, facing;
+			test4(i, planes, camera, cone, frustum, facing);
+			for (int k = 0; k < 4 && i + k < m_count; k++)
+			{
+				stats.tested++;
+				if (!(frustum & (1 << k)))
+				{
+					stats.frustumCulled++;
+					continue;
+				}
+				if (!(facing & (1 << k)))
+				{
+					stats.coneCulled++;
+					continue;
+				}
+				int m = i + k;
+				if (previous == m - 1)
+					counts.back() += 3 * m_triangles[m];
+				else
+				{
+					firsts.push_back(3 * m_first[m]);
+					counts.push_back(3 * m_triangles[m]);
+				}
+				previous = m;
+			}
+		}
+	}
+
+	int size()
+	{
+		return m_count;
+	}
+
+private:
+	static glm::vec3 vertex(const float *pos, int i)
+	{
+		return glm::vec3(pos[3 * i], pos[3 * i + 1], pos[3 * i + 2]);
+	}
+
+	// 0..5: +x, -x, +y, -y, +z, -z
+	static int mainAxis(const glm::vec3 &n)
+	{
+		glm::vec3 a = glm::abs(n);
+		if (a.x >= a.y && a.x >= a.z)
+			return n.x >= 0.0f ? 0 : 1;
+		if (a.y >= a.z)
+			return n.y >= 0.0f ? 2 : 3;
+		return n.z >= 0.0f ? 4 : 5;
+	}
+
+	// spreads the 10 low bits of x to every third bit
+	static unsigned long long morton(unsigned int x)
+	{
+		unsigned long long v = x & 0x3ff;
+		v = (v | (v << 16)) & 0x030000ffULL;
+		v = (v | (v << 8)) & 0x0300f00fULL;
+		v = (v | (v << 4)) & 0x030c30c3ULL;
+		v = (v | (v << 2)) & 0x09249249ULL;
+		return v;
+	}
+
+	// meshlet of the triangles order[begin..end)
+	void addMeshlet(const float *pos, const vector<glm::vec3> &normals, const vector<int> &order, int begin, int end)
+	{
+		glm::vec3 bmin(1e30f), bmax(-1e30f), axis(0.0f);
+		for (int t = begin; t < end; t++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				glm::vec3 p = vertex(pos, 3 * order[t] + j);
+				bmin = glm::min(bmin, p);
+				bmax = glm::max(bmax, p);
+			}
+			axis += normals[order[t]];
+		}
+		glm::vec3 center = (bmin + bmax) * 0.5f;
+		float radius = 0.0f;
+		for (int t = begin; t < end; t++)
+		{
+			for (int j = 0; j < 3; j++)
+				radius = glm::max(radius, glm::length(vertex(pos, 3 * order[t] + j) - center));
+		}
+
+		// normal cone: the widest angle between the axis and a face normal.
+		// cutoff = sin(angle), 1 when the cone is too wide to ever cull
+		float cutoff = 1.0f;
+		float l = glm::length(axis);
+		if (l > 0.0f)
+		{
+			axis /= l;
+			float minDot = 1.0f;
+			for (int t = begin; t < end; t++)
+			{
+				// degenerate triangles are never visible
+				if (normals[order[t]] != glm::vec3(0.0f))
+					minDot = glm::min(minDot, glm::dot(axis, normals[order[t]]));
+			}
+			if (minDot > 0.1f)
+				cutoff = sqrtf(1.0f - minDot * minDot);
+		}
+
+		m_cx.push_back(center.x); m_cy.push_back(center.y); m_cz.push_back(center.z);
+		m_radius.push_back(radius);
+		m_ax.push_back(axis.x); m_ay.push_back(axis.y); m_az.push_back(axis.z);
+		m_cutoff.push_back(cutoff);
+		m_first.push_back(begin);
+		m_triangles.push_back(end - begin);
+	}
+
+	// bit k of frustum/facing: meshlet i+k intersects the frustum / may
+	// have a triangle facing the camera. The cone test is the apex-free
+	// one: all the triangles face away when
+	//   dot(center - camera, axis) >= cutoff * |center - camera| + radius
+	void test4(int i, const glm::vec4 planes[6], const glm::vec3 &camera, bool cone, int &frustum, int &facing)
+	{
+#ifdef MESHLETS_SSE
+		__m128 cx = _mm_loadu_ps(&m_cx[i]), cy = _mm_loadu_ps(&m_cy[i]), cz = _mm_loadu_ps(&m_cz[i]);
+		__m128 r = _mm_loadu_ps(&m_radius[i]);
+		__m128 negR = _mm_sub_ps(_mm_setzero_ps(), r);
+		__m128 inside = _mm_cmpeq_ps(r, r);	// all ones
+		for (int p = 0; p < 6; p++)
+		{
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(planes[p].x)), _mm_mul_ps(cy, _mm_set1_ps(planes[p].y))),
+				_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(planes[p].z)), _mm_set1_ps(planes[p].w)));
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(d, negR));
+		}
+		frustum = _mm_movemask_ps(inside);
+		facing = 0xf;
+		if (cone)
+		{
+			__m128 vx = _mm_sub_ps(cx, _mm_set1_ps(camera.x));
+			__m128 vy = _mm_sub_ps(cy, _mm_set1_ps(camera.y));
+			__m128 vz = _mm_sub_ps(cz, _mm_set1_ps(camera.z));
+			__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, _mm_loadu_ps(&m_ax[i])), _mm_mul_ps(vy, _mm_loadu_ps(&m_ay[i]))),
+				_mm_mul_ps(vz, _mm_loadu_ps(&m_az[i])));
+			__m128 limit = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&m_cutoff[i]), len), r);
+			facing = _mm_movemask_ps(_mm_cmplt_ps(d, limit));
+		}
+#else
+		frustum = facing = 0;
+		for (int k = 0; k < 4; k++)
+		{
+			glm::vec3 c(m_cx[i + k], m_cy[i + k], m_cz[i + k]);
+			float r = m_radius[i + k];
+			bool in = true;
+			for (int p = 0; p < 6; p++)
+				in = in && glm::dot(glm::vec3(planes[p]), c) + planes[p].w > -r;
+			if (in)
+				frustum |= 1 << k;
+			glm::vec3 v = c - camera;
+			if (!cone || glm::dot(v, glm::vec3(m_ax[i + k], m_ay[i + k], m_az[i + k])) < m_cutoff[i + k] * glm::length(v) + r)
+				facing |= 1 << k;
+		}
+#endif
+	}
+
+	int m_count;
+
+	// per meshlet, structure of arrays padded to a multiple of 4
+	vector<float> m_cx, m_cy, m_cz, m_radius;
+	vector<float> m_ax, m_ay, m_az, m_cutoff;
+	vector<int> m_first, m_triangles;
+};
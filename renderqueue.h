@@ -0,0 +1,193 @@
+#pragma once
+
+#include <vector>
+#include <string.h>
+
+using namespace std;
+
+// per-frame render statistics
+typedef struct SRenderStats
+{
+	int draws;
+	int textureBinds;
+	int uniformUpdates;
+	int materialChanges;
+	int programChanges;
+	int objectChanges;
+
+	SRenderStats()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		draws = textureBinds = uniformUpdates = materialChanges = programChanges = objectChanges = 0;
+	}
+} SRenderStats;
+
+// a queue of draw packets ordered by 64-bit sort keys.
+// Key layout, from the most significant bit:
+//   pass (4) | shader variant (8) | texture (16) | material (12) | depth (24)
+// so state changes get sorted by cost: program, then texture, then
+// material uniforms, and front to back inside the same state
+class CRenderQueue
+{
+public:
+	enum
+	{
+		PASS_BITS = 4,
+		VARIANT_BITS = 8,
+		TEXTURE_BITS = 16,
+		MATERIAL_BITS = 12,
+		DEPTH_BITS = 24
+	};
+
+	// builds a sort key; depth is a view distance normalized to [0, 1]
+	static unsigned long long makeKey(unsigned int pass, unsigned int variant, unsigned int texture, unsigned int material, float depth)
+	{
+		if (depth < 0.0f) depth = 0.0f;
+		if (depth > 1.0f) depth = 1.0f;
+		unsigned long long d = (unsigned long long)(depth * ((1 << DEPTH_BITS) - 1));
+		unsigned long long k = pass & ((1 << PASS_BITS) - 1);
+		k = (k << VARIANT_BITS) | (variant & ((1 << VARIANT_BITS) - 1));
+		k = (k << TEXTURE_BITS) | (texture & ((1 << TEXTURE_BITS) - 1));
+		k = (k << MATERIAL_BITS) | (material & ((1 << MATERIAL_BITS) - 1));
+		k = (k << DEPTH_BITS) | d;
+		return k;
+	}
+
+	// same fields with the depth moved to the top: strict front to back
+	// order, the state only breaks ties between draws at the same depth
+	static unsigned long long makeDepthKey(unsigned int variant, unsigned int texture, unsigned int material, float depth)
+	{
+		unsigned long long k = makeKey(0, variant, texture, material, depth);
+		return ((k & ((1ULL << DEPTH_BITS) - 1)) << (64 - DEPTH_BITS)) | (k >> DEPTH_BITS);
+	}
+
+	CRenderQueue()
+	{
+		m_sorted = true;
+	}
+
+	void clear()
+	{
+		m_keys.clear();
+		m_payloads.clear();
+		m_sorted = true;
+	}
+
+	// adds a packet; payload is an index into the caller's packet array
+	void push(unsigned long long key, unsigned int payload)
+	{
+		m_keys.push_back(key);
+		m_payloads.push_back(payload);
+		m_sorted = false;
+	}
+
+	// adds the packets of another queue, their payloads moved by offset
+	void append(const CRenderQueue &q, unsigned int offset)
+	{
+		m_keys.insert(m_keys.end(), q.m_keys.begin(), q.m_keys.end());
+		for (int i = 0; i < q.m_payloads.size(); i++)
+			m_payloads.push_back(q.m_payloads[i] + offset);
+		m_sorted = m_keys.size() == q.m_keys.size() && q.m_sorted;
+	}
+
+	// replaces the queue by the sorted queues merged, payloads moved by
+	// their offsets. Ties go to the first queue, so the merge is stable
+	void merge(const vector<CRenderQueue*> &queues, const vector<unsigned int> &offsets)
+	{
+		clear();
+		int k = (int)queues.size();
+		vector<int> heads(k, 0);
+		for (;;)
+		{
+			int best = -1;
+			for (int q = 0; q < k; q++)
+			{
+				if (heads[q] < queues[q]->size() && (best < 0 || queues[q]->m_keys[heads[q]] < queues[best]->m_keys[heads[best]]))
+					best = q;
+			}
+			if (best < 0)
+				break;
+			m_keys.push_back(queues[best]->m_keys[heads[best]]);
+			m_payloads.push_back(queues[best]->m_payloads[heads[best]] + offsets[best]);
+			heads[best]++;
+		}
+	}
+
+	int size()
+	{
+		return (int)m_keys.size();
+	}
+
+	unsigned long long key(int i)
+	{
+		return m_keys[i];
+	}
+
+	unsigned int payload(int i)
+	{
+		return m_payloads[i];
+	}
+
+	// LSD radix sort, 8 bits per pass. Passes where every key has the same
+	// digit are skipped, so unused key fields cost nothing. Stable, so equal
+	// keys keep their submission order
+	void sort()
+	{
+		int n = (int)m_keys.size();
+		if (m_sorted || n < 2)
+		{
+			m_sorted = true;
+			return;
+		}
+		m_tmpKeys.resize(n);
+		m_tmpPayloads.resize(n);
+		unsigned long long *keys = m_keys.data(), *tmpKeys = m_tmpKeys.data();
+		unsigned int *payloads = m_payloads.data(), *tmpPayloads = m_tmpPayloads.data();
+
+		// all histograms in a single read of the keys
+		unsigned int counts[8][256];
+		memset(counts, 0, sizeof(counts));
+		for (int i = 0; i < n; i++)
+		{
+			unsigned long long k = keys[i];
+			for (int b = 0; b < 8; b++)
+				counts[b][(k >> (8 * b)) & 0xff]++;
+		}
+
+		for (int b = 0; b < 8; b++)
+		{
+			unsigned int *c = counts[b];
+			if (c[(keys[0] >> (8 * b)) & 0xff] == (unsigned int)n)
+				continue;
+			unsigned int offsets[256], sum = 0;
+			for (int i = 0; i < 256; i++)
+			{
+				offsets[i] = sum;
+				sum += c[i];
+			}
+			for (int i = 0; i < n; i++)
+			{
+				unsigned int o = offsets[(keys[i] >> (8 * b)) & 0xff]++;
+				tmpKeys[o] = keys[i];
+				tmpPayloads[o] = payloads[i];
+			}
+			unsigned long long *k = keys; keys = tmpKeys; tmpKeys = k;
+			unsigned int *p = payloads; payloads = tmpPayloads; tmpPayloads = p;
+		}
+		if (keys != m_keys.data())
+		{
+			m_keys.swap(m_tmpKeys);
+			m_payloads.swap(m_tmpPayloads);
+		}
+		m_sorted = true;
+	}
+
+private:
+	vector<unsigned long long> m_keys, m_tmpKeys;
+	vector<unsigned int> m_payloads, m_tmpPayloads;
+	bool m_sorted;	// nothing pushed since the last sort or merge
+};
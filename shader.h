@@ -4,21 +4,40 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
 #include "gl/glew.h"
 #include "gl/freeglut.h"
+#ifdef _WIN32
+#include <direct.h>
+#define makeDir(d) _mkdir(d)
+#else
+#include <sys/stat.h>
+#define makeDir(d) mkdir(d, 0755)
+#endif
 
 using namespace std;
 
+// linked programs are saved here, one file per source/driver hash
+#define SHADER_CACHE_DIR "shadercache"
+
 class CShader
 {
 public:
 	GLuint prog;
 	bool ok;
+	// the program was linked by beginLoad but not checked yet
+	bool pending;
+	// the program came from the binary cache
+	bool fromBinary;
 
 	CShader()
 	{
 		prog = 0;
 		ok = false;
+		pending = false;
+		fromBinary = false;
 	}
 
 	// loads chaders
@@ -32,7 +51,29 @@ public:
 		return prog;
 	}
 
-	bool loadShader(const char* vertexFilename, const char* fragmentFilename)
+	// puts the #define lines of a permutation right after the #version line
+	static string addDefines(const string &code, const string &defines)
+	{
+		if (defines.empty())
+			return code;
+		size_t pos = code.find("#version");
+		if (pos != string::npos)
+			pos = code.find('\n', pos);
+		if (pos == string::npos)
+			return defines + code;
+		return code.substr(0, pos + 1) + defines + code.substr(pos + 1);
+	}
+
+	// loads chaders; defines are #define lines added to both stages
+	bool loadShader(const char* vertexFilename, const char* fragmentFilename, const string &defines = "")
+	{
+		return beginLoad(vertexFilename, fragmentFilename, defines) && finishLoad();
+	}
+
+	// starts loading a program. It comes from the binary cache when the
+	// same sources were linked before by the same driver; otherwise it is
+	// compiled and linked without waiting for the result (see ready)
+	bool beginLoad(const char* vertexFilename, const char* fragmentFilename, const string &defines = "")
 	{
 		if (prog)
 		{
@@ -40,6 +81,8 @@ public:
 		}
 		ok = true;
 		prog = 0;
+		pending = false;
+		fromBinary = false;
 		std::string vertexCode;
 		std::string fragmentCode;
 		std::ifstream vShaderFile;
@@ -62,8 +105,8 @@ public:
 			fShaderFile.close();
 
 			// to string
-			vertexCode = vShaderStream.str();
-			fragmentCode = fShaderStream.str();
+			vertexCode = addDefines(vShaderStream.str(), defines);
+			fragmentCode = addDefines(fShaderStream.str(), defines);
 		}
 		catch (std::ifstream::failure e)
 		{
@@ -71,63 +114,174 @@ public:
 			ok = false;
 			return false;
 		}
+
+		cacheKey = binaryKey(vertexCode + '\0' + fragmentCode);
+		if (loadBinary())
+		{
+			fromBinary = true;
+			return true;
+		}
+
 		const char* vsCode = vertexCode.c_str();
 		const char * fsCode = fragmentCode.c_str();
-		GLuint vertex, fragment;
-		GLint success;
-		char infoLog[512];
 
 		// vertex shaders... compiling....
-		vertex = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vertex, 1, &vsCode, NULL);
-		glCompileShader(vertex);
+		vertexId = glCreateShader(GL_VERTEX_SHADER);
+		glShaderSource(vertexId, 1, &vsCode, NULL);
+		glCompileShader(vertexId);
+
+		// fragment shaders... compiling....
+		fragmentId = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(fragmentId, 1, &fsCode, NULL);
+		glCompileShader(fragmentId);
+
+		// Shader prog
+		prog = glCreateProgram();
+		glAttachShader(prog, vertexId);
+		glAttachShader(prog, fragmentId);
+		// same attribute locations in every program, so one vao fits all of them
+		glBindAttribLocation(prog, 0, "inPosition");
+		glBindAttribLocation(prog, 1, "inNormal");
+		glBindAttribLocation(prog, 2, "inTex");
+		if (programBinaries())
+			glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(prog);
+		pending = true;
+		return true;
+	}
+
+	// false while the driver is still compiling a pending program in the
+	// background. Without parallel compilation, finishLoad just waits
+	bool ready()
+	{
+		if (!pending || !parallelCompile())
+			return true;
+		GLint done = 0;
+		glGetProgramiv(prog, GL_COMPLETION_STATUS_ARB, &done);
+		return done != 0;
+	}
+
+	// waits for a pending program, checks it and saves it in the binary cache
+	bool finishLoad()
+	{
+		if (!pending)
+			return ok;
+		pending = false;
+		GLint success;
+		char infoLog[512];
 
 		// check for compilation errors
-		glGetShaderiv(vertex, GL_COMPILE_STATUS, &success);
+		glGetShaderiv(vertexId, GL_COMPILE_STATUS, &success);
 		if (!success)
 		{
-			glGetShaderInfoLog(vertex, 512, NULL, infoLog);
+			glGetShaderInfoLog(vertexId, 512, NULL, infoLog);
 			cout << "Vertex shader error: " << infoLog << endl;
 			ok = false;
+		}
+		glGetShaderiv(fragmentId, GL_COMPILE_STATUS, &success);
+		if (ok && !success)
+		{
+			glGetShaderInfoLog(fragmentId, 512, NULL, infoLog);
+			std::cout << "Fragment shader error: " << infoLog << std::endl;
+			ok = false;
+		}
+
+		// Print linking errors if any
+		glGetProgramiv(prog, GL_LINK_STATUS, &success);
+		if (ok && !success)
+		{
+			glGetProgramInfoLog(prog, 512, NULL, infoLog);
+			cout << "Shaders link error: " << infoLog << endl;
+			ok = false;
+		}
+
+		// shaders are linked into prog. We dont need them anymore
+		glDeleteShader(vertexId);
+		glDeleteShader(fragmentId);
+		if (ok)
+			saveBinary();
+		return ok;
+	}
+
+	// loads a compute shader into prog (needs OpenGL 4.3)
+	bool loadComputeShader(const char* computeFilename)
+	{
+		ok = true;
+		prog = 0;
+		std::string computeCode;
+		std::ifstream cShaderFile;
+
+		// enabel exceptions
+		cShaderFile.exceptions(std::ifstream::badbit);
+		try
+		{
+			cShaderFile.open(computeFilename);
+			std::stringstream cShaderStream;
+			cShaderStream << cShaderFile.rdbuf();
+			cShaderFile.close();
+			computeCode = cShaderStream.str();
+		}
+		catch (std::ifstream::failure e)
+		{
+			cout << "Error loading shader" << endl;
+			ok = false;
 			return false;
 		}
+		const char* csCode = computeCode.c_str();
+		GLuint compute;
+		GLint success;
+		char infoLog[512];
 
-		// fragment shaders... compiling....
-		fragment = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fragment, 1, &fsCode, NULL);
-		glCompileShader(fragment);
+		// compute shader... compiling....
+		compute = glCreateShader(GL_COMPUTE_SHADER);
+		glShaderSource(compute, 1, &csCode, NULL);
+		glCompileShader(compute);
 
 		// check for compilation errors
-		glGetShaderiv(fragment, GL_COMPILE_STATUS, &success);
+		glGetShaderiv(compute, GL_COMPILE_STATUS, &success);
 		if (!success)
 		{
-			glGetShaderInfoLog(fragment, 512, NULL, infoLog);
-			std::cout << "Fragment shader error: " << infoLog << std::endl;
+			glGetShaderInfoLog(compute, 512, NULL, infoLog);
+			cout << "Compute shader error: " << infoLog << endl;
+			glDeleteShader(compute);
 			ok = false;
 			return false;
 		}
 
-		// Shader prog
 		prog = glCreateProgram();
-		glAttachShader(prog, vertex);
-		glAttachShader(prog, fragment);
+		glAttachShader(prog, compute);
 		glLinkProgram(prog);
-		// Print linking errors if any
 		glGetProgramiv(prog, GL_LINK_STATUS, &success);
 		if (!success)
 		{
 			glGetProgramInfoLog(prog, 512, NULL, infoLog);
-			cout << "Shaders link error: " << infoLog << endl;
+			cout << "Compute shader link error: " << infoLog << endl;
 			ok = false;
 			return false;
 		}
-
-		// shaders are linked into prog. We dont need them anymore
-		glDeleteShader(vertex);
-		glDeleteShader(fragment);
+		glDeleteShader(compute);
 		return true;
 	}
 
+	// driver compiles shaders on its own threads: ARB_parallel_shader_compile,
+	// or its KHR twin (same enums, not known by glew 2.0)
+	static bool parallelCompile()
+	{
+		static int available = -1;
+		if (available < 0)
+		{
+			PFNGLMAXSHADERCOMPILERTHREADSARBPROC maxThreads = NULL;
+			if (GLEW_ARB_parallel_shader_compile)
+				maxThreads = glMaxShaderCompilerThreadsARB;
+			else if (hasExtension("GL_KHR_parallel_shader_compile"))
+				maxThreads = (PFNGLMAXSHADERCOMPILERTHREADSARBPROC)glutGetProcAddress("glMaxShaderCompilerThreadsKHR");
+			if (maxThreads)
+				maxThreads(0xFFFFFFFF);	// as many threads as the driver wants
+			available = maxThreads != NULL;
+		}
+		return available != 0;
+	}
+
 	// set shader as current one
 	void setCurrent()
 	{
@@ -136,5 +290,123 @@ public:
 		else
 			cout << "CShader::setCurrent error: shader program does not exit" << endl;
 	}
+
+private:
+	static bool hasExtension(const char *name)
+	{
+		if (GLEW_VERSION_3_0)
+		{
+			GLint n = 0;
+			glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+			for (int i = 0; i < n; i++)
+			{
+				if (!strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name))
+					return true;
+			}
+			return false;
+		}
+		const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+		return extensions && strstr(extensions, name);
+	}
+
+	// glGetProgramBinary is there and the driver has at least one format
+	static bool programBinaries()
+	{
+		static int available = -1;
+		if (available < 0)
+		{
+			GLint formats = 0;
+			if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+				glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+			available = formats > 0;
+		}
+		return available != 0;
+	}
+
+	// FNV-1a of the sources and the driver strings: a new driver never
+	// gets the binaries of an older one
+	static unsigned long long binaryKey(const string &code)
+	{
+		string s = code;
+		GLenum names[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		for (int i = 0; i < 3; i++)
+		{
+			const char *v = (const char*)glGetString(names[i]);
+			s += '\0';
+			s += v ? v : "";
+		}
+		unsigned long long h = 14695981039346656037ULL;
+		for (size_t i = 0; i < s.size(); i++)
+		{
+			h ^= (unsigned char)s[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	string binaryPath()
+	{
+		char name[64];
+		sprintf(name, "/%016llx.bin", cacheKey);
+		return string(SHADER_CACHE_DIR) + name;
+	}
+
+	// file: format, length, binary. Rejected binaries are compiled again
+	bool loadBinary()
+	{
+		if (!programBinaries())
+			return false;
+		FILE *f = fopen(binaryPath().c_str(), "rb");
+		if (f == NULL)
+			return false;
+		GLenum format;
+		GLint length;
+		vector<char> data;
+		bool read = fread(&format, sizeof(format), 1, f) == 1 && fread(&length, sizeof(length), 1, f) == 1 && length > 0;
+		if (read)
+		{
+			data.resize(length);
+			read = fread(data.data(), 1, length, f) == (size_t)length;
+		}
+		fclose(f);
+		if (!read)
+			return false;
+
+		prog = glCreateProgram();
+		glProgramBinary(prog, format, data.data(), length);
+		GLint success;
+		glGetProgramiv(prog, GL_LINK_STATUS, &success);
+		if (!success)
+		{
+			glDeleteProgram(prog);
+			prog = 0;
+			return false;
+		}
+		return true;
+	}
+
+	void saveBinary()
+	{
+		if (!programBinaries())
+			return;
+		GLint length = 0;
+		glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+		vector<char> data(length);
+		GLenum format;
+		glGetProgramBinary(prog, length, &length, &format, data.data());
+		makeDir(SHADER_CACHE_DIR);
+		FILE *f = fopen(binaryPath().c_str(), "wb");
+		if (f == NULL)
+			return;
+		fwrite(&format, sizeof(format), 1, f);
+		fwrite(&length, sizeof(length), 1, f);
+		fwrite(data.data(), 1, length, f);
+		fclose(f);
+	}
+
+	GLuint vertexId, fragmentId;
+	unsigned long long cacheKey;
 };
 
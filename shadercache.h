@@ -0,0 +1,170 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include "shader.h"
+#include "uniformbuffers.h"
+
+using namespace std;
+
+// feature bits of a shader permutation. Each bit is a #define of the
+// shader sources, so a variant only runs the code its material needs
+#define VARIANT_TEXTURED 1	// the material has a diffuse map
+#define VARIANT_NORMALS  2	// the mesh has normals: lit with a light in the eye
+#define VARIANT_SPECULAR 4	// the material has a specular term (with normals only)
+#define VARIANT_DEPTH    8	// depth pre-pass: position only, the other bits are ignored
+#define VARIANT_LIGHTS   16	// clustered point lights (with normals, GLSL 3.30 only)
+#define VARIANT_SHADOWS  32	// shadow maps for the sun and the point lights (with lights)
+#define VARIANT_TEXTURE_ARRAY 64	// the diffuse map is a layer of a texture array (textured, GLSL 3.30 only)
+
+// a compiled permutation and the locations of its uniforms.
+// Uniforms moved into uniform blocks are -1 in the GLSL 3.30 programs
+typedef struct SShaderVariant
+{
+	CShader m_shader;
+	unsigned int m_bits;
+	bool m_ready;	// linked, checked and locations known
+	GLint m_model, m_normalMat, m_view, m_projection;
+	GLint m_ka, m_kd, m_ks, m_shine;
+	GLint m_texture;
+	GLint m_lightData, m_clusterRanges, m_lightIndices, m_shadowAtlas;
+
+	GLuint program()
+	{
+		return m_shader.getProgram();
+	}
+} SShaderVariant;
+
+// programs compiled from one vertex/fragment pair, one per set of feature
+// bits. Compilation is started by get and does not block: with parallel
+// shader compilation the driver builds every variant at the same time,
+// and ready() tells when one can be used
+class CShaderCache
+{
+public:
+	enum { N_VARIANTS = 8 };
+
+	CShaderCache()
+	{
+		m_uniformBlocks = false;
+		m_fromBinary = 0;
+	}
+
+	// uniformBlocks: the sources use the Frame/Materials/Draw blocks
+	void init(const string &vertexFilename, const string &fragmentFilename, bool uniformBlocks)
+	{
+		m_vertexFilename = vertexFilename;
+		m_fragmentFilename = fragmentFilename;
+		m_uniformBlocks = uniformBlocks;
+	}
+
+	// starts every variant, so they compile while the scene loads
+	void precompile()
+	{
+		for (unsigned int bits = 0; bits < N_VARIANTS; bits++)
+			get(bits);
+		get(VARIANT_DEPTH);
+	}
+
+	// the variant for some feature bits, NULL if its sources can not be read
+	SShaderVariant *get(unsigned int bits)
+	{
+		// specular and point lights need normals
+		if (!(bits & VARIANT_NORMALS))
+			bits &= ~(VARIANT_SPECULAR | VARIANT_LIGHTS);
+		if (!(bits & VARIANT_LIGHTS))
+			bits &= ~VARIANT_SHADOWS;
+		if (!(bits & VARIANT_TEXTURED))
+			bits &= ~VARIANT_TEXTURE_ARRAY;
+		if (bits & VARIANT_DEPTH)
+			bits = VARIANT_DEPTH;
+		map<unsigned int, SShaderVariant>::iterator it = m_variants.find(bits);
+		if (it != m_variants.end())
+			return &it->second;
+
+		SShaderVariant &v = m_variants[bits];
+		v.m_bits = bits;
+		v.m_ready = false;
+		if (!v.m_shader.beginLoad(m_vertexFilename.c_str(), m_fragmentFilename.c_str(), defines(bits)))
+		{
+			m_variants.erase(bits);
+			return NULL;
+		}
+		if (v.m_shader.fromBinary)
+			m_fromBinary++;
+		return &v;
+	}
+
+	// true when the variant can be used; never blocks while the driver is
+	// still compiling it. A variant that does not compile ends the program
+	bool ready(SShaderVariant *v)
+	{
+		if (v->m_ready)
+			return true;
+		if (!v->m_shader.ready())
+			return false;
+		if (!v->m_shader.finishLoad())
+		{
+			printf("Error compiling shader variant %u (%s). Press enter to finish-->\n", v->m_bits, m_fragmentFilename.c_str());
+			getchar();
+			exit(1);
+		}
+		GLuint p = v->program();
+		v->m_model = glGetUniformLocation(p, "model");
+		v->m_normalMat = glGetUniformLocation(p, "normalMat");
+		v->m_view = glGetUniformLocation(p, "view");
+		v->m_projection = glGetUniformLocation(p, "projection");
+		v->m_ka = glGetUniformLocation(p, "ka");
+		v->m_kd = glGetUniformLocation(p, "kd");
+		v->m_ks = glGetUniformLocation(p, "ks");
+		v->m_shine = glGetUniformLocation(p, "shine");
+		v->m_texture = glGetUniformLocation(p, "texture_diffuse1");
+		v->m_lightData = glGetUniformLocation(p, "lightData");
+		v->m_clusterRanges = glGetUniformLocation(p, "clusterRanges");
+		v->m_lightIndices = glGetUniformLocation(p, "lightIndices");
+		v->m_shadowAtlas = glGetUniformLocation(p, "shadowAtlas");
+		if (m_uniformBlocks)
+			bindUniformBlocks(p);
+		v->m_ready = true;
+		return true;
+	}
+
+	int size()
+	{
+		return (int)m_variants.size();
+	}
+
+	// variants loaded from the program binary cache
+	int fromBinary()
+	{
+		return m_fromBinary;
+	}
+
+	static string defines(unsigned int bits)
+	{
+		string d;
+		if (bits & VARIANT_TEXTURED)
+			d += "#define TEXTURED\n";
+		if (bits & VARIANT_NORMALS)
+			d += "#define NORMALS\n";
+		if (bits & VARIANT_SPECULAR)
+			d += "#define SPECULAR\n";
+		if (bits & VARIANT_LIGHTS)
+			d += "#define LIGHTS\n";
+		if (bits & VARIANT_SHADOWS)
+			d += "#define SHADOWS\n";
+		if (bits & VARIANT_TEXTURE_ARRAY)
+			d += "#define TEXTURE_ARRAY\n";
+		if (bits & VARIANT_DEPTH)
+			d += "#define DEPTH_ONLY\n";
+		return d;
+	}
+
+private:
+	string m_vertexFilename, m_fragmentFilename;
+	bool m_uniformBlocks;
+	int m_fromBinary;
+	map<unsigned int, SShaderVariant> m_variants;
+};
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <vector>
+#include "gl/glew.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "clusteredlights.h"
+
+using namespace std;
+
+// cached shadow maps: one depth atlas holds the map of the sun (a big
+// orthographic tile) and six perspective faces for each shadowed point
+// light. Maps stay in the atlas from frame to frame; a view is drawn again
+// only when its light moved or when something changed inside its range
+// (touch), so a still scene costs no shadow draw at all
+#define SHADOW_ATLAS_SIZE 4096
+#define SHADOW_SUN_SIZE 2048
+#define SHADOW_FACE_SIZE 256
+#define MAX_SHADOW_LIGHTS 24
+#define MAX_SHADOW_FACES (6 * MAX_SHADOW_LIGHTS)	// fragment.shader has the same number
+#define SHADOW_NEAR 20.0f	// where the faces of a point light start, in millimeters
+
+// the Shadows block (std140): matrices from eye space to the atlas
+typedef struct SShadowBlock
+{
+	glm::vec4 sunDirection;	// eye space, towards the sun
+	glm::vec4 sunColor;
+	glm::mat4 sunMatrix;
+	glm::mat4 faceMatrices[MAX_SHADOW_FACES];	// 6 per light: +x, -x, +y, -y, +z, -z
+} SShadowBlock;
+
+class CShadowAtlas
+{
+public:
+	// view 0 is the sun, 1 + 6 * light + face the point light faces
+	enum { N_VIEWS = 1 + MAX_SHADOW_FACES };
+
+	CShadowAtlas()
+	{
+		m_ok = false;
+		m_fbo = m_texture = 0;
+		m_drawn = 0;
+		m_sunColor = glm::vec3(0.0f);
+		m_dirty.assign(N_VIEWS, true);
+		m_lights.resize(MAX_SHADOW_LIGHTS);
+		m_viewProjections.resize(N_VIEWS);
+	}
+
+	bool create()
+	{
+		glGenTextures(1, &m_texture);
+		glBindTexture(GL_TEXTURE_2D, m_texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+		// hardware 2x2 filtered comparison, for a sampler2DShadow
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &m_fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_texture, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		m_ok = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return m_ok;
+	}
+
+	// a directional light covering the box; color 0 turns it off
+	void setSun(const glm::vec3 &direction, const glm::vec3 &color, const glm::vec3 &bmin, const glm::vec3 &bmax)
+	{
+		glm::vec3 d = glm::normalize(direction);
+		if (d == m_sunDirection && bmin == m_sunMin && bmax == m_sunMax)
+		{
+			m_sunColor = color;
+			return;
+		}
+		m_sunDirection = d;
+		m_sunColor = color;
+		m_sunMin = bmin;
+		m_sunMax = bmax;
+		glm::vec3 center = (bmin + bmax) * 0.5f;
+		float r = glm::length(bmax - bmin) * 0.5f;
+		glm::vec3 up = fabsf(d.y) > 0.9f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+		m_viewProjections[0] = glm::ortho(-r, r, -r, r, 0.0f, 2.0f * r) * glm::lookAt(center - d * r, center, up);
+		m_dirty[0] = true;
+	}
+
+	// gives the first MAX_SHADOW_LIGHTS lights their faces (m_shadow), the
+	// others none; a light that moved or changed range is drawn again
+	void setLights(vector<SPointLight> &lights)
+	{
+		for (int i = 0; i < MAX_SHADOW_LIGHTS; i++)
+		{
+			SLightSlot &s = m_lights[i];
+			bool used = i < lights.size();
+			if (!used)
+			{
+				s.m_used = false;
+				continue;
+			}
+			SPointLight &l = lights[i];
+			l.m_shadow = 6 * i;
+			if (s.m_used && s.m_position == l.m_position && s.m_radius == l.m_radius)
+				continue;
+			s.m_used = true;
+			s.m_position = l.m_position;
+			s.m_radius = l.m_radius;
+			static const glm::vec3 dirs[6] = { glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1) };
+			static const glm::vec3 ups[6] = { glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0) };
+			glm::mat4 projection = glm::perspective(3.14159265f / 2.0f, 1.0f, SHADOW_NEAR, l.m_radius);
+			for (int f = 0; f < 6; f++)
+			{
+				m_viewProjections[1 + 6 * i + f] = projection * glm::lookAt(l.m_position, l.m_position + dirs[f], ups[f]);
+				m_dirty[1 + 6 * i + f] = true;
+			}
+		}
+		for (int i = MAX_SHADOW_LIGHTS; i < lights.size(); i++)
+			lights[i].m_shadow = -1;
+	}
+
+	// something changed inside the world box: views that can see it are
+	// drawn again
+	void touch(const glm::vec3 &bmin, const glm::vec3 &bmax)
+	{
+		if (glm::all(glm::lessThanEqual(bmin, m_sunMax)) && glm::all(glm::lessThanEqual(m_sunMin, bmax)))
+			m_dirty[0] = true;
+		for (int i = 0; i < MAX_SHADOW_LIGHTS; i++)
+		{
+			SLightSlot &s = m_lights[i];
+			if (!s.m_used)
+				continue;
+			glm::vec3 d = glm::clamp(s.m_position, bmin, bmax) - s.m_position;
+			if (glm::dot(d, d) > s.m_radius * s.m_radius)
+				continue;
+			for (int f = 0; f < 6; f++)
+				m_dirty[1 + 6 * i + f] = true;
+		}
+	}
+
+	// the view must be drawn; unused light slots never are
+	bool dirty(int v)
+	{
+		return m_dirty[v] && (v == 0 || m_lights[(v - 1) / 6].m_used);
+	}
+
+	const glm::mat4 &viewProjection(int v)
+	{
+		return m_viewProjections[v];
+	}
+
+	// binds the atlas and clears the tile of the view, for drawing it
+	void beginView(int v)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+		glm::ivec4 r = tile(v);
+		glViewport(r.x, r.y, r.z, r.w);
+		glScissor(r.x, r.y, r.z, r.w);
+		glEnable(GL_SCISSOR_TEST);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glDisable(GL_SCISSOR_TEST);
+		m_dirty[v] = false;
+		m_drawn++;
+	}
+
+	// back to the window, of size width x height
+	void end(int width, int height)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, width, height);
+	}
+
+	// the Shadows block for a camera
+	void fill(SShadowBlock &b, const glm::mat4 &view)
+	{
+		glm::mat4 eyeToWorld = glm::inverse(view);
+		b.sunDirection = glm::vec4(glm::mat3(view) * -m_sunDirection, 0.0f);
+		b.sunColor = glm::vec4(m_sunColor, 0.0f);
+		b.sunMatrix = atlasMatrix(0) * eyeToWorld;
+		for (int i = 0; i < MAX_SHADOW_FACES; i++)
+			b.faceMatrices[i] = atlasMatrix(1 + i) * eyeToWorld;
+	}
+
+	GLuint texture()
+	{
+		return m_texture;
+	}
+
+	bool m_ok;
+	int m_drawn;	// views drawn, reset by the caller
+
+private:
+	typedef struct SLightSlot
+	{
+		bool m_used;
+		glm::vec3 m_position;
+		float m_radius;
+
+		SLightSlot()
+		{
+			m_used = false;
+			m_radius = 0.0f;
+		}
+	} SLightSlot;
+
+	// x, y, width, height in the atlas: the sun in the lower left corner,
+	// the faces in the tiles around it
+	glm::ivec4 tile(int v)
+	{
+		if (v == 0)
+			return glm::ivec4(0, 0, SHADOW_SUN_SIZE, SHADOW_SUN_SIZE);
+		const int n = SHADOW_ATLAS_SIZE / SHADOW_FACE_SIZE, sun = SHADOW_SUN_SIZE / SHADOW_FACE_SIZE;
+		int t = v - 1;
+		for (int y = 0; y < n; y++)
+		{
+			int skip = y < sun ? sun : 0;
+			if (t < n - skip)
+				return glm::ivec4((skip + t) * SHADOW_FACE_SIZE, y * SHADOW_FACE_SIZE, SHADOW_FACE_SIZE, SHADOW_FACE_SIZE);
+			t -= n - skip;
+		}
+		return glm::ivec4(0);
+	}
+
+	// world to atlas coordinates and depth, for the shader comparison
+	glm::mat4 atlasMatrix(int v)
+	{
+		glm::vec4 r = glm::vec4(tile(v)) / (float)SHADOW_ATLAS_SIZE;
+		glm::mat4 bias = glm::translate(glm::mat4(1.0f), glm::vec3(r.x + r.z * 0.5f, r.y + r.w * 0.5f, 0.5f));
+		bias = glm::scale(bias, glm::vec3(r.z * 0.5f, r.w * 0.5f, 0.5f));
+		return bias * m_viewProjections[v];
+	}
+
+	GLuint m_fbo, m_texture;
+	glm::vec3 m_sunDirection, m_sunColor, m_sunMin, m_sunMax;
+	vector<SLightSlot> m_lights;
+	vector<glm::mat4> m_viewProjections;
+	vector<bool> m_dirty;
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <utility>
+#include "gl/glew.h"
+#include "glm/glm.hpp"
+
+using namespace std;
+
+// packs 2D textures of the same size, format and mip count into the layers
+// of GL_TEXTURE_2D_ARRAY textures, so draws with different diffuse maps
+// keep one texture bound and pick their layer from the material. The levels
+// are copied on the GPU with glCopyImageSubData (OpenGL 4.3 or
+// ARB_copy_image) into immutable storage. The 2D textures stay: they are
+// the names the materials know their maps by, and what they go back to when
+// packing is off. A group that gets a new texture is packed again into new
+// arrays; a texture without a match stays 2D
+class CTextureArrays
+{
+public:
+	CTextureArrays()
+	{
+		m_ok = false;
+		m_maxLayers = 0;
+	}
+
+	bool create()
+	{
+		m_ok = (GLEW_VERSION_4_3 || GLEW_ARB_copy_image) && (GLEW_VERSION_4_2 || GLEW_ARB_texture_storage);
+		if (m_ok)
+			glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &m_maxLayers);
+		return m_ok;
+	}
+
+	// packs the textures not seen before, which must be complete (loaded,
+	// or given up on); the bindings of the current unit change. Returns the
+	// number of arrays made
+	int pack(const vector<GLuint> &textures)
+	{
+		map<SFormat, bool> grown;
+		for (int i = 0; i < textures.size(); i++)
+		{
+			GLuint t = textures[i];
+			if (!t || m_seen.find(t) != m_seen.end())
+				continue;
+			m_seen[t] = true;
+			SFormat f = format(t);
+			if (!f.m_width || !f.m_height)
+				continue;
+			SGroup &g = m_groups[f];
+			g.m_textures.push_back(t);
+			if (g.m_textures.size() > 1)
+				grown[f] = true;
+		}
+		int arrays = 0;
+		for (map<SFormat, bool>::iterator it = grown.begin(); it != grown.end(); ++it)
+			arrays += build(it->first, m_groups[it->first]);
+		return arrays;
+	}
+
+	// the array holding a texture and its layer, false when it is not packed
+	bool find(GLuint texture, GLuint &array, int &layer)
+	{
+		map<GLuint, pair<GLuint, int> >::iterator it = m_where.find(texture);
+		if (it == m_where.end())
+			return false;
+		array = it->second.first;
+		layer = it->second.second;
+		return true;
+	}
+
+	// deletes the arrays and forgets the textures, to pack them again
+	void clear()
+	{
+		for (map<SFormat, SGroup>::iterator it = m_groups.begin(); it != m_groups.end(); ++it)
+		{
+			if (!it->second.m_arrays.empty())
+				glDeleteTextures((GLsizei)it->second.m_arrays.size(), &it->second.m_arrays[0]);
+		}
+		m_groups.clear();
+		m_seen.clear();
+		m_where.clear();
+	}
+
+	// statistics: arrays, textures packed into them and their bytes
+	void stats(int &arrays, int &layers, size_t &bytes)
+	{
+		arrays = layers = 0;
+		bytes = 0;
+		for (map<SFormat, SGroup>::iterator it = m_groups.begin(); it != m_groups.end(); ++it)
+		{
+			if (it->second.m_arrays.empty())
+				continue;
+			arrays += (int)it->second.m_arrays.size();
+			layers += (int)it->second.m_textures.size();
+			bytes += it->second.m_bytes;
+		}
+	}
+
+	bool m_ok;
+
+private:
+	typedef struct SFormat
+	{
+		GLint m_width, m_height, m_format, m_levels;
+
+		bool operator<(const SFormat &o) const
+		{
+			if (m_width != o.m_width)
+				return m_width < o.m_width;
+			if (m_height != o.m_height)
+				return m_height < o.m_height;
+			if (m_format != o.m_format)
+				return m_format < o.m_format;
+			return m_levels < o.m_levels;
+		}
+	} SFormat;
+
+	typedef struct SGroup
+	{
+		SGroup()
+		{
+			m_bytes = 0;
+		}
+
+		vector<GLuint> m_textures;	// in layer order
+		vector<GLuint> m_arrays;	// m_maxLayers textures each
+		size_t m_bytes;
+	} SGroup;
+
+	// size, internal format and levels defined one after the other
+	static SFormat format(GLuint t)
+	{
+		SFormat f;
+		glBindTexture(GL_TEXTURE_2D, t);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &f.m_width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &f.m_height);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &f.m_format);
+		f.m_levels = 1;
+		while ((f.m_width >> f.m_levels) || (f.m_height >> f.m_levels))
+		{
+			GLint w = 0;
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, f.m_levels, GL_TEXTURE_WIDTH, &w);
+			if (w != glm::max(f.m_width >> f.m_levels, 1))
+				break;
+			f.m_levels++;
+		}
+		// immutable storage wants a sized format
+		switch (f.m_format)
+		{
+		case GL_LUMINANCE: f.m_format = GL_LUMINANCE8; break;
+		case GL_LUMINANCE_ALPHA: f.m_format = GL_LUMINANCE8_ALPHA8; break;
+		case GL_RGB: f.m_format = GL_RGB8; break;
+		case GL_RGBA: f.m_format = GL_RGBA8; break;
+		}
+		return f;
+	}
+
+	// the arrays of a group, made again with all of its textures
+	int build(const SFormat &f, SGroup &g)
+	{
+		if (!g.m_arrays.empty())
+			glDeleteTextures((GLsizei)g.m_arrays.size(), &g.m_arrays[0]);
+		g.m_arrays.clear();
+		g.m_bytes = 0;
+		for (int first = 0; first < g.m_textures.size(); first += m_maxLayers)
+		{
+			int layers = glm::min((int)g.m_textures.size() - first, m_maxLayers);
+			GLuint array;
+			glGenTextures(1, &array);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, array);
+			glTexStorage3D(GL_TEXTURE_2D_ARRAY, f.m_levels, f.m_format, f.m_width, f.m_height, layers);
+			for (int layer = 0; layer < layers; layer++)
+			{
+				GLuint t = g.m_textures[first + layer];
+				for (int level = 0; level < f.m_levels; level++)
+				{
+					int w = glm::max(f.m_width >> level, 1), h = glm::max(f.m_height >> level, 1);
+					glCopyImageSubData(t, GL_TEXTURE_2D, level, 0, 0, 0, array, GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, w, h, 1);
+				}
+				m_where[t] = make_pair(array, layer);
+			}
+			// the sampling the streamer gives the 2D textures
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP);
+			g.m_bytes += layers * layerBytes(f);
+			g.m_arrays.push_back(array);
+		}
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		return (int)g.m_arrays.size();
+	}
+
+	// bytes of one layer, all levels: 4x4 blocks of 8 (DXT1) or 16 bytes
+	// (DXT5), or the bytes of a texel
+	static size_t layerBytes(const SFormat &f)
+	{
+		size_t bytes = 0;
+		for (int level = 0; level < f.m_levels; level++)
+		{
+			size_t w = glm::max(f.m_width >> level, 1), h = glm::max(f.m_height >> level, 1);
+			switch (f.m_format)
+			{
+			case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: bytes += (w + 3) / 4 * ((h + 3) / 4) * 8; break;
+			case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: bytes += (w + 3) / 4 * ((h + 3) / 4) * 16; break;
+			case GL_LUMINANCE8: bytes += w * h; break;
+			case GL_LUMINANCE8_ALPHA8: bytes += w * h * 2; break;
+			case GL_RGB8: bytes += w * h * 3; break;
+			default: bytes += w * h * 4; break;
+			}
+		}
+		return bytes;
+	}
+
+	GLint m_maxLayers;
+	map<GLuint, bool> m_seen;
+	map<SFormat, SGroup> m_groups;
+	map<GLuint, pair<GLuint, int> > m_where;	// texture: array and layer
+};
@@ -0,0 +1,1183 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "gl/glew.h"
+#include "SOIL/SOIL.h"
+#include "SOIL/image_helper.h"
+#include "SOIL/stb_image_aug.h"
+extern "C" {
+#include "SOIL/image_DXT.h"
+}
+#include "glm/glm.hpp"
+
+using namespace std;
+
+// staging pixel buffers the loader threads write the mip chains to; a
+// texture bigger than one goes through client memory
+#define TEXTURE_STAGING_SLOTS 4
+#define TEXTURE_STAGING_BYTES (8 << 20)
+
+// pixel rows at least per thread resampling or compressing a level
+#define TEXTURE_BAND_ROWS 64
+
+// texels across a texture keeps when it is evicted, under a budget
+#define TEXTURE_RESIDENT_SIZE 64
+
+// asynchronous texture loading. request() returns a texture name right
+// away, holding a 1x1 grey placeholder, and queues the file for the loader
+// threads. Each one reads a file, decodes it from memory and prepares what
+// SOIL_load_OGL_texture did on the GL thread (power of two size, mip
+// chain), writing the levels straight into a mapped pixel buffer. update(),
+// on the GL thread once a frame, only allocates the levels and copies them
+// from the buffer with glTexSubImage2D for a few textures, then maps the
+// buffer again (orphaned, so nothing waits) for the next one. The real
+// texture goes into the same name, so the materials, sort keys and batches
+// that kept a name never change. A file that cannot be loaded keeps a
+// magenta placeholder instead of exiting.
+// With S3TC the textures go to the GPU as DXT1 (no alpha) or DXT5, 4 to 8
+// times smaller. The first load of a file compresses its mip chain and
+// writes it next to it as a .dds, later ones read that instead of decoding
+// as long as it is not older than the file. A level is resampled and
+// compressed in bands of rows, on one more thread per loader that has
+// nothing to do.
+// Residency: with a budget (m_budget bytes) a texture only keeps the mip
+// levels its size on screen asks for. The frames touch() the textures they
+// draw; manage() streams finer levels in from the file (the whole chain is
+// read again, only the levels missing are uploaded) and, to make room,
+// evicts the least recently used textures down to TEXTURE_RESIDENT_SIZE.
+// Dropped levels are sized 0 under GL_TEXTURE_BASE_LEVEL, so the driver
+// frees them. Without a budget every texture is kept whole
+class CTextureStreamer
+{
+public:
+	CTextureStreamer()
+	{
+		m_stop = false;
+		m_pending = 0;
+		m_idle = 0;
+		m_loaded = m_missing = m_staged = m_cached = 0;
+		m_decodeMs = m_uploadMs = 0.0;
+		m_textureBytes = 0;
+		m_budget = m_residentBytes = m_wantedBytes = m_incomingBytes = 0;
+		m_evictions = m_streamIns = m_starved = 0;
+		m_frame = 0;
+		m_maxSize = 0;
+		m_cache = true;
+		m_dxt = false;
+	}
+
+	~CTextureStreamer()
+	{
+		stop();
+	}
+
+	// folder: prefix of the requested paths; GL thread
+	void start(const string &folder, int threads)
+	{
+		m_folder = folder;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &m_maxSize);
+		m_dxt = m_cache && GLEW_EXT_texture_compression_s3tc;
+		if (GLEW_VERSION_2_1 || GLEW_ARB_pixel_buffer_object)
+		{
+			m_slots.resize(TEXTURE_STAGING_SLOTS);
+			bool mapped = true;
+			for (int i = 0; i < m_slots.size(); i++)
+			{
+				glGenBuffers(1, &m_slots[i].m_buffer);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_slots[i].m_buffer);
+				remap(m_slots[i]);
+				mapped = mapped && m_slots[i].m_mapped;
+			}
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			if (!mapped)
+				m_slots.clear();
+		}
+		for (int i = 0; i < threads; i++)
+			m_threads.push_back(thread(&CTextureStreamer::loop, this));
+	}
+
+	void stop()
+	{
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		m_slotFreed.notify_all();
+		for (int i = 0; i < m_threads.size(); i++)
+			m_threads[i].join();
+		m_threads.clear();
+		m_decoded.clear();
+	}
+
+	// the texture of a file, loaded once; GL thread only. A new one binds
+	// its placeholder on the current unit
+	GLuint request(const string &path)
+	{
+		map<string, GLuint>::iterator it = m_names.find(path);
+		if (it != m_names.end())
+			return it->second;
+		static const unsigned char grey[4] = { 128, 128, 128, 255 };
+		GLuint name = placeholder(0, grey);
+		m_names[path] = name;
+		m_textures[name].m_path = path;
+		SJob job;
+		job.m_path = path;
+		job.m_name = name;
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_jobs.push_back(move(job));
+		}
+		m_pending++;
+		m_wake.notify_one();
+		return name;
+	}
+
+	// uploads at most maxUploads decoded images, returns how many; the
+	// texture bindings of the current unit change
+	int update(int maxUploads)
+	{
+		int uploads = 0;
+		while (uploads < maxUploads)
+		{
+			SJob job;
+			{
+				lock_guard<mutex> lock(m_mutex);
+				if (m_decoded.empty())
+					break;
+				job = move(m_decoded.front());
+				m_decoded.pop_front();
+			}
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			if (job.m_error.empty())
+			{
+				upload(job);
+				if (job.m_first >= 0)
+					m_streamIns++;
+				else
+				{
+					m_loaded++;
+					m_cached += job.m_fromCache;
+				}
+				m_textureBytes += job.m_bytes;
+			}
+			else if (job.m_first >= 0)
+			{
+				// the levels it has stay
+				STexture &t = m_textures[job.m_name];
+				m_incomingBytes -= t.m_incomingBytes;
+				t.m_incomingBytes = 0;
+				t.m_streaming = false;
+				printf("could not stream %s in: %s\n", job.m_path.c_str(), job.m_error.c_str());
+			}
+			else
+			{
+				static const unsigned char magenta[4] = { 255, 0, 255, 255 };
+				placeholder(job.m_name, magenta);
+				printf("could not load %s: %s\n", job.m_path.c_str(), job.m_error.c_str());
+				m_missing++;
+			}
+			m_uploadMs += chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+			m_pending--;
+			uploads++;
+		}
+		return uploads;
+	}
+
+	// the texture of name is drawn this frame, pixels: how many its whole
+	// width covers on screen (the most of the frame counts); GL thread
+	void touch(GLuint name, float pixels)
+	{
+		map<GLuint, STexture>::iterator it = m_textures.find(name);
+		if (it == m_textures.end())
+			return;
+		STexture &t = it->second;
+		if (t.m_lastUsed != m_frame)
+		{
+			t.m_lastUsed = m_frame;
+			t.m_pixels = pixels;
+		}
+		else
+			t.m_pixels = glm::max(t.m_pixels, pixels);
+	}
+
+	// once a frame on the GL thread, before the textures are used, with the
+	// touches of the last frame. The textures drawn that want finer levels
+	// get them streamed in, the biggest on screen first, as far as the
+	// budget allows after evicting the least recently used ones. Then, while
+	// over the budget (it was lowered), the least recently used textures and
+	// then the finest levels of the biggest ones drawn go. Without a budget
+	// every texture not whole is streamed in again. True when it bound
+	// textures (on the current unit)
+	bool manage()
+	{
+		int evictions = m_evictions;
+		vector<pair<float, GLuint> > finer;
+		m_wantedBytes = 0;
+		for (map<GLuint, STexture>::iterator it = m_textures.begin(); it != m_textures.end(); ++it)
+		{
+			STexture &t = it->second;
+			if (!t.m_levels)
+				continue;
+			int level = wanted(t);
+			m_wantedBytes += residentBytes(t, level);
+			if (level < t.m_base && !t.m_streaming)
+				finer.push_back(make_pair(t.m_lastUsed == m_frame ? -t.m_pixels : 0.0f, it->first));
+		}
+		sort(finer.begin(), finer.end());
+		for (int i = 0; i < finer.size(); i++)
+		{
+			STexture &t = m_textures[finer[i].second];
+			int level = wanted(t);
+			while (m_budget && level < t.m_base && !makeRoom(residentBytes(t, level) - t.m_bytes))
+				level++;
+			if (level < t.m_base)
+				streamIn(finer[i].second, t, level);
+		}
+		while (m_budget && m_residentBytes > m_budget)
+		{
+			GLuint name = leastRecentlyUsed();
+			if (name)
+			{
+				evict(name, m_textures[name], residentLevel(m_textures[name]));
+				continue;
+			}
+			// everything left was drawn last frame: the biggest loses a level
+			size_t most = 0;
+			for (map<GLuint, STexture>::iterator it = m_textures.begin(); it != m_textures.end(); ++it)
+			{
+				if (it->second.m_levels && it->second.m_base < residentLevel(it->second) && it->second.m_bytes > most)
+				{
+					most = it->second.m_bytes;
+					name = it->first;
+				}
+			}
+			if (!name)
+				break;
+			evict(name, m_textures[name], m_textures[name].m_base + 1);
+		}
+		m_starved = 0;
+		for (map<GLuint, STexture>::iterator it = m_textures.begin(); it != m_textures.end(); ++it)
+		{
+			if (it->second.m_levels && !it->second.m_streaming && it->second.m_base > wanted(it->second))
+				m_starved++;
+		}
+		m_frame++;
+		return m_evictions != evictions;
+	}
+
+	// bytes the textures keep on the GPU now
+	size_t residentBytes()
+	{
+		return m_residentBytes;
+	}
+
+	// the bytes they want for the last frame (the levels it asks for, the
+	// textures not drawn at TEXTURE_RESIDENT_SIZE) over the budget: above 1
+	// the budget cannot hold them all
+	double pressure()
+	{
+		return m_budget ? (double)m_wantedBytes / m_budget : 0.0;
+	}
+
+	// requested, not uploaded yet
+	int pending()
+	{
+		return m_pending;
+	}
+
+	// files requested so far
+	int size()
+	{
+		return (int)m_names.size();
+	}
+
+	// their textures; GL thread only
+	void textures(vector<GLuint> &names)
+	{
+		names.clear();
+		for (map<string, GLuint>::iterator it = m_names.begin(); it != m_names.end(); ++it)
+			names.push_back(it->second);
+	}
+
+	int threads()
+	{
+		return (int)m_threads.size();
+	}
+
+	// summed over the loader threads
+	double decodeMs()
+	{
+		lock_guard<mutex> lock(m_mutex);
+		return m_decodeMs;
+	}
+
+	// reads, decodes and prepares every file on threads threads of its own,
+	// without uploading, and returns the milliseconds taken. fileBytes and
+	// levelBytes: read, and prepared
+	double benchmark(const vector<string> &paths, int threads, size_t &fileBytes, size_t &levelBytes)
+	{
+		vector<SJob> jobs(paths.size());
+		for (int i = 0; i < jobs.size(); i++)
+			jobs[i].m_path = paths[i];
+		atomic<int> next(0);
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		vector<thread> workers;
+		for (int t = 0; t < threads; t++)
+		{
+			workers.push_back(thread([&] {
+				int i;
+				while ((i = next++) < (int)jobs.size())
+					decode(jobs[i], false);
+			}));
+		}
+		for (int t = 0; t < threads; t++)
+			workers[t].join();
+		double ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+		fileBytes = levelBytes = 0;
+		for (int i = 0; i < jobs.size(); i++)
+		{
+			fileBytes += jobs[i].m_fileBytes;
+			levelBytes += jobs[i].m_bytes;
+		}
+		return ms;
+	}
+
+	typedef struct SCompressBenchmark
+	{
+		int m_width, m_height, m_channels;	// of level 0
+		double m_megapixels;	// of the mip chain
+		double m_referenceMs;	// the plain C block encoders, one thread
+		double m_simdMs;	// the SIMD ones, in bands on the threads
+		double m_referencePsnr, m_simdPsnr;	// dB, against the levels
+		bool m_same;		// the same blocks
+	} SCompressBenchmark;
+
+	// compresses the mip chain of a file to DXT as the loaders do, with the
+	// plain C block encoders and then with the SIMD ones on threads threads;
+	// false when the file cannot be loaded
+	bool compressBenchmark(const string &path, int threads, SCompressBenchmark &result)
+	{
+		SJob job;
+		job.m_path = path;
+		vector<unsigned char> levels;
+		if (!decodeImage(job, levels))
+			return false;
+		SJob dxt = job;
+		dxt.m_compressed = (job.m_channels & 1) ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		vector<unsigned char> reference(chainBytes(dxt)), simd(reference.size());
+		result.m_width = job.m_width;
+		result.m_height = job.m_height;
+		result.m_channels = job.m_channels;
+		result.m_megapixels = 0.0;
+		result.m_referenceMs = result.m_simdMs = 0.0;
+		double referenceError = 0.0, simdError = 0.0, samples = 0.0;
+		size_t offset = 0, blocks = 0;
+		for (int level = 0, n = levelCount(job.m_width, job.m_height); level < n; level++)
+		{
+			int w = glm::max(job.m_width >> level, 1), h = glm::max(job.m_height >> level, 1);
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			compressLevel(&levels[offset], w, h, job.m_channels, &reference[blocks], 1, true);
+			chrono::high_resolution_clock::time_point middle = chrono::high_resolution_clock::now();
+			compressLevel(&levels[offset], w, h, job.m_channels, &simd[blocks], threads, false);
+			chrono::high_resolution_clock::time_point end = chrono::high_resolution_clock::now();
+			result.m_referenceMs += chrono::duration<double, milli>(middle - start).count();
+			result.m_simdMs += chrono::duration<double, milli>(end - middle).count();
+			result.m_megapixels += w * h / 1000000.0;
+			referenceError += squaredError(&levels[offset], w, h, job.m_channels, &reference[blocks]);
+			simdError += squaredError(&levels[offset], w, h, job.m_channels, &simd[blocks]);
+			samples += (double)w * h * job.m_channels;
+			offset += levelBytes(job, level);
+			blocks += levelBytes(dxt, level);
+		}
+		result.m_referencePsnr = psnr(referenceError / samples);
+		result.m_simdPsnr = psnr(simdError / samples);
+		result.m_same = reference == simd;
+		return true;
+	}
+
+	typedef struct SDecodeBenchmark
+	{
+		int m_width, m_height, m_channels;
+		double m_megabytes;	// decoded
+		double m_referenceMs;	// the plain zlib inflate and unfiltering
+		double m_fastMs;	// the fast ones
+		bool m_same;		// the same pixels
+	} SDecodeBenchmark;
+
+	// decodes a PNG file with the plain zlib inflate and unfiltering loops
+	// and then with the fast ones, the best of runs runs each; false when
+	// the file is not a PNG that can be decoded
+	bool decodeBenchmark(const string &path, int runs, SDecodeBenchmark &result)
+	{
+		vector<unsigned char> file;
+		if (!readFile(m_folder + path, file) || !stbi_png_test_memory(&file[0], (int)file.size()))
+			return false;
+		typedef chrono::high_resolution_clock clock;
+		unsigned char *pixels[2] = { NULL, NULL };
+		double ms[2] = { 0.0, 0.0 };
+		int w = 0, h = 0, c = 0;
+		for (int r = 0; r < runs; r++)
+		{
+			for (int fast = 0; fast < 2; fast++)
+			{
+				free(pixels[fast]);
+				clock::time_point start = clock::now();
+				pixels[fast] = stbi_png_load_from_memory_ex(&file[0], (int)file.size(), &w, &h, &c, 0, !fast);
+				double t = chrono::duration<double, milli>(clock::now() - start).count();
+				if (!r || t < ms[fast])
+					ms[fast] = t;
+			}
+		}
+		result.m_width = w;
+		result.m_height = h;
+		result.m_channels = c;
+		result.m_megabytes = w * h * c / 1000000.0;
+		result.m_referenceMs = ms[0];
+		result.m_fastMs = ms[1];
+		bool ok = pixels[0] && pixels[1];
+		result.m_same = ok && !memcmp(pixels[0], pixels[1], w * h * c);
+		free(pixels[0]);
+		free(pixels[1]);
+		return ok;
+	}
+
+	typedef struct SResampleBenchmark
+	{
+		int m_width, m_height, m_channels;	// of the file
+		double m_upMegapixels;	// made by the upscale, to the next power of two up
+		double m_upReferenceMs, m_upSimdMs;
+		double m_mipMegapixels;	// of level 0
+		double m_mipReferenceMs, m_mipSimdMs;	// for the mip chain
+		double m_ntscReferenceMs, m_ntscSimdMs;	// on level 0
+		bool m_same;		// the same bytes, all three
+	} SResampleBenchmark;
+
+	// the CPU resampling of a file the way the loaders and SOIL do it, with
+	// the plain C loops on one thread and then the SIMD ones in bands on
+	// threads threads; false when the file cannot be loaded
+	bool resampleBenchmark(const string &path, int threads, SResampleBenchmark &result)
+	{
+		vector<unsigned char> file;
+		int w, h, c;
+		if (!readFile(m_folder + path, file))
+			return false;
+		unsigned char *pixels = SOIL_load_image_from_memory(&file[0], (int)file.size(), &w, &h, &c, SOIL_LOAD_AUTO);
+		if (!pixels)
+			return false;
+		result.m_width = w;
+		result.m_height = h;
+		result.m_channels = c;
+		result.m_same = true;
+		typedef chrono::high_resolution_clock clock;
+
+		// the upscale, as baseLevel does it
+		int pw = 2, ph = 2;
+		while (pw <= w)
+			pw *= 2;
+		while (ph <= h)
+			ph *= 2;
+		vector<unsigned char> reference(pw * ph * c), simd(reference.size());
+		clock::time_point start = clock::now();
+		up_scale_image_rows(pixels, w, h, c, &reference[0], pw, ph, 0, ph, 1);
+		clock::time_point middle = clock::now();
+		bands(ph, threads, TEXTURE_BAND_ROWS, [&](int first, int rows) {
+			up_scale_image_rows(pixels, w, h, c, &simd[0], pw, ph, first, rows, 0);
+		});
+		clock::time_point end = clock::now();
+		result.m_upMegapixels = pw * ph / 1000000.0;
+		result.m_upReferenceMs = chrono::duration<double, milli>(middle - start).count();
+		result.m_upSimdMs = chrono::duration<double, milli>(end - middle).count();
+		result.m_same = result.m_same && reference == simd;
+
+		// the mip chain of the image, or of its upscale
+		SJob job;
+		job.m_width = w;
+		job.m_height = h;
+		job.m_channels = c;
+		vector<unsigned char> base(pixels, pixels + w * h * c);
+		SOIL_free_image_data(pixels);
+		if ((w & (w - 1)) || (h & (h - 1)))
+		{
+			base.swap(reference);
+			job.m_width = pw;
+			job.m_height = ph;
+		}
+		reference.assign(chainBytes(job), 0);
+		simd.assign(reference.size(), 0);
+		start = clock::now();
+		mipChain(job, &base[0], &reference[0], 1, true);
+		middle = clock::now();
+		mipChain(job, &base[0], &simd[0], threads, false);
+		end = clock::now();
+		result.m_mipMegapixels = job.m_width * job.m_height / 1000000.0;
+		result.m_mipReferenceMs = chrono::duration<double, milli>(middle - start).count();
+		result.m_mipSimdMs = chrono::duration<double, milli>(end - middle).count();
+		result.m_same = result.m_same && reference == simd;
+
+		// the NTSC safe colours of level 0
+		reference.assign(base.begin(), base.end());
+		simd.assign(base.begin(), base.end());
+		start = clock::now();
+		scale_image_RGB_to_NTSC_safe_rows(&reference[0], job.m_width, job.m_height, c, 0, job.m_height, 1);
+		middle = clock::now();
+		bands(job.m_height, threads, TEXTURE_BAND_ROWS, [&](int first, int rows) {
+			scale_image_RGB_to_NTSC_safe_rows(&simd[0], job.m_width, job.m_height, c, first, rows, 0);
+		});
+		end = clock::now();
+		result.m_ntscReferenceMs = chrono::duration<double, milli>(middle - start).count();
+		result.m_ntscSimdMs = chrono::duration<double, milli>(end - middle).count();
+		result.m_same = result.m_same && reference == simd;
+		return true;
+	}
+
+	// DXT textures and the DDS cache, set before start() (used with S3TC only)
+	bool m_cache;
+
+	int m_loaded, m_missing;
+	int m_staged;		// of m_loaded, through a pixel buffer
+	int m_cached;		// of m_loaded, from the DDS cache
+	size_t m_textureBytes;	// of the levels uploaded
+	double m_uploadMs;
+	size_t m_budget;	// bytes of GPU memory for the textures, 0: none
+	int m_evictions;	// levels dropped to make room
+	int m_streamIns;	// finer levels streamed in
+	int m_starved;		// textures held coarser than their size on screen asks, last frame
+
+private:
+	typedef struct SJob
+	{
+		SJob()
+		{
+			m_name = 0;
+			m_width = m_height = m_channels = 0;
+			m_compressed = 0;
+			m_fromCache = false;
+			m_first = -1;
+			m_slot = -1;
+			m_bytes = m_fileBytes = 0;
+		}
+
+		string m_path;
+		GLuint m_name;
+		int m_width, m_height, m_channels;	// of level 0
+		GLenum m_compressed;	// DXT format of the levels, 0 if they are not
+		bool m_fromCache;
+		int m_first;		// streaming finer levels in: the finest to upload; -1 for a load
+		int m_slot;		// staging buffer holding the levels, -1: m_pixels does
+		vector<unsigned char> m_pixels;	// the levels one after the other
+		size_t m_bytes;		// of the levels
+		size_t m_fileBytes;
+		string m_error;		// the load failed
+	} SJob;
+
+	// residency of a texture, by name
+	typedef struct STexture
+	{
+		STexture()
+		{
+			m_width = m_height = m_channels = 0;
+			m_compressed = 0;
+			m_levels = m_base = 0;
+			m_bytes = m_incomingBytes = 0;
+			m_lastUsed = ~0u;
+			m_pixels = 0.0f;
+			m_streaming = false;
+		}
+
+		string m_path;
+		int m_width, m_height, m_channels;	// of level 0, as in its job
+		GLenum m_compressed;
+		int m_levels;		// 0 until it is loaded
+		int m_base;		// finest level on the GPU
+		size_t m_bytes;		// of the levels on the GPU
+		size_t m_incomingBytes;	// more while finer levels stream in
+		unsigned int m_lastUsed;	// frame
+		float m_pixels;		// see touch(), in that frame
+		bool m_streaming;
+	} STexture;
+
+	// bytes of the levels of a texture from base on
+	static size_t residentBytes(const STexture &t, int base)
+	{
+		SJob job;
+		job.m_width = t.m_width;
+		job.m_height = t.m_height;
+		job.m_channels = t.m_channels;
+		job.m_compressed = t.m_compressed;
+		size_t bytes = 0;
+		for (int level = base; level < t.m_levels; level++)
+			bytes += levelBytes(job, level);
+		return bytes;
+	}
+
+	// the coarsest level kept, at most TEXTURE_RESIDENT_SIZE texels across
+	static int residentLevel(const STexture &t)
+	{
+		int level = 0;
+		while (level < t.m_levels - 1 && (glm::max(t.m_width, t.m_height) >> level) > TEXTURE_RESIDENT_SIZE)
+			level++;
+		return level;
+	}
+
+	// the finest level a texture needs: all of them without a budget, else
+	// the coarsest with at least a texel per pixel on screen in the last
+	// frame, and residentLevel when it was not drawn
+	int wanted(const STexture &t)
+	{
+		if (!m_budget)
+			return 0;
+		int coarsest = residentLevel(t);
+		if (t.m_lastUsed != m_frame)
+			return coarsest;
+		int size = glm::max(t.m_width, t.m_height), level = 0;
+		while (level < coarsest && (size >> (level + 1)) >= t.m_pixels)
+			level++;
+		return level;
+	}
+
+	// the texture not drawn last frame that was drawn the longest ago, with
+	// levels to drop; 0 if there is none
+	GLuint leastRecentlyUsed()
+	{
+		GLuint name = 0;
+		unsigned int oldest = 0;
+		for (map<GLuint, STexture>::iterator it = m_textures.begin(); it != m_textures.end(); ++it)
+		{
+			const STexture &t = it->second;
+			if (!t.m_levels || t.m_streaming || t.m_lastUsed == m_frame || t.m_base >= residentLevel(t))
+				continue;
+			// never drawn (~0u) comes out older than any
+			unsigned int age = m_frame - t.m_lastUsed;
+			if (!name || age > oldest)
+			{
+				name = it->first;
+				oldest = age;
+			}
+		}
+		return name;
+	}
+
+	// evicts least recently used textures until bytes more fit in the
+	// budget, false if they do not
+	bool makeRoom(size_t bytes)
+	{
+		while (m_residentBytes + m_incomingBytes + bytes > m_budget)
+		{
+			GLuint name = leastRecentlyUsed();
+			if (!name)
+				return false;
+			evict(name, m_textures[name], residentLevel(m_textures[name]));
+		}
+		return true;
+	}
+
+	// drops the levels of a texture finer than base
+	void evict(GLuint name, STexture &t, int base)
+	{
+		glBindTexture(GL_TEXTURE_2D, name);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, base);
+		for (int level = t.m_base; level < base; level++)
+			glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		m_evictions += base - t.m_base;
+		m_residentBytes -= t.m_bytes;
+		t.m_bytes = residentBytes(t, base);
+		t.m_base = base;
+		m_residentBytes += t.m_bytes;
+	}
+
+	// queues the file of a texture again for its levels from first on
+	void streamIn(GLuint name, STexture &t, int first)
+	{
+		t.m_streaming = true;
+		t.m_incomingBytes = residentBytes(t, first) - t.m_bytes;
+		m_incomingBytes += t.m_incomingBytes;
+		SJob job;
+		job.m_path = t.m_path;
+		job.m_name = name;
+		job.m_first = first;
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_jobs.push_back(move(job));
+		}
+		m_pending++;
+		m_wake.notify_one();
+	}
+
+	typedef struct SSlot
+	{
+		GLuint m_buffer;
+		unsigned char *m_mapped;
+		bool m_free;
+	} SSlot;
+
+	// fresh storage for a bound staging buffer, mapped for the loaders
+	void remap(SSlot &slot)
+	{
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, TEXTURE_STAGING_BYTES, NULL, GL_STREAM_DRAW);
+		slot.m_mapped = (unsigned char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+		slot.m_free = slot.m_mapped != NULL;
+	}
+
+	static int levelCount(int w, int h)
+	{
+		int n = 1;
+		while ((1 << n) <= w || (1 << n) <= h)
+			n++;
+		return n;
+	}
+
+	// bytes of a level of a job, 4x4 blocks of 8 (DXT1) or 16 bytes (DXT5)
+	// when compressed
+	static size_t levelBytes(const SJob &job, int level)
+	{
+		int w = glm::max(job.m_width >> level, 1), h = glm::max(job.m_height >> level, 1);
+		if (job.m_compressed)
+			return (size_t)((w + 3) / 4) * ((h + 3) / 4) * (job.m_compressed == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16);
+		return (size_t)w * h * job.m_channels;
+	}
+
+	static size_t chainBytes(const SJob &job)
+	{
+		size_t bytes = 0;
+		for (int level = 0, n = levelCount(job.m_width, job.m_height); level < n; level++)
+			bytes += levelBytes(job, level);
+		return bytes;
+	}
+
+	static bool readFile(const string &path, vector<unsigned char> &data)
+	{
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f)
+			return false;
+		fseek(f, 0, SEEK_END);
+		long size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		data.resize(size > 0 ? size : 0);
+		bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+		fclose(f);
+		return ok;
+	}
+
+	static unsigned int fourCC(char a, char b, char c, char d)
+	{
+		return (unsigned char)a | ((unsigned char)b << 8) | ((unsigned char)c << 16) | ((unsigned int)(unsigned char)d << 24);
+	}
+
+	// the DDS of a texture file, next to it: bed_d.png -> bed_d.png.dds
+	static string cachePath(const string &path)
+	{
+		return path + ".dds";
+	}
+
+	// reads the file of a job and writes its levels to a staging buffer or
+	// to m_pixels. loading: a job of the loader threads, staged and cached;
+	// else one of benchmark()
+	void decode(SJob &job, bool loading)
+	{
+		vector<unsigned char> levels;
+		if (m_dxt && readCache(job, levels))
+			job.m_fromCache = true;
+		else
+		{
+			if (!decodeImage(job, levels))
+				return;
+			if (m_dxt)
+				compress(job, levels, loading);
+		}
+		job.m_bytes = levels.size();
+		unsigned char *dst = loading ? stage(job) : NULL;
+		if (dst)
+			memcpy(dst, &levels[0], levels.size());
+		else
+			job.m_pixels.swap(levels);
+	}
+
+	// the uncompressed mip chain of a texture file
+	bool decodeImage(SJob &job, vector<unsigned char> &levels)
+	{
+		vector<unsigned char> file;
+		if (!readFile(m_folder + job.m_path, file))
+		{
+			job.m_error = "Unable to open file";
+			return false;
+		}
+		job.m_fileBytes = file.size();
+		unsigned char *pixels = SOIL_load_image_from_memory(&file[0], (int)file.size(), &job.m_width, &job.m_height, &job.m_channels, SOIL_LOAD_AUTO);
+		if (!pixels)
+		{
+			// SOIL_last_result() is shared by the loader threads; stb_image
+			// keeps the reason per thread
+			const char *reason = stbi_failure_reason();
+			job.m_error = reason ? reason : "Unable to decode image";
+			return false;
+		}
+		vector<unsigned char> base;
+		baseLevel(job, pixels, base);
+		SOIL_free_image_data(pixels);
+		levels.resize(chainBytes(job));
+		mipChain(job, &base[0], &levels[0], 1 + m_idle, false);
+		return true;
+	}
+
+	// what SOIL_create_OGL_texture did with SOIL_FLAG_MIPMAPS: level n is
+	// 2^n x 2^n blocks of level 0, in bands on threads threads. reference:
+	// with the plain C loops, which give the same bytes
+	static void mipChain(const SJob &job, const unsigned char *base, unsigned char *levels, int threads, bool reference)
+	{
+		memcpy(levels, base, levelBytes(job, 0));
+		size_t offset = levelBytes(job, 0);
+		for (int level = 1, n = levelCount(job.m_width, job.m_height); level < n; level++)
+		{
+			unsigned char *dst = levels + offset;
+			bands(glm::max(job.m_height >> level, 1), threads, glm::max(TEXTURE_BAND_ROWS >> level, 1), [&](int first, int rows) {
+				mipmap_image_rows(base, job.m_width, job.m_height, job.m_channels, dst, 1 << level, 1 << level, first, rows, reference);
+			});
+			offset += levelBytes(job, level);
+		}
+	}
+
+	// level 0 as SOIL_create_OGL_texture made it with SOIL_FLAG_POWER_OF_TWO:
+	// up to a power of two, then down to the size limit
+	void baseLevel(SJob &job, const unsigned char *pixels, vector<unsigned char> &base)
+	{
+		int w = job.m_width, h = job.m_height, c = job.m_channels, threads = 1 + m_idle;
+		int pw = 1, ph = 1;
+		while (pw < w)
+			pw *= 2;
+		while (ph < h)
+			ph *= 2;
+		base.assign(pixels, pixels + w * h * c);
+		if (pw != w || ph != h)
+		{
+			vector<unsigned char> up(pw * ph * c);
+			bands(ph, threads, TEXTURE_BAND_ROWS, [&](int first, int rows) {
+				up_scale_image_rows(&base[0], w, h, c, &up[0], pw, ph, first, rows, 0);
+			});
+			base.swap(up);
+			w = pw;
+			h = ph;
+		}
+		if (w > m_maxSize || h > m_maxSize)
+		{
+			int bx = w > m_maxSize ? w / m_maxSize : 1, by = h > m_maxSize ? h / m_maxSize : 1;
+			vector<unsigned char> down((w / bx) * (h / by) * c);
+			bands(h / by, threads, glm::max(TEXTURE_BAND_ROWS / by, 1), [&](int first, int rows) {
+				mipmap_image_rows(&base[0], w, h, c, &down[0], bx, by, first, rows, 0);
+			});
+			base.swap(down);
+			w /= bx;
+			h /= by;
+		}
+		job.m_width = w;
+		job.m_height = h;
+	}
+
+	// the levels to DXT1 (odd channel counts, no alpha) or DXT5, the way
+	// SOIL_FLAG_COMPRESS_TO_DXT did, in bands while loaders are idle; write:
+	// into the cache too
+	void compress(SJob &job, vector<unsigned char> &levels, bool write)
+	{
+		SJob dxt = job;
+		dxt.m_compressed = (job.m_channels & 1) ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		vector<unsigned char> blocks(chainBytes(dxt));
+		size_t offset = 0, compressed = 0;
+		for (int level = 0, n = levelCount(job.m_width, job.m_height); level < n; level++)
+		{
+			int w = glm::max(job.m_width >> level, 1), h = glm::max(job.m_height >> level, 1);
+			compressLevel(&levels[offset], w, h, job.m_channels, &blocks[compressed], 1 + m_idle, false);
+			offset += levelBytes(job, level);
+			compressed += levelBytes(dxt, level);
+		}
+		job.m_compressed = dxt.m_compressed;
+		levels.swap(blocks);
+		if (write)
+			writeCache(job, levels);
+	}
+
+	// f(first, rows) over rows rows in bands of at least band rows, on
+	// threads threads, this one included
+	static void bands(int rows, int threads, int band, const function<void(int, int)> &f)
+	{
+		threads = glm::clamp(rows / band, 1, threads);
+		vector<thread> others;
+		for (int t = 1; t < threads; t++)
+		{
+			int first = rows * t / threads, last = rows * (t + 1) / threads;
+			others.push_back(thread(f, first, last - first));
+		}
+		f(0, rows / threads);
+		for (int t = 0; t < others.size(); t++)
+			others[t].join();
+	}
+
+	// one level to DXT1 (odd channel counts) or DXT5, in bands of block rows
+	// on threads threads. reference: with the plain C block encoders, which
+	// give the same blocks
+	static void compressLevel(const unsigned char *pixels, int w, int h, int channels, unsigned char *blocks, int threads, bool reference)
+	{
+		void (*convert)(const unsigned char *, int, int, int, int, int, int, unsigned char *) =
+			(channels & 1) ? convert_image_to_DXT1_rows : convert_image_to_DXT5_rows;
+		bands((h + 3) / 4, threads, TEXTURE_BAND_ROWS / 4, [&](int first, int rows) {
+			convert(pixels, w, h, channels, first, rows, reference, blocks);
+		});
+	}
+
+	// the summed squared error of a DXT level against the pixels it was
+	// made of, over their channels
+	static double squaredError(const unsigned char *pixels, int w, int h, int channels, const unsigned char *blocks)
+	{
+		vector<unsigned char> rgba(w * h * 4);
+		convert_DXT_to_RGBA(blocks, w, h, !(channels & 1), &rgba[0]);
+		double sum = 0.0;
+		for (int i = 0; i < w * h; i++)
+		{
+			for (int c = 0; c < channels; c++)
+			{
+				// grey is in red, grey + alpha in red and alpha
+				int d = pixels[i * channels + c] - rgba[i * 4 + (channels == 2 && c == 1 ? 3 : c)];
+				sum += d * d;
+			}
+		}
+		return sum;
+	}
+
+	static double psnr(double meanSquaredError)
+	{
+		return meanSquaredError > 0.0 ? 10.0 * log10(255.0 * 255.0 / meanSquaredError) : 99.0;
+	}
+
+	// the DXT levels of a job from its DDS, when that is there, not older
+	// than the file and a full DXT1 or DXT5 chain
+	bool readCache(SJob &job, vector<unsigned char> &levels)
+	{
+		string path = m_folder + job.m_path, dds = cachePath(path);
+		struct stat source, cache;
+		if (stat(dds.c_str(), &cache) != 0)
+			return false;
+		if (stat(path.c_str(), &source) == 0 && source.st_mtime > cache.st_mtime)
+			return false;
+		vector<unsigned char> file;
+		if (!readFile(dds, file) || file.size() < sizeof(DDS_header))
+			return false;
+		DDS_header header;
+		memcpy(&header, &file[0], sizeof(header));
+		if (header.dwMagic != fourCC('D', 'D', 'S', ' ') || !(header.sPixelFormat.dwFlags & DDPF_FOURCC))
+			return false;
+		SJob dxt = job;
+		if (header.sPixelFormat.dwFourCC == fourCC('D', 'X', 'T', '1'))
+			dxt.m_compressed = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		else if (header.sPixelFormat.dwFourCC == fourCC('D', 'X', 'T', '5'))
+			dxt.m_compressed = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		else
+			return false;
+		dxt.m_width = header.dwWidth;
+		dxt.m_height = header.dwHeight;
+		if (dxt.m_width < 1 || dxt.m_height < 1 || dxt.m_width > m_maxSize || dxt.m_height > m_maxSize ||
+			header.dwMipMapCount != levelCount(dxt.m_width, dxt.m_height) || file.size() != sizeof(DDS_header) + chainBytes(dxt))
+			return false;
+		job.m_width = dxt.m_width;
+		job.m_height = dxt.m_height;
+		job.m_compressed = dxt.m_compressed;
+		job.m_fileBytes = file.size();
+		levels.assign(file.begin() + sizeof(DDS_header), file.end());
+		return true;
+	}
+
+	// a DDS with the DXT levels of a job; written to a temporary file and
+	// renamed, so a load never sees half of one
+	void writeCache(const SJob &job, const vector<unsigned char> &levels)
+	{
+		DDS_header header;
+		memset(&header, 0, sizeof(header));
+		header.dwMagic = fourCC('D', 'D', 'S', ' ');
+		header.dwSize = 124;
+		header.dwFlags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_LINEARSIZE | DDSD_MIPMAPCOUNT;
+		header.dwWidth = job.m_width;
+		header.dwHeight = job.m_height;
+		header.dwPitchOrLinearSize = (unsigned int)levelBytes(job, 0);
+		header.dwMipMapCount = levelCount(job.m_width, job.m_height);
+		header.sPixelFormat.dwSize = 32;
+		header.sPixelFormat.dwFlags = DDPF_FOURCC;
+		header.sPixelFormat.dwFourCC = job.m_compressed == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? fourCC('D', 'X', 'T', '1') : fourCC('D', 'X', 'T', '5');
+		header.sCaps.dwCaps1 = DDSCAPS_TEXTURE | DDSCAPS_COMPLEX | DDSCAPS_MIPMAP;
+		string dds = cachePath(m_folder + job.m_path), temporary = dds + ".tmp";
+		FILE *f = fopen(temporary.c_str(), "wb");
+		if (!f)
+			return;
+		bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(&levels[0], 1, levels.size(), f) == levels.size();
+		ok = fclose(f) == 0 && ok;
+		remove(dds.c_str());
+		if (!ok || rename(temporary.c_str(), dds.c_str()) != 0)
+			remove(temporary.c_str());
+	}
+
+	// a staging buffer for the levels of a job, waiting for the GL thread to
+	// hand one back; NULL when there are none, they are too small or the
+	// loaders stop
+	unsigned char *stage(SJob &job)
+	{
+		if (m_slots.empty() || job.m_bytes > TEXTURE_STAGING_BYTES)
+			return NULL;
+		unique_lock<mutex> lock(m_mutex);
+		int slot = -1;
+		m_slotFreed.wait(lock, [&] { return m_stop || (slot = freeSlot()) >= 0; });
+		if (m_stop)
+			return NULL;
+		m_slots[slot].m_free = false;
+		job.m_slot = slot;
+		return m_slots[slot].m_mapped;
+	}
+
+	int freeSlot()
+	{
+		for (int i = 0; i < m_slots.size(); i++)
+		{
+			if (m_slots[i].m_free)
+				return i;
+		}
+		return -1;
+	}
+
+	// copies the levels from the staging buffer or from m_pixels, with the
+	// sampling SOIL set. DXT levels are allocated and copied at once,
+	// uncompressed ones allocated first and copied with glTexSubImage2D.
+	// Only the levels from the base level on go up: the one the job streams
+	// in, or for a load the one the texture wants now
+	void upload(const SJob &job)
+	{
+		static const GLenum formats[5] = { 0, GL_LUMINANCE, GL_LUMINANCE_ALPHA, GL_RGB, GL_RGBA };
+		GLenum format = formats[job.m_channels];
+		int w = job.m_width, h = job.m_height, n = levelCount(w, h);
+		STexture &t = m_textures[job.m_name];
+		t.m_width = w;
+		t.m_height = h;
+		t.m_channels = job.m_channels;
+		t.m_compressed = job.m_compressed;
+		t.m_levels = n;
+		int first = glm::min(job.m_first >= 0 ? job.m_first : wanted(t), n - 1);
+		glBindTexture(GL_TEXTURE_2D, job.m_name);
+		if (!job.m_compressed)
+		{
+			for (int level = first; level < n; level++)
+				glTexImage2D(GL_TEXTURE_2D, level, format, glm::max(w >> level, 1), glm::max(h >> level, 1), 0, format, GL_UNSIGNED_BYTE, NULL);
+		}
+
+		// with a pixel buffer bound the pointers are offsets into it
+		const unsigned char *origin = NULL;
+		if (job.m_slot >= 0)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_slots[job.m_slot].m_buffer);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		else
+			origin = &job.m_pixels[0];
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		size_t offset = 0;
+		for (int level = 0; level < n; level++)
+		{
+			int lw = glm::max(w >> level, 1), lh = glm::max(h >> level, 1);
+			GLsizei size = (GLsizei)levelBytes(job, level);
+			if (level >= first && job.m_compressed)
+				glCompressedTexImage2D(GL_TEXTURE_2D, level, job.m_compressed, lw, lh, 0, size, origin + offset);
+			else if (level >= first)
+				glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, lw, lh, format, GL_UNSIGNED_BYTE, origin + offset);
+			offset += size;
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, first);
+		m_residentBytes -= t.m_bytes;
+		m_incomingBytes -= t.m_incomingBytes;
+		t.m_bytes = residentBytes(t, first);
+		t.m_incomingBytes = 0;
+		t.m_base = first;
+		t.m_streaming = false;
+		m_residentBytes += t.m_bytes;
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+		if (job.m_slot < 0)
+			return;
+
+		// the copies read the old storage, the loaders get new
+		SSlot &slot = m_slots[job.m_slot];
+		{
+			lock_guard<mutex> lock(m_mutex);
+			remap(slot);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		m_slotFreed.notify_one();
+		m_staged++;
+	}
+
+	// a 1x1 texture, in name or a new one
+	GLuint placeholder(GLuint name, const unsigned char rgba[4])
+	{
+		if (!name)
+			glGenTextures(1, &name);
+		glBindTexture(GL_TEXTURE_2D, name);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		return name;
+	}
+
+	void loop()
+	{
+		for (;;)
+		{
+			SJob job;
+			{
+				unique_lock<mutex> lock(m_mutex);
+				m_idle++;
+				m_wake.wait(lock, [&] { return m_stop || !m_jobs.empty(); });
+				m_idle--;
+				if (m_stop)
+					return;
+				job = move(m_jobs.front());
+				m_jobs.pop_front();
+			}
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			decode(job, true);
+			double ms = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+			lock_guard<mutex> lock(m_mutex);
+			m_decodeMs += ms;
+			m_decoded.push_back(move(job));
+		}
+	}
+
+	string m_folder;
+	GLint m_maxSize;
+	bool m_dxt;		// DXT textures, the cache on
+	map<string, GLuint> m_names;	// GL thread only
+	map<GLuint, STexture> m_textures;	// GL thread only
+	size_t m_residentBytes, m_wantedBytes, m_incomingBytes;
+	unsigned int m_frame;		// of manage()
+	int m_pending;
+	atomic<int> m_idle;		// loaders waiting for a job
+	double m_decodeMs;
+	vector<thread> m_threads;
+	mutex m_mutex;
+	condition_variable m_wake, m_slotFreed;
+	bool m_stop;
+	deque<SJob> m_jobs;		// to decode
+	deque<SJob> m_decoded;	// to upload
+	vector<SSlot> m_slots;	// staging buffers
+};
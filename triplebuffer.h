@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+
+using namespace std;
+
+// lock-free triple buffer: one writer thread and one reader thread pass
+// whole values of T. The writer fills back() and publishes it; the reader
+// always gets the latest published value, never a half written one, and
+// neither side ever waits for the other. The slot in the middle and a
+// fresh bit are swapped atomically, the other two slots belong to one side
+template <class T>
+class CTripleBuffer
+{
+public:
+	CTripleBuffer()
+	{
+		m_back = 0;
+		m_middle = 1;
+		m_front = 2;
+	}
+
+	// the slot the writer fills
+	T &back()
+	{
+		return m_slots[m_back];
+	}
+
+	// makes back() the latest value and gives the writer another slot
+	void publish()
+	{
+		unsigned int old = m_middle.exchange(m_back | FRESH, memory_order_acq_rel);
+		m_back = old & INDEX;
+	}
+
+	// the latest published value (the previous one when nothing new came)
+	const T &read()
+	{
+		if (m_middle.load(memory_order_relaxed) & FRESH)
+		{
+			unsigned int old = m_middle.exchange(m_front, memory_order_acq_rel);
+			m_front = old & INDEX;
+		}
+		return m_slots[m_front];
+	}
+
+private:
+	enum { INDEX = 3, FRESH = 4 };
+
+	T m_slots[3];
+	unsigned int m_back;	// writer only
+	unsigned int m_front;	// reader only
+	atomic<unsigned int> m_middle;
+};
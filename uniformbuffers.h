@@ -0,0 +1,188 @@
+#pragma once
+
+#include <vector>
+#include <string.h>
+#include "gl/glew.h"
+#include "glm/glm.hpp"
+
+using namespace std;
+
+// uniform block binding points shared by every GL 3.3+ program
+#define UBO_FRAME 0
+#define UBO_MATERIALS 1
+#define UBO_DRAW 2
+#define UBO_SHADOWS 3
+
+// size of the material array in the Materials block (64 bytes each, so the
+// block stays inside the 16KB guaranteed by GL_MAX_UNIFORM_BLOCK_SIZE)
+#define MAX_UBO_MATERIALS 256
+
+// the Frame block (std140): camera of the frame
+typedef struct SFrameBlock
+{
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::mat4 viewProjection;
+	glm::vec4 clusterParams;	// see CClusteredLights::params
+} SFrameBlock;
+
+// the Draw block (std140): everything a draw needs from its object
+typedef struct SDrawBlock
+{
+	glm::mat4 mvp;
+	glm::mat4 modelView;
+	glm::mat4 normalView;	// normal matrix to eye space
+	int material, pad0, pad1, pad2;
+} SDrawBlock;
+
+// ring of uniform blocks, one block per draw. With OpenGL 4.4 (or
+// ARB_buffer_storage) the buffer is persistently mapped and blocks are
+// written in place; otherwise they are written to a staging copy and
+// uploaded with a single glBufferSubData. Each frame writes its own
+// section of the ring, guarded by a fence so the CPU never overwrites
+// blocks the GPU has not consumed yet
+class CUniformRing
+{
+public:
+	enum { SECTIONS = 3 };
+
+	CUniformRing()
+	{
+		m_buffer = 0;
+		m_mapped = NULL;
+		m_persistent = false;
+		m_capacity = m_stride = m_blockSize = 0;
+		m_section = 0;
+		m_count = 0;
+		for (int i = 0; i < SECTIONS; i++)
+			m_fences[i] = 0;
+	}
+
+	// blockSize is rounded up to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+	void create(GLuint blockSize, GLuint blocksPerFrame)
+	{
+		GLint align = 256;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+		m_blockSize = blockSize;
+		m_stride = (blockSize + align - 1) / align * align;
+		m_capacity = blocksPerFrame;
+		m_persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+
+		GLsizeiptr size = (GLsizeiptr)m_stride * m_capacity * SECTIONS;
+		glGenBuffers(1, &m_buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+		if (m_persistent)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_UNIFORM_BUFFER, size, NULL, flags);
+			m_mapped = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, size, flags);
+		}
+		else
+		{
+			glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_STREAM_DRAW);
+			m_staging.resize(m_stride * m_capacity);
+		}
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	void destroy()
+	{
+		if (!m_buffer)
+			return;
+		for (int i = 0; i < SECTIONS; i++)
+		{
+			if (m_fences[i])
+				glDeleteSync(m_fences[i]);
+			m_fences[i] = 0;
+		}
+		if (m_mapped)
+		{
+			glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+			glUnmapBuffer(GL_UNIFORM_BUFFER);
+			glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		}
+		glDeleteBuffers(1, &m_buffer);
+		m_buffer = 0;
+		m_mapped = NULL;
+	}
+
+	// starts the next section for count blocks, growing the ring if needed
+	void begin(GLuint count)
+	{
+		if (count > m_capacity)
+		{
+			glFinish();
+			GLuint blockSize = m_blockSize;
+			destroy();
+			create(blockSize, glm::max(count, m_capacity * 2));
+		}
+		m_section = (m_section + 1) % SECTIONS;
+		if (m_fences[m_section])
+		{
+			// the GPU is normally done with it: the section was used 2 frames ago
+			while (glClientWaitSync(m_fences[m_section], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+			glDeleteSync(m_fences[m_section]);
+			m_fences[m_section] = 0;
+		}
+		m_count = count;
+	}
+
+	// where to write block i of the current section
+	void *block(GLuint i)
+	{
+		if (m_persistent)
+			return m_mapped + offset(i);
+		return &m_staging[i * m_stride];
+	}
+
+	// makes the written blocks visible to the GPU
+	void commit()
+	{
+		if (m_persistent || !m_count)
+			return;
+		glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, offset(0), m_count * m_stride, m_staging.data());
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	// binds block i to a uniform block binding point
+	void bind(GLuint binding, GLuint i)
+	{
+		glBindBufferRange(GL_UNIFORM_BUFFER, binding, m_buffer, offset(i), m_blockSize);
+	}
+
+	// every draw using the section has been issued
+	void end()
+	{
+		m_fences[m_section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	GLuint offset(GLuint i)
+	{
+		return (m_section * m_capacity + i) * m_stride;
+	}
+
+	bool m_persistent;
+
+private:
+	GLuint m_buffer;
+	unsigned char *m_mapped;
+	vector<unsigned char> m_staging;
+	GLuint m_capacity, m_stride, m_blockSize;
+	int m_section;
+	GLuint m_count;
+	GLsync m_fences[SECTIONS];
+};
+
+// connects the uniform blocks of a GLSL 3.30 program to the binding points
+inline void bindUniformBlocks(GLuint p)
+{
+	const char *names[4] = { "Frame", "Materials", "Draw", "Shadows" };
+	GLuint bindings[4] = { UBO_FRAME, UBO_MATERIALS, UBO_DRAW, UBO_SHADOWS };
+	for (int i = 0; i < 4; i++)
+	{
+		GLuint index = glGetUniformBlockIndex(p, names[i]);
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(p, index, bindings[i]);
+	}
+}
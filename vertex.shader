@@ -1,23 +1,41 @@
 #version 330 core
+// permutations, see CShaderCache: TEXTURED, NORMALS, SPECULAR, DEPTH_ONLY
 
 layout (location = 0) in vec3 inPosition;
 layout (location = 1) in vec3 inNormal;
 layout (location = 2) in vec2 inTex;
 
+out vec4 outPosition;
+flat out int outMaterial;
+// the depth pre-pass and the GL_EQUAL color pass must agree on depth
+invariant gl_Position;
+#ifdef TEXTURED
 out vec2 outTex;
+#endif
+#ifdef NORMALS
 out vec3 outNormal;
-out vec4 outPosition;
+#endif
 
-uniform mat4 model;
-uniform mat4 normalMat;
-uniform mat4 view;
-uniform mat4 projection;
+// written per draw by the CPU, see SDrawBlock
+layout (std140) uniform Draw
+{
+	mat4 mvp;
+	mat4 modelView;
+	mat4 normalView;
+	ivec4 drawInfo;		// material id
+};
 
 void main()
 {
-	mat4 modelView = view * model;
-    gl_Position = projection * modelView * vec4(inPosition, 1.0f);
-	outNormal = normalize((view * normalMat * vec4(inNormal, 0.0)).xyz);
-	outPosition   = modelView * vec4(inPosition, 1.0);
-    outTex = inTex;
-}
\ No newline at end of file
+	gl_Position = mvp * vec4(inPosition, 1.0);
+#ifndef DEPTH_ONLY
+	outPosition = modelView * vec4(inPosition, 1.0);
+	outMaterial = drawInfo.x;
+#ifdef NORMALS
+	outNormal = normalize(mat3(normalView) * inNormal);
+#endif
+#ifdef TEXTURED
+	outTex = inTex;
+#endif
+#endif
+}
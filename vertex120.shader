@@ -1,4 +1,5 @@
 #version 120
+// permutations, see CShaderCache: TEXTURED, NORMALS, SPECULAR, DEPTH_ONLY
 uniform mat4 model;
 uniform mat4 normalMat;
 uniform mat4 view;
@@ -8,14 +9,26 @@ attribute vec3 inPosition;
 attribute vec3 inNormal;
 attribute vec2 inTex;
 
+varying vec4 outPosition;
+// the depth pre-pass and the GL_EQUAL color pass must agree on depth
+invariant gl_Position;
+#ifdef TEXTURED
 varying vec2 outTex;
+#endif
+#ifdef NORMALS
 varying vec3 outNormal;
-varying vec4 outPosition;
+#endif
 void main(void)
 {
 	mat4 modelView = view * model;
 	gl_Position = projection * modelView * vec4(inPosition, 1.0f);
-	outNormal = normalize((view * normalMat * vec4(inNormal, 0.0)).xyz);
+#ifndef DEPTH_ONLY
 	outPosition = modelView * vec4(inPosition, 1.0);
+#ifdef NORMALS
+	outNormal = normalize((view * normalMat * vec4(inNormal, 0.0)).xyz);
+#endif
+#ifdef TEXTURED
 	outTex = inTex;
+#endif
+#endif
 }
\ No newline at end of file
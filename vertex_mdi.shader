@@ -0,0 +1,44 @@
+#version 430 core
+
+layout (location = 0) in vec3 inPosition;
+layout (location = 1) in vec3 inNormal;
+layout (location = 2) in vec2 inTex;
+layout (location = 3) in uint inDrawId;	// instanced, offset by baseInstance
+
+struct DrawRecord
+{
+	vec4 bmin;
+	vec4 bmax;
+	uvec4 info;		// transform index, material index, has normal
+	uvec4 range;	// count, first index, base vertex
+};
+
+layout (std430, binding = 0) readonly buffer Draws { DrawRecord draws[]; };
+layout (std430, binding = 1) readonly buffer Transforms { mat4 transforms[]; };	// model, normalMat per object
+
+out vec2 outTex;
+out vec3 outNormal;
+out vec4 outPosition;
+flat out uint outMaterial;
+flat out uint outHasNormal;
+
+layout (std140, binding = 0) uniform Frame
+{
+	mat4 view;
+	mat4 projection;
+	mat4 viewProjection;
+};
+
+void main()
+{
+	DrawRecord d = draws[inDrawId];
+	mat4 model = transforms[2 * d.info.x];
+	mat4 normalMat = transforms[2 * d.info.x + 1];
+	vec4 world = model * vec4(inPosition, 1.0);
+	gl_Position = viewProjection * world;
+	outNormal = normalize((view * normalMat * vec4(inNormal, 0.0)).xyz);
+	outPosition = view * world;
+	outTex = inTex;
+	outMaterial = d.info.y;
+	outHasNormal = d.info.z;
+}
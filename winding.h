@@ -0,0 +1,220 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include "glm/glm.hpp"
+
+using namespace std;
+
+// winding analysis of a triangle soup (positions xyz, non indexed), done at
+// load time to know where back faces can be culled. Vertices are welded by
+// exact position, then the triangles are split in edge-connected shells.
+// A shell is closed when every edge is shared by exactly two triangles;
+// the triangles of a closed shell are made to wind the same way (each
+// shared edge walked once in each direction) and then counter-clockwise
+// seen from outside, using the sign of the enclosed volume. Back faces of
+// a closed, oriented shell are never visible from outside, so they can be
+// culled; open or non-manifold shells (single sided walls, cracks, fins)
+// can show their back and are left alone
+class CWinding
+{
+public:
+	CWinding()
+	{
+		m_shells = m_closedShells = m_flippedShells = 0;
+	}
+
+	void analyze(const float *pos, int n)
+	{
+		int triangles = n / 3;
+		vector<int> id;
+		weld(pos, triangles * 3, id);
+
+		// every edge of every non degenerate triangle, sorted so the uses of
+		// an edge are together. forward: walked from the lower id
+		vector<SEdge> edges;
+		edges.reserve(triangles * 3);
+		m_degenerate.assign(triangles, false);
+		for (int t = 0; t < triangles; t++)
+		{
+			int a = id[3 * t], b = id[3 * t + 1], c = id[3 * t + 2];
+			if (a == b || b == c || a == c)
+			{
+				m_degenerate[t] = true;
+				continue;
+			}
+			addEdge(edges, a, b, t);
+			addEdge(edges, b, c, t);
+			addEdge(edges, c, a, t);
+		}
+		sort(edges.begin(), edges.end());
+
+		// neighbours across the edges shared by exactly two triangles,
+		// -1 on a border or a non manifold edge
+		vector<int> neighbour(triangles * 3, -1);
+		vector<char> sameDirection(triangles * 3, 0);
+		vector<int> slots(triangles, 0);
+		vector<bool> open(triangles, false);
+		for (int i = 0; i < edges.size();)
+		{
+			int j = i + 1;
+			while (j < edges.size() && edges[j].m_a == edges[i].m_a && edges[j].m_b == edges[i].m_b)
+				j++;
+			if (j - i == 2)
+			{
+				const SEdge &e0 = edges[i], &e1 = edges[i + 1];
+				int s0 = 3 * e0.m_triangle + slots[e0.m_triangle]++;
+				int s1 = 3 * e1.m_triangle + slots[e1.m_triangle]++;
+				neighbour[s0] = e1.m_triangle;
+				neighbour[s1] = e0.m_triangle;
+				sameDirection[s0] = sameDirection[s1] = e0.m_forward == e1.m_forward;
+			}
+			else
+			{
+				for (int k = i; k < j; k++)
+					open[edges[k].m_triangle] = true;
+			}
+			i = j;
+		}
+
+		// flood each shell, flipping triangles to agree with their neighbours
+		m_flipped.assign(triangles, false);
+		m_closed.assign(triangles, false);
+		vector<int> shell(triangles, -1), members, stack;
+		for (int s = 0; s < triangles; s++)
+		{
+			if (m_degenerate[s] || shell[s] >= 0)
+				continue;
+			bool closed = true;
+			members.clear();
+			stack.push_back(s);
+			shell[s] = m_shells;
+			while (!stack.empty())
+			{
+				int t = stack.back();
+				stack.pop_back();
+				members.push_back(t);
+				closed = closed && !open[t];
+				for (int k = 0; k < slots[t]; k++)
+				{
+					int o = neighbour[3 * t + k];
+					// walked the same way, the neighbour must wind the other way
+					bool flip = m_flipped[t] != (sameDirection[3 * t + k] != 0);
+					if (shell[o] < 0)
+					{
+						shell[o] = m_shells;
+						m_flipped[o] = flip;
+						stack.push_back(o);
+					}
+					else if (m_flipped[o] != flip)
+						closed = false;	// not orientable
+				}
+			}
+			m_shells++;
+			if (!closed)
+			{
+				// open shells keep the winding of the file
+				for (int i = 0; i < members.size(); i++)
+					m_flipped[members[i]] = false;
+				continue;
+			}
+
+			// six times the enclosed volume, negative when inside out
+			double volume = 0.0;
+			for (int i = 0; i < members.size(); i++)
+			{
+				int t = members[i];
+				glm::dvec3 p0 = vertex(pos, 3 * t), p1 = vertex(pos, 3 * t + 1), p2 = vertex(pos, 3 * t + 2);
+				double v = glm::dot(p0, glm::cross(p1, p2));
+				volume += m_flipped[t] ? -v : v;
+			}
+			bool inverted = volume < 0.0;
+			if (inverted)
+				m_flippedShells++;
+			for (int i = 0; i < members.size(); i++)
+			{
+				m_closed[members[i]] = true;
+				m_flipped[members[i]] = m_flipped[members[i]] != inverted;
+			}
+			m_closedShells++;
+		}
+	}
+
+	// triangle t must swap two vertices to face outwards
+	bool flipped(int t)
+	{
+		return m_flipped[t];
+	}
+
+	// triangle t belongs to a closed shell (degenerate ones never show)
+	bool cullable(int t)
+	{
+		return m_closed[t] || m_degenerate[t];
+	}
+
+	int m_shells, m_closedShells, m_flippedShells;
+
+private:
+	typedef struct SEdge
+	{
+		int m_a, m_b;	// vertex ids, m_a < m_b
+		int m_triangle;
+		bool m_forward;
+
+		bool operator < (const SEdge &e) const
+		{
+			if (m_a != e.m_a) return m_a < e.m_a;
+			if (m_b != e.m_b) return m_b < e.m_b;
+			return m_triangle < e.m_triangle;
+		}
+	} SEdge;
+
+	static void addEdge(vector<SEdge> &edges, int a, int b, int t)
+	{
+		SEdge e;
+		e.m_a = min(a, b);
+		e.m_b = max(a, b);
+		e.m_triangle = t;
+		e.m_forward = a < b;
+		edges.push_back(e);
+	}
+
+	static glm::dvec3 vertex(const float *pos, int i)
+	{
+		return glm::dvec3(pos[3 * i], pos[3 * i + 1], pos[3 * i + 2]);
+	}
+
+	// id[i]: the same for every vertex at the position of vertex i
+	static void weld(const float *pos, int n, vector<int> &id)
+	{
+		vector<int> order(n);
+		for (int i = 0; i < n; i++)
+			order[i] = i;
+		sort(order.begin(), order.end(), SPositionLess(pos));
+		id.resize(n);
+		int next = -1;
+		for (int i = 0; i < n; i++)
+		{
+			if (i == 0 || SPositionLess(pos)(order[i - 1], order[i]))
+				next++;
+			id[order[i]] = next;
+		}
+	}
+
+	typedef struct SPositionLess
+	{
+		const float *m_pos;
+
+		SPositionLess(const float *pos) : m_pos(pos) {}
+
+		bool operator () (int a, int b) const
+		{
+			const float *p = m_pos + 3 * a, *q = m_pos + 3 * b;
+			if (p[0] != q[0]) return p[0] < q[0];
+			if (p[1] != q[1]) return p[1] < q[1];
+			return p[2] < q[2];
+		}
+	} SPositionLess;
+
+	vector<bool> m_flipped, m_closed, m_degenerate;
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+// worker threads for the data parallel parts of a frame. run(n, f) calls
+// f(task, worker) for every task 0..n-1, spread over the workers and the
+// calling thread (worker 0), and returns when all of them are done. Tasks
+// are taken one by one from a shared counter, so uneven tasks balance
+// themselves. The workers sleep on a condition variable between runs.
+// A worker joins a run under the mutex and is counted until it leaves
+// work(); run() waits for that count to be 0 before it sets up the next
+// run and before it returns, so a worker late from one run never takes a
+// task index (or calls the job) of another
+class CWorkerPool
+{
+public:
+	CWorkerPool()
+	{
+		m_stop = false;
+		m_generation = 0;
+		m_job = NULL;
+		m_tasks = m_next = m_done = 0;
+		m_active = 1;
+		m_working = 0;
+	}
+
+	~CWorkerPool()
+	{
+		stop();
+	}
+
+	// threads: workers besides the calling thread
+	void start(int threads)
+	{
+		for (int i = 0; i < threads; i++)
+			m_threads.push_back(thread(&CWorkerPool::loop, this, i + 1));
+		m_active = size();
+	}
+
+	void stop()
+	{
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (int i = 0; i < m_threads.size(); i++)
+			m_threads[i].join();
+		m_threads.clear();
+	}
+
+	// threads that can work, the calling one included
+	int size()
+	{
+		return (int)m_threads.size() + 1;
+	}
+
+	// only workers 0..n-1 take tasks (to measure the scaling)
+	void setActive(int n)
+	{
+		m_active = max(1, min(n, size()));
+	}
+
+	int active()
+	{
+		return m_active;
+	}
+
+	void run(int tasks, const function<void(int, int)> &f)
+	{
+		if (tasks <= 0)
+			return;
+		if (m_active == 1 || tasks == 1)
+		{
+			for (int i = 0; i < tasks; i++)
+				f(i, 0);
+			return;
+		}
+		{
+			unique_lock<mutex> lock(m_mutex);
+			m_finished.wait(lock, [&] { return m_working == 0; });
+			m_job = &f;
+			m_done = 0;
+			m_tasks = tasks;
+			m_next = 0;
+			m_generation++;
+		}
+		m_wake.notify_all();
+		work(0);
+		unique_lock<mutex> lock(m_mutex);
+		m_finished.wait(lock, [&] { return m_done == m_tasks && m_working == 0; });
+	}
+
+private:
+	// takes tasks until there are none left
+	void work(int worker)
+	{
+		if (worker >= m_active)
+			return;
+		int t;
+		while ((t = m_next++) < m_tasks)
+		{
+			(*m_job)(t, worker);
+			if (++m_done == m_tasks)
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_finished.notify_one();
+			}
+		}
+	}
+
+	void loop(int worker)
+	{
+		unsigned int generation = 0;
+		for (;;)
+		{
+			{
+				unique_lock<mutex> lock(m_mutex);
+				m_wake.wait(lock, [&] { return m_stop || m_generation != generation; });
+				if (m_stop)
+					return;
+				generation = m_generation;
+				m_working++;
+			}
+			work(worker);
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_working--;
+			}
+			m_finished.notify_one();
+		}
+	}
+
+	vector<thread> m_threads;
+	mutex m_mutex;
+	condition_variable m_wake, m_finished;
+	bool m_stop;
+	unsigned int m_generation;	// one per run
+	const function<void(int, int)> *m_job;
+	atomic<int> m_tasks, m_next, m_done;
+	atomic<int> m_active;
+	int m_working;		// workers in work(), under m_mutex
+};